@@ -0,0 +1,462 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * crust-bench times the hot paths of the state and messaging modules on a layout loaded from an init file, usually one
+ * written by crust-generate. Each benchmark is run for a number of rounds of at least a minimum time each. The median
+ * and fastest rounds are reported in nanoseconds per operation, along with the heap allocations made and bytes requested per operation.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link time (see src/CMakeLists.txt), so only calls
+ * made from CRUST's own code are seen. Where the linker can't wrap them the counts are left out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "core.h"
+#include "image.h"
+#include "state.h"
+#include "messaging.h"
+#include "config.h"
+#include "terminal.h"
+
+#define CRUST_BENCH struct crustBench
+#define CRUST_BENCH_LINES struct crustBenchLines
+
+// Runs a benchmark once, adding the time spent on the measured operations to elapsed and returning how many were made.
+typedef size_t (*crustBenchFunction)(CRUST_STATE * state, long long * elapsed);
+
+struct crustBench {
+    const char * name;
+    crustBenchFunction function;
+};
+
+struct crustBenchLines {
+    char ** lines;
+    size_t count;
+};
+
+unsigned long long benchAllocations = 0;
+unsigned long long benchAllocatedBytes = 0;
+
+#ifdef CRUST_BENCH_COUNT_ALLOCATIONS
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * pointer, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+    benchAllocations++;
+    benchAllocatedBytes += size;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size)
+{
+    benchAllocations++;
+    benchAllocatedBytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * pointer, size_t size)
+{
+    benchAllocations++;
+    benchAllocatedBytes += size;
+    return __real_realloc(pointer, size);
+}
+#endif
+
+CRUST_BENCH_LINES benchBlockLines = {NULL, 0}; // The IB commands from the init file, without the opcode
+CRUST_BENCH_LINES benchTrackCircuitLines = {NULL, 0}; // The IC commands
+CRUST_SESSION benchSession;
+CRUST_CORE * benchCore;
+
+void crust_bench_lines_add(CRUST_BENCH_LINES * lines, const char * line)
+{
+    lines->lines = realloc(lines->lines, sizeof(char *) * (lines->count + 1));
+    if(lines->lines == NULL || (lines->lines[lines->count] = strdup(line)) == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    lines->count++;
+}
+
+// Keeps the insert commands from the init file to be interpreted again by the benchmarks.
+void crust_bench_read_lines(const char * path)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH];
+
+    FILE * initFile = fopen(path, "r");
+    if(initFile == NULL)
+    {
+        crust_terminal_print("Failed to open the init file.");
+        exit(EXIT_FAILURE);
+    }
+    while(fgets(line, CRUST_MAX_MESSAGE_LENGTH, initFile) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == 'I' && line[1] == 'B')
+        {
+            crust_bench_lines_add(&benchBlockLines, &line[2]);
+        }
+        else if(line[0] == 'I' && line[1] == 'C')
+        {
+            crust_bench_lines_add(&benchTrackCircuitLines, &line[2]);
+        }
+    }
+    fclose(initFile);
+}
+
+size_t crust_bench_interpret_block(CRUST_STATE * state, long long * elapsed)
+{
+    CRUST_BLOCK * block;
+
+    long long start = crust_metrics_nanoseconds();
+    for(size_t i = 0; i < benchBlockLines.count; i++)
+    {
+        crust_block_init(&block, state);
+        crust_interpret_block(benchBlockLines.lines[i], block, state);
+        free(block->blockName);
+        free(block);
+    }
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return benchBlockLines.count;
+}
+
+size_t crust_bench_interpret_track_circuit(CRUST_STATE * state, long long * elapsed)
+{
+    CRUST_TRACK_CIRCUIT * trackCircuit;
+
+    long long start = crust_metrics_nanoseconds();
+    for(size_t i = 0; i < benchTrackCircuitLines.count; i++)
+    {
+        crust_track_circuit_init(&trackCircuit, state);
+        crust_interpret_track_circuit(benchTrackCircuitLines.lines[i], trackCircuit, state);
+        free(trackCircuit->blocks);
+        free(trackCircuit);
+    }
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return benchTrackCircuitLines.count;
+}
+
+size_t crust_bench_print_block(CRUST_STATE * state, long long * elapsed)
+{
+    char * buffer;
+
+    long long start = crust_metrics_nanoseconds();
+    for(unsigned int i = 0; i < state->blockIndexPointer; i++)
+    {
+        crust_print_block(state->blockIndex[i], &buffer, state);
+        free(buffer);
+    }
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return state->blockIndexPointer;
+}
+
+size_t crust_bench_print_state(CRUST_STATE * state, long long * elapsed)
+{
+    char * buffer;
+
+    // Change the state each time so that the snapshot behind the print can't simply be reused
+    state->generation++;
+
+    long long start = crust_metrics_nanoseconds();
+    crust_print_state(state, &buffer);
+    *elapsed += crust_metrics_nanoseconds() - start;
+    free(buffer);
+
+    return 1;
+}
+
+size_t crust_bench_set_occupation(CRUST_STATE * state, long long * elapsed)
+{
+    long long start = crust_metrics_nanoseconds();
+    for(unsigned int i = 0; i < state->trackCircuitIndexPointer; i++)
+    {
+        CRUST_TRACK_CIRCUIT * trackCircuit = state->trackCircuitIndex[i];
+        crust_track_circuit_set_occupation(trackCircuit,
+                                           !crust_track_circuit_is_occupied(trackCircuit, state),
+                                           state,
+                                           &benchSession);
+    }
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return state->trackCircuitIndexPointer;
+}
+
+/*
+ * Runs a train along every track circuit in turn: each circuit is occupied, the headcodes are advanced into it, then
+ * it is cleared again behind the train. Only the advance is timed.
+ */
+size_t crust_bench_auto_advance(CRUST_STATE * state, long long * elapsed)
+{
+    CRUST_BLOCK ** affectedBlocks = NULL;
+
+    for(unsigned int i = 0; i < state->trackCircuitIndexPointer; i++)
+    {
+        CRUST_TRACK_CIRCUIT * trackCircuit = state->trackCircuitIndex[i];
+        crust_track_circuit_set_occupation(trackCircuit, true, state, &benchSession);
+
+        long long start = crust_metrics_nanoseconds();
+        if(crust_headcode_auto_advance(trackCircuit, &affectedBlocks, state))
+        {
+            free(affectedBlocks);
+            affectedBlocks = NULL;
+        }
+        *elapsed += crust_metrics_nanoseconds() - start;
+
+        if(i)
+        {
+            crust_track_circuit_set_occupation(state->trackCircuitIndex[i - 1], false, state, &benchSession);
+        }
+    }
+    if(state->trackCircuitIndexPointer)
+    {
+        crust_track_circuit_set_occupation(state->trackCircuitIndex[state->trackCircuitIndexPointer - 1],
+                                           false,
+                                           state,
+                                           &benchSession);
+    }
+
+    return state->trackCircuitIndexPointer;
+}
+
+size_t crust_bench_remap_berths_around(CRUST_STATE * state, long long * elapsed)
+{
+    long long start = crust_metrics_nanoseconds();
+    for(unsigned int i = 0; i < state->blockIndexPointer; i++)
+    {
+        crust_remap_berths_around(state->blockIndex[i], state);
+    }
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return state->blockIndexPointer;
+}
+
+size_t crust_bench_compile_path_circuits(CRUST_STATE * state, long long * elapsed)
+{
+    long long start = crust_metrics_nanoseconds();
+    crust_compile_path_circuits(state);
+    *elapsed += crust_metrics_nanoseconds() - start;
+
+    return 1;
+}
+
+const CRUST_BENCH benchmarks[] = {
+        {"crust_interpret_block", crust_bench_interpret_block},
+        {"crust_interpret_track_circuit", crust_bench_interpret_track_circuit},
+        {"crust_print_block", crust_bench_print_block},
+        {"crust_print_state", crust_bench_print_state},
+        {"crust_track_circuit_set_occupation", crust_bench_set_occupation},
+        {"crust_headcode_auto_advance", crust_bench_auto_advance},
+        {"crust_remap_berths_around", crust_bench_remap_berths_around},
+        {"crust_compile_path_circuits", crust_bench_compile_path_circuits}
+};
+
+int crust_bench_compare_results(const void * a, const void * b)
+{
+    double resultA = *(const double *)a;
+    double resultB = *(const double *)b;
+    return (resultA > resultB) - (resultA < resultB);
+}
+
+// Interposes a headcode on every other berth so that there is something for the auto advance to move.
+void crust_bench_interpose_headcodes(CRUST_STATE * state)
+{
+    unsigned int berths = 0;
+    for(unsigned int i = 0; i < state->blockIndexPointer; i++)
+    {
+        if(state->blockIndex[i]->berth && berths++ % 2 == 0)
+        {
+            crust_interpose(state->blockIndex[i], "1A00", state);
+        }
+    }
+}
+
+/*
+ * Builds the layout from the image named by -b, or from the commands in the file named by -c if there is no image.
+ * Exits if the layout can't be loaded.
+ */
+void crust_bench_load_layout()
+{
+    if(crustOptionLayoutImagePath[0] != '\0')
+    {
+        if(crust_image_load(benchCore->state, crustOptionLayoutImagePath, NULL))
+        {
+            crust_terminal_print("Failed to load the layout image.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(crustOptionDaemonConfigFilePath[0] != '\0')
+    {
+        switch(crust_core_read_config(benchCore, crustOptionDaemonConfigFilePath))
+        {
+            case 0:
+                break;
+
+            case 1:
+                crust_terminal_print("Failed to open the init file.");
+                exit(EXIT_FAILURE);
+
+            default:
+                crust_terminal_print("Invalid init file.");
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned long rounds = 5;
+    unsigned long roundTime = 200; // Milliseconds
+    const char * filter = NULL;
+    char * endPointer;
+
+    int option;
+    while((option = getopt(argc, argv, "b:c:f:hr:t:")) != -1)
+    {
+        switch(option)
+        {
+            case 'b':
+                strncpy(crustOptionLayoutImagePath, optarg, PATH_MAX);
+                crustOptionLayoutImagePath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'c':
+                strncpy(crustOptionDaemonConfigFilePath, optarg, PATH_MAX);
+                crustOptionDaemonConfigFilePath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'f':
+                filter = optarg;
+                break;
+
+            case 'h':
+                crust_terminal_print("Usage: crust-bench [options] -c init_file");
+                crust_terminal_print("  -b  Load the layout from the named image compiled with crust -k.");
+                crust_terminal_print("  -c  Build the layout from the named init file, such as one written by "
+                                     "crust-generate.");
+                crust_terminal_print("  -f  Only run the benchmarks with names containing this text.");
+                crust_terminal_print("  -h  Display this help.");
+                crust_terminal_print("  -r  Number of rounds to run each benchmark for (defaults to 5)");
+                crust_terminal_print("  -t  Minimum length of each round in milliseconds (defaults to 200)");
+                exit(EXIT_SUCCESS);
+
+            case 'r':
+                rounds = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || !rounds)
+                {
+                    crust_terminal_print("Invalid number of rounds specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                roundTime = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0')
+                {
+                    crust_terminal_print("Invalid round time specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case '?':
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(crustOptionDaemonConfigFilePath[0] == '\0')
+    {
+        crust_terminal_print("An init file must be specified with -c.");
+        exit(EXIT_FAILURE);
+    }
+
+    crust_core_init(&benchCore);
+    crust_bench_load_layout();
+    CRUST_STATE * state = benchCore->state;
+    crust_compile_path_circuits(state);
+    crust_bench_read_lines(crustOptionDaemonConfigFilePath);
+    crust_core_session_init(benchCore, &benchSession);
+    crust_bench_interpose_headcodes(state);
+
+    printf("Layout: %u blocks, %u track circuits\n", state->blockIndexPointer, state->trackCircuitIndexPointer);
+    printf("%-36s %12s %12s %12s %12s\n", "Benchmark", "ns/op", "fastest", "allocs/op", "bytes/op");
+
+    double * results = malloc(sizeof(double) * rounds);
+    if(results == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t b = 0; b < sizeof(benchmarks) / sizeof(CRUST_BENCH); b++)
+    {
+        if(filter != NULL && strstr(benchmarks[b].name, filter) == NULL)
+        {
+            continue;
+        }
+
+        // One run to warm the caches and settle the arenas before anything is measured
+        long long elapsed = 0;
+        benchmarks[b].function(state, &elapsed);
+
+        unsigned long long allocations = 0;
+        unsigned long long allocatedBytes = 0;
+        unsigned long long totalOperations = 0;
+        for(unsigned long r = 0; r < rounds; r++)
+        {
+            unsigned long long operations = 0;
+            long long roundStart = crust_metrics_nanoseconds();
+            elapsed = 0;
+
+            unsigned long long allocationsBefore = benchAllocations;
+            unsigned long long bytesBefore = benchAllocatedBytes;
+            do
+            {
+                operations += benchmarks[b].function(state, &elapsed);
+            } while(crust_metrics_nanoseconds() - roundStart < (long long)roundTime * 1000000);
+            allocations += benchAllocations - allocationsBefore;
+            allocatedBytes += benchAllocatedBytes - bytesBefore;
+            totalOperations += operations;
+
+            results[r] = operations ? (double)elapsed / (double)operations : 0;
+        }
+        qsort(results, rounds, sizeof(double), crust_bench_compare_results);
+
+#ifdef CRUST_BENCH_COUNT_ALLOCATIONS
+        printf("%-36s %12.1f %12.1f %12.2f %12.1f\n",
+               benchmarks[b].name,
+               results[rounds / 2],
+               results[0],
+               totalOperations ? (double)allocations / (double)totalOperations : 0,
+               totalOperations ? (double)allocatedBytes / (double)totalOperations : 0);
+#else
+        printf("%-36s %12.1f %12.1f %12s %12s\n", benchmarks[b].name, results[rounds / 2], results[0], "-", "-");
+#endif
+    }
+
+    return EXIT_SUCCESS;
+}
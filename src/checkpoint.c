@@ -0,0 +1,367 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "terminal.h"
+#include "thread.h"
+#include "journal.h"
+
+size_t crust_checkpoint_length(u_int32_t numBlocks, u_int32_t numTrackCircuits)
+{
+    return sizeof(CRUST_CHECKPOINT_HEADER)
+        + sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(numTrackCircuits) * 2
+        + numBlocks
+        + (size_t)numBlocks * CRUST_HEADCODE_LENGTH;
+}
+
+/*
+ * Hashes what identifies a layout: the name, links and track circuit of every block in ID order. Berths are left out
+ * as they can be enabled at runtime and are restored from the checkpoint itself.
+ */
+u_int64_t crust_checkpoint_fingerprint(CRUST_STATE * state)
+{
+    u_int64_t hash = CRUST_HASH_BASIS;
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        CRUST_BLOCK * block = state->blockIndex[i];
+        CRUST_IDENTIFIER identifiers[CRUST_MAX_LINKS + 1];
+        for(int link = 0; link < CRUST_MAX_LINKS; link++)
+        {
+            identifiers[link] = block->links[link] != NULL ? block->links[link]->blockId : CRUST_PATH_NO_PARENT;
+        }
+        identifiers[CRUST_MAX_LINKS] = block->trackCircuit != NULL ? block->trackCircuit->trackCircuitId
+                                                                   : CRUST_PATH_NO_PARENT;
+        hash = crust_hash(hash, identifiers, sizeof(identifiers));
+        if(block->blockName != NULL)
+        {
+            hash = crust_hash(hash, block->blockName, strlen(block->blockName) + 1);
+        }
+    }
+    return hash;
+}
+
+/*
+ * Copies the runtime state into a new checkpoint. This is the only part of taking a checkpoint that the daemon loop
+ * waits for.
+ */
+CRUST_CHECKPOINT * crust_checkpoint_copy(CRUST_CHECKPOINT_WRITER * writer, CRUST_STATE * state)
+{
+    CRUST_CHECKPOINT * checkpoint = malloc(sizeof(CRUST_CHECKPOINT));
+    if(checkpoint == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    checkpoint->length = crust_checkpoint_length(state->blockIndexPointer, state->trackCircuitIndexPointer);
+    checkpoint->data = malloc(checkpoint->length);
+    if(checkpoint->data == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    CRUST_CHECKPOINT_HEADER * header = (CRUST_CHECKPOINT_HEADER *)checkpoint->data;
+    memcpy(header->magic, CRUST_CHECKPOINT_MAGIC, CRUST_CHECKPOINT_MAGIC_LENGTH);
+    header->version = CRUST_CHECKPOINT_VERSION;
+    header->byteOrderMark = CRUST_CHECKPOINT_BYTE_ORDER_MARK;
+    header->numBlocks = state->blockIndexPointer;
+    header->numTrackCircuits = state->trackCircuitIndexPointer;
+    header->journalSequence = crust_journal_sequence(writer->journal);
+    // The layout rarely changes at runtime, so its fingerprint is only worked out again when it has
+    if(writer->fingerprintGeneration != state->layoutGeneration)
+    {
+        writer->layoutFingerprint = crust_checkpoint_fingerprint(state);
+        writer->fingerprintGeneration = state->layoutGeneration;
+    }
+    header->layoutFingerprint = writer->layoutFingerprint;
+
+    size_t bitsetLength = sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(state->trackCircuitIndexPointer);
+    char * position = checkpoint->data + sizeof(CRUST_CHECKPOINT_HEADER);
+    if(bitsetLength)
+    {
+        memcpy(position, state->trackCircuitOccupancy, bitsetLength);
+        memcpy(position + bitsetLength, state->trackCircuitKnown, bitsetLength);
+    }
+    position += bitsetLength * 2;
+
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        position[i] = state->blockIndex[i]->berth ? state->blockIndex[i]->berthDirection + 1 : CRUST_CHECKPOINT_NO_BERTH;
+    }
+    position += state->blockIndexPointer;
+
+    memcpy(position, state->headcodes, (size_t)state->blockIndexPointer * CRUST_HEADCODE_LENGTH);
+
+    header->bodyChecksum = crust_hash(CRUST_HASH_BASIS,
+                                      checkpoint->data + sizeof(CRUST_CHECKPOINT_HEADER),
+                                      checkpoint->length - sizeof(CRUST_CHECKPOINT_HEADER));
+
+    return checkpoint;
+}
+
+void crust_checkpoint_free(CRUST_CHECKPOINT * checkpoint)
+{
+    free(checkpoint->data);
+    free(checkpoint);
+}
+
+/*
+ * Replaces the checkpoint file with the given checkpoint. The checkpoint is written and synced beside the file then
+ * moved over it so that a crash part way through leaves the previous checkpoint in place.
+ */
+bool crust_checkpoint_file_write(CRUST_CHECKPOINT_WRITER * writer, CRUST_CHECKPOINT * checkpoint)
+{
+    char * temporaryPath;
+    bool written = false;
+
+    pthread_mutex_lock(&writer->fileLock);
+
+    asprintf(&temporaryPath, "%s.tmp", writer->path);
+    int checkpointFD = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(checkpointFD != -1)
+    {
+        size_t writtenTo = 0;
+        while(writtenTo < checkpoint->length)
+        {
+            ssize_t writeResult = write(checkpointFD, checkpoint->data + writtenTo, checkpoint->length - writtenTo);
+            if(writeResult <= 0)
+            {
+                break;
+            }
+            writtenTo += writeResult;
+        }
+        written = writtenTo == checkpoint->length && !fsync(checkpointFD);
+        written = !close(checkpointFD) && written;
+        written = written && !rename(temporaryPath, writer->path);
+        if(!written)
+        {
+            unlink(temporaryPath);
+        }
+    }
+    free(temporaryPath);
+
+    pthread_mutex_unlock(&writer->fileLock);
+
+    // The journal records the checkpoint includes are no longer needed
+    if(written)
+    {
+        crust_journal_trim(writer->journal, ((CRUST_CHECKPOINT_HEADER *)checkpoint->data)->journalSequence);
+    }
+
+    return written;
+}
+
+void * crust_checkpoint_thread(void * argument)
+{
+    CRUST_CHECKPOINT_WRITER * writer = argument;
+
+    crust_thread_block_stop_signals();
+
+    for(;;)
+    {
+        pthread_mutex_lock(&writer->pendingLock);
+        while(writer->pending == NULL)
+        {
+            pthread_cond_wait(&writer->pendingReady, &writer->pendingLock);
+        }
+        CRUST_CHECKPOINT * checkpoint = writer->pending;
+        writer->pending = NULL;
+        pthread_mutex_unlock(&writer->pendingLock);
+
+        if(!crust_checkpoint_file_write(writer, checkpoint))
+        {
+            crust_terminal_print("Failed to write checkpoint.");
+        }
+        crust_checkpoint_free(checkpoint);
+    }
+}
+
+/*
+ * Starts the thread that writes checkpoints of the state to the file at path. Checkpoints are only taken once the state
+ * has changed from how it is now. Each checkpoint includes the records queued in journal so far, and once written those
+ * records are trimmed from it.
+ */
+void crust_checkpoint_start(CRUST_CHECKPOINT_WRITER * writer,
+                            const char * path,
+                            CRUST_STATE * state,
+                            CRUST_JOURNAL * journal)
+{
+    writer->journal = journal;
+    writer->pending = NULL;
+    strncpy(writer->path, path, PATH_MAX);
+    writer->path[PATH_MAX - 1] = '\0';
+    writer->capturedGeneration = state->generation;
+    writer->layoutFingerprint = crust_checkpoint_fingerprint(state);
+    writer->fingerprintGeneration = state->layoutGeneration;
+
+    if(pthread_mutex_init(&writer->pendingLock, NULL)
+       || pthread_mutex_init(&writer->fileLock, NULL)
+       || pthread_cond_init(&writer->pendingReady, NULL)
+       || pthread_create(&writer->thread, NULL, crust_checkpoint_thread, writer)
+       || pthread_detach(writer->thread))
+    {
+        crust_terminal_print("Failed to start the checkpoint writer.");
+        exit(EXIT_FAILURE);
+    }
+
+    writer->running = true;
+}
+
+/*
+ * Hands a copy of the state to the checkpoint writer if it has changed since the last checkpoint.
+ */
+void crust_checkpoint_capture(CRUST_CHECKPOINT_WRITER * writer, CRUST_STATE * state)
+{
+    if(!writer->running || state->generation == writer->capturedGeneration)
+    {
+        return;
+    }
+
+    CRUST_CHECKPOINT * checkpoint = crust_checkpoint_copy(writer, state);
+    writer->capturedGeneration = state->generation;
+
+    pthread_mutex_lock(&writer->pendingLock);
+    if(writer->pending != NULL)
+    {
+        // The writer has fallen behind, only the newest checkpoint is worth writing
+        crust_checkpoint_free(writer->pending);
+    }
+    writer->pending = checkpoint;
+    pthread_cond_signal(&writer->pendingReady);
+    pthread_mutex_unlock(&writer->pendingLock);
+}
+
+/*
+ * Writes a checkpoint of the state straight away, for use when the daemon is shutting down. Returns false if the
+ * checkpoint could not be written.
+ */
+bool crust_checkpoint_write(CRUST_CHECKPOINT_WRITER * writer, CRUST_STATE * state)
+{
+    if(!writer->running)
+    {
+        return false;
+    }
+
+    CRUST_CHECKPOINT * checkpoint = crust_checkpoint_copy(writer, state);
+    bool written = crust_checkpoint_file_write(writer, checkpoint);
+    crust_checkpoint_free(checkpoint);
+
+    return written;
+}
+
+/*
+ * Restores the runtime state held in the checkpoint at path over the layout in state, filling journalSequence with the
+ * last journal record it includes. Track circuits are restored without an owning session, the first node to report a
+ * circuit after the restart takes ownership of it. Returns 0 on success or:
+ * 1: The checkpoint could not be opened
+ * 2: The file is not a checkpoint this version of CRUST can read
+ * 3: The checkpoint was taken from a different layout
+ * 4: The checkpoint is damaged
+ */
+int crust_checkpoint_restore(CRUST_STATE * state, const char * path, u_int64_t * journalSequence)
+{
+    CRUST_CHECKPOINT_HEADER header;
+
+    FILE * checkpointFile = fopen(path, "rb");
+    if(checkpointFile == NULL)
+    {
+        return 1;
+    }
+
+    if(fread(&header, sizeof(CRUST_CHECKPOINT_HEADER), 1, checkpointFile) != 1
+       || memcmp(header.magic, CRUST_CHECKPOINT_MAGIC, CRUST_CHECKPOINT_MAGIC_LENGTH)
+       || header.version != CRUST_CHECKPOINT_VERSION
+       || header.byteOrderMark != CRUST_CHECKPOINT_BYTE_ORDER_MARK)
+    {
+        fclose(checkpointFile);
+        return 2;
+    }
+
+    if(header.numBlocks != state->blockIndexPointer
+       || header.numTrackCircuits != state->trackCircuitIndexPointer
+       || header.layoutFingerprint != crust_checkpoint_fingerprint(state))
+    {
+        fclose(checkpointFile);
+        return 3;
+    }
+
+    size_t bodyLength = crust_checkpoint_length(header.numBlocks, header.numTrackCircuits) - sizeof(CRUST_CHECKPOINT_HEADER);
+    char * body = malloc(bodyLength);
+    if(body == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if(fread(body, 1, bodyLength, checkpointFile) != bodyLength)
+    {
+        free(body);
+        fclose(checkpointFile);
+        return 4;
+    }
+    fclose(checkpointFile);
+
+    if(header.bodyChecksum != crust_hash(CRUST_HASH_BASIS, body, bodyLength))
+    {
+        free(body);
+        return 4;
+    }
+
+    size_t bitsetLength = sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(header.numTrackCircuits);
+    const char * berths = body + bitsetLength * 2;
+    const char * headcodes = berths + header.numBlocks;
+
+    for(CRUST_IDENTIFIER i = 0; i < header.numBlocks; i++)
+    {
+        if((unsigned char)berths[i] > DOWN + 1)
+        {
+            free(body);
+            return 4;
+        }
+    }
+
+    if(bitsetLength)
+    {
+        memcpy(state->trackCircuitOccupancy, body, bitsetLength);
+        memcpy(state->trackCircuitKnown, body + bitsetLength, bitsetLength);
+    }
+
+    // Berths enabled after startup are not in the layout so they have to be enabled again before their headcodes
+    // can be restored
+    for(CRUST_IDENTIFIER i = 0; i < header.numBlocks; i++)
+    {
+        if(berths[i] != CRUST_CHECKPOINT_NO_BERTH && !state->blockIndex[i]->berth)
+        {
+            crust_enable_berth(state->blockIndex[i], berths[i] - 1, state);
+        }
+    }
+
+    memcpy(state->headcodes, headcodes, (size_t)header.numBlocks * CRUST_HEADCODE_LENGTH);
+    crust_state_all_changed(state);
+    state->generation++;
+    *journalSequence = header.journalSequence;
+
+    free(body);
+    return 0;
+}
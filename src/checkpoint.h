@@ -0,0 +1,97 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_CHECKPOINT_H
+#define CRUST_CHECKPOINT_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "state.h"
+#include "config.h"
+#include "journal.h"
+
+/*
+ * A checkpoint is a copy of the runtime state of a layout: which track circuits are occupied and known, which blocks
+ * are berths and the headcodes they hold. The daemon writes one every few seconds while the state is changing and
+ * restores from it at startup so that a restart does not lose the position of every train.
+ *
+ * A checkpoint holds no layout, only a fingerprint of the one it was taken from, and is only restored over a layout
+ * with the same fingerprint. The body is checksummed so that a damaged checkpoint is not restored.
+ */
+
+#define CRUST_CHECKPOINT_MAGIC "CRUSTCKP"
+#define CRUST_CHECKPOINT_MAGIC_LENGTH 8
+#define CRUST_CHECKPOINT_VERSION 2
+#define CRUST_CHECKPOINT_BYTE_ORDER_MARK 0x01020304
+#define CRUST_CHECKPOINT_INTERVAL 5000 // Milliseconds between checkpoints while the state is changing
+#define CRUST_CHECKPOINT_NO_BERTH 0 // Berth directions are stored plus one so that zero can mean no berth
+
+#define CRUST_CHECKPOINT_HEADER struct crustCheckpointHeader
+#define CRUST_CHECKPOINT struct crustCheckpoint
+#define CRUST_CHECKPOINT_WRITER struct crustCheckpointWriter
+
+struct crustCheckpointHeader {
+    char magic[CRUST_CHECKPOINT_MAGIC_LENGTH];
+    u_int32_t version;
+    u_int32_t byteOrderMark;
+    u_int32_t numBlocks;
+    u_int32_t numTrackCircuits;
+    u_int64_t journalSequence; // The last journal record whose change is included in the checkpoint
+    u_int64_t layoutFingerprint; // A hash of the names, links and track circuits of the blocks in the layout
+    u_int64_t bodyChecksum; // A hash of everything after the header
+};
+
+/*
+ * A checkpoint as it appears on disk: the header followed by the occupancy bitset, the known bitset, one berth byte
+ * per block and the headcodes.
+ */
+struct crustCheckpoint {
+    char * data;
+    size_t length;
+};
+
+/*
+ * Checkpoints are written to disk by a background thread so that the daemon loop only pays for copying the state.
+ * The loop leaves each new checkpoint in pending, replacing any the thread has not picked up yet. Each layout the
+ * daemon serves has a writer of its own, which must be zeroed until it is started.
+ */
+struct crustCheckpointWriter {
+    char path[PATH_MAX];
+    CRUST_JOURNAL * journal; // The journal of the same layout, trimmed after each checkpoint
+    pthread_t thread;
+    pthread_mutex_t pendingLock;
+    pthread_cond_t pendingReady;
+    CRUST_CHECKPOINT * pending;
+    pthread_mutex_t fileLock; // Held while the checkpoint file is being replaced
+    u_int64_t capturedGeneration;
+    u_int64_t layoutFingerprint; // The fingerprint of the layout as it was at fingerprintGeneration
+    u_int64_t fingerprintGeneration;
+    bool running;
+};
+
+void crust_checkpoint_start(CRUST_CHECKPOINT_WRITER * writer,
+                            const char * path,
+                            CRUST_STATE * state,
+                            CRUST_JOURNAL * journal);
+void crust_checkpoint_capture(CRUST_CHECKPOINT_WRITER * writer, CRUST_STATE * state);
+bool crust_checkpoint_write(CRUST_CHECKPOINT_WRITER * writer, CRUST_STATE * state);
+int crust_checkpoint_restore(CRUST_STATE * state, const char * path, u_int64_t * journalSequence);
+
+#endif //CRUST_CHECKPOINT_H
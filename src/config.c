@@ -34,7 +34,22 @@ gid_t crustOptionTargetGroup;
 in_port_t crustOptionPort = CRUST_DEFAULT_PORT;
 in_addr_t crustOptionIPAddress = CRUST_DEFAULT_IP_ADDRESS;
 char crustOptionDaemonConfigFilePath[PATH_MAX] = "";
+char crustOptionLayoutImagePath[PATH_MAX] = "";
+char crustOptionCheckpointPath[PATH_MAX] = "";
+char crustOptionJournalPath[PATH_MAX] = "";
+char crustOptionRecordPath[PATH_MAX] = "";
 rlim_t crustOptionConnectionLimit = 0;
+CRUST_LAYOUT_OPTION crustOptionExtraLayouts[CRUST_MAX_EXTRA_LAYOUTS];
+unsigned int crustOptionExtraLayoutCount = 0;
+unsigned int crustOptionWorkerCount = 0;
+bool crustOptionBatchUpdates = false;
+unsigned long crustOptionBatchInterval = 0;
+size_t crustOptionListenerHighWaterMark = CRUST_DEFAULT_LISTENER_HIGH_WATER_MARK;
+unsigned long crustOptionListenerLagLimit = CRUST_DEFAULT_LISTENER_LAG_LIMIT;
+char crustOptionViewName[NAME_MAX] = "";
+bool crustOptionMulticast = false;
+in_addr_t crustOptionMulticastGroup;
+in_port_t crustOptionMulticastPort;
 
 #ifdef NCURSES
 bool crustOptionWindowEnterLog = false;
@@ -45,6 +60,7 @@ char crustOptionWindowConfigFilePath[PATH_MAX];
 char crustOptionGPIOPath[PATH_MAX];
 char * crustOptionPinMapString = NULL;
 bool crustOptionInvertPinLogic = false;
+bool crustOptionSendEdgeTimes = false;
 #endif
 
 static const cyaml_config_t cyamlConfig = {
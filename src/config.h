@@ -34,19 +34,34 @@
 #define CRUST_RUN_DIRECTORY "/var/run/crust/"
 #define CRUST_SOCKET_NAME "crust.sock"
 #define CRUST_DEFAULT_SOCKET_UMASK 0117
-#define CRUST_SOCKET_QUEUE_LIMIT 4096
+#define CRUST_SOCKET_QUEUE_LIMIT 65535 // The kernel cuts this down to its own limit (net.core.somaxconn on Linux)
 #define CRUST_DEFAULT_PORT 12321
 #define CRUST_DEFAULT_IP_ADDRESS 0x100007f // 127.0.0.1
 #define CRUST_DEFAULT_CONFIG_FILE "/etc/crust.yml"
 #define CRUST_TCP_KEEPALIVE_INTERVAL 10
 #define CRUST_TCP_MAX_FAILED_KEEPALIVES 3
 #define CRUST_MAX_MESSAGE_LENGTH 256
+#define CRUST_MAX_EXTRA_LAYOUTS 16
+#define CRUST_MAX_WORKERS 64
+#define CRUST_NODE_COMMAND_BUDGET 256 // Commands carried out for each node on each pass of the daemon loop
+#define CRUST_CLIENT_COMMAND_BUDGET 32 // Commands carried out for each other client on each pass
+#define CRUST_LOOP_COMMAND_BUDGET 1024 // Commands carried out for clients other than nodes on each pass
+#define CRUST_DEFAULT_LISTENER_HIGH_WATER_MARK 1048576 // Bytes
+#define CRUST_DEFAULT_LISTENER_LAG_LIMIT 60 // Seconds
+#define CRUST_LAYOUT_OPTION struct crustLayoutOption
 
 enum crustRunMode {
     CRUST_RUN_MODE_CLI,
     CRUST_RUN_MODE_DAEMON,
     CRUST_RUN_MODE_NODE,
-    CRUST_RUN_MODE_WINDOW
+    CRUST_RUN_MODE_WINDOW,
+    CRUST_RUN_MODE_COMPILE
+};
+
+// A layout hosted by the daemon alongside the one given by -b and -c, served on its own port
+struct crustLayoutOption {
+    in_port_t port;
+    char configFilePath[PATH_MAX];
 };
 
 extern bool crustOptionVerbose;
@@ -62,12 +77,28 @@ extern in_addr_t crustOptionIPAddress;
 extern bool crustOptionWindowEnterLog;
 extern char crustOptionWindowConfigFilePath[PATH_MAX];
 extern char crustOptionDaemonConfigFilePath[PATH_MAX];
+extern char crustOptionLayoutImagePath[PATH_MAX];
+extern char crustOptionCheckpointPath[PATH_MAX];
+extern char crustOptionJournalPath[PATH_MAX];
+extern char crustOptionRecordPath[PATH_MAX];
 extern rlim_t crustOptionConnectionLimit;
+extern CRUST_LAYOUT_OPTION crustOptionExtraLayouts[CRUST_MAX_EXTRA_LAYOUTS];
+extern unsigned int crustOptionExtraLayoutCount;
+extern unsigned int crustOptionWorkerCount;
+extern bool crustOptionBatchUpdates;
+extern unsigned long crustOptionBatchInterval;
+extern size_t crustOptionListenerHighWaterMark;
+extern unsigned long crustOptionListenerLagLimit;
+extern char crustOptionViewName[NAME_MAX];
+extern bool crustOptionMulticast;
+extern in_addr_t crustOptionMulticastGroup;
+extern in_port_t crustOptionMulticastPort;
 
 #ifdef GPIO
 extern char crustOptionGPIOPath[PATH_MAX];
 extern char * crustOptionPinMapString;
 extern bool crustOptionInvertPinLogic;
+extern bool crustOptionSendEdgeTimes;
 #endif
 
 void crust_config_load_defaults();
@@ -40,11 +40,16 @@ void crust_connection_init(CRUST_CONNECTION * connection)
     connection->closeFunction = NULL;
     connection->readBuffer = NULL;
     connection->readTo = 0;
+    connection->readPaused = false;
     connection->writeBuffer = NULL;
+    connection->writeBufferLength = 0;
     connection->didConnect = false;
     connection->didClose = false;
     connection->customIdentifier = 0;
     connection->parentSocket = NULL;
+    connection->notifyFD = -1;
+    connection->markedBytes = 0;
+    connection->markedAt = 0;
 }
 
 void crust_connectivity_extend()
@@ -93,6 +98,43 @@ CRUST_CONNECTION * crust_connection_read_keyboard_open(void (*readFunction)(CRUS
     return connection;
 }
 
+/*
+ * Opens a connection that other threads can use to wake the poll loop. Each call to crust_connection_notify() from any
+ * thread causes the read function to be run on the polling thread, although several notifications may be combined into
+ * one run.
+ */
+CRUST_CONNECTION * crust_connection_notify_open(void (*readFunction)(CRUST_CONNECTION *))
+{
+    int pipeFDs[2];
+    if(pipe(pipeFDs)
+       || fcntl(pipeFDs[0], F_SETFL, O_NONBLOCK)
+       || fcntl(pipeFDs[1], F_SETFL, O_NONBLOCK))
+    {
+        crust_terminal_print("Unable to create notify pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    crust_connectivity_extend();
+    CRUST_CONNECTION * connection = connectivity.connectionList[connectivity.connectionListLength - 1];
+    struct pollfd * pollListEntry = &connectivity.pollList[connectivity.connectionListLength - 1];
+
+    connection->type = CONNECTION_TYPE_NOTIFY;
+    connection->readFunction = readFunction;
+    connection->didConnect = true;
+    connection->notifyFD = pipeFDs[1];
+    pollListEntry->fd = pipeFDs[0];
+    pollListEntry->events = POLLRDNORM;
+
+    return connection;
+}
+
+void crust_connection_notify(CRUST_CONNECTION * connection)
+{
+    // If the pipe is full the poll loop already has a notification waiting so there is nothing to add
+    char notification = 0;
+    write(connection->notifyFD, &notification, 1);
+}
+
 CRUST_CONNECTION * crust_connection_read_write_open(void (*readFunction)(CRUST_CONNECTION *),
                                                     void (*openFunction)(CRUST_CONNECTION *),
                                                     void (*closeFunction)(CRUST_CONNECTION *),
@@ -168,10 +210,9 @@ CRUST_CONNECTION * crust_connection_socket_accept(CRUST_CONNECTION * socket, int
 
     if(newfd == -1)
     {
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
         {
             // No connection to accept
-            crust_terminal_print_verbose("Tried to accept a non-existent connection.");
             return NULL;
         }
 
@@ -193,6 +234,14 @@ CRUST_CONNECTION * crust_connection_socket_accept(CRUST_CONNECTION * socket, int
         exit(EXIT_FAILURE);
     }
 
+    // Writes to clients must never hold up the daemon loop
+    int flags = fcntl(newfd, F_GETFL);
+    if(flags == -1 || fcntl(newfd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        crust_terminal_print("Unable to make a client connection non-blocking.");
+        exit(EXIT_FAILURE);
+    }
+
     // Prepare memory to hold the connection
     crust_connectivity_extend();
     CRUST_CONNECTION * connection = connectivity.connectionList[connectivity.connectionListLength - 1];
@@ -285,7 +334,7 @@ CRUST_CONNECTION * crust_connection_socket_open(void (*readFunction)(CRUST_CONNE
     }
 
     // Make the socket non-blocking
-    if(fcntl(pollListEntry->fd, F_SETFD, fcntl(pollListEntry->fd, F_GETFD) | O_NONBLOCK) == -1)
+    if(fcntl(pollListEntry->fd, F_SETFL, fcntl(pollListEntry->fd, F_GETFL) | O_NONBLOCK) == -1)
     {
         crust_terminal_print("Unable to make the CRUST socket non-blocking.");
         exit(EXIT_FAILURE);
@@ -335,16 +384,102 @@ CRUST_CONNECTION * crust_connection_gpio_open(void (*readFunction)(CRUST_CONNECT
 
 void crust_connection_write(CRUST_CONNECTION * connection, char * data)
 {
-    size_t existingDataSize = 0;
+    size_t existingDataSize = connection->writeBuffer != NULL ? connection->writeBufferLength : 0;
     size_t newDataSize = strlen(data);
-    if(connection->writeBuffer != NULL)
+
+    connection->writeBuffer = realloc(connection->writeBuffer, existingDataSize + newDataSize + 1);
+    memcpy(&connection->writeBuffer[existingDataSize], data, newDataSize + 1);
+    connection->writeBufferLength = existingDataSize + newDataSize;
+}
+
+// Shuts the connection down. The close function is called once the hangup has been seen.
+void crust_connection_close(CRUST_CONNECTION * connection)
+{
+    for(size_t i = 0; i < connectivity.connectionListLength; i++)
     {
-        existingDataSize = strlen(connection->writeBuffer);
+        if(connectivity.connectionList[i] == connection && connectivity.pollList[i].fd >= 0)
+        {
+            shutdown(connectivity.pollList[i].fd, SHUT_RDWR);
+            return;
+        }
     }
+}
 
-    connection->writeBuffer = realloc(connection->writeBuffer, existingDataSize + newDataSize + 1);
-    connection->writeBuffer[existingDataSize] = '\0'; // Make sure the write buffer is null terminated
-    strncat(connection->writeBuffer, data, newDataSize + 1);
+/*
+ * Marks the end of what has been written to the connection so far. Once it has all gone out, the time since markedAt
+ * is added to the metrics. Only one mark is kept at a time, so marks set while another is outstanding are ignored.
+ */
+void crust_connection_mark(CRUST_CONNECTION * connection, u_int64_t markedAt)
+{
+    if(connection->markedBytes || connection->writeBuffer == NULL)
+    {
+        return;
+    }
+    connection->markedBytes = connection->writeBufferLength;
+    connection->markedAt = markedAt;
+}
+
+// Returns the file descriptor behind a connection, or -1 if it has been closed.
+int crust_connection_fd(CRUST_CONNECTION * connection)
+{
+    for(size_t i = 0; i < connectivity.connectionListLength; i++)
+    {
+        if(connectivity.connectionList[i] == connection)
+        {
+            return connectivity.pollList[i].fd >= 0 ? connectivity.pollList[i].fd : -1;
+        }
+    }
+    return -1;
+}
+
+// Drops everything before readTo from the read buffer.
+void crust_connection_consume(CRUST_CONNECTION * connection)
+{
+    if(connection->readBuffer == NULL)
+    {
+        return;
+    }
+
+    size_t bytesLeft = strlen(&connection->readBuffer[connection->readTo]);
+    if(!bytesLeft)
+    {
+        free(connection->readBuffer);
+        connection->readBuffer = NULL;
+    }
+    else if(connection->readTo)
+    {
+        memmove(connection->readBuffer, &connection->readBuffer[connection->readTo], bytesLeft + 1);
+    }
+    connection->readTo = 0;
+}
+
+/*
+ * Stops or restarts reading from a connection. Anything sent in the meantime waits in the kernel, so a client that
+ * keeps sending is eventually held back by TCP flow control.
+ */
+void crust_connection_set_reading(CRUST_CONNECTION * connection, bool reading)
+{
+    if(connection->readPaused == !reading)
+    {
+        return;
+    }
+    connection->readPaused = !reading;
+
+    for(size_t i = 0; i < connectivity.connectionListLength; i++)
+    {
+        if(connectivity.connectionList[i] == connection)
+        {
+            if(reading)
+            {
+                connectivity.pollList[i].events |= POLLRDNORM;
+            }
+            else
+            {
+                connectivity.pollList[i].events &= ~POLLRDNORM;
+            }
+            return;
+        }
+    }
 }
 
 void crust_connectivity_execute(int timeout)
@@ -368,16 +503,21 @@ void crust_connectivity_execute(int timeout)
             // Stop looking for new connections if we have reached the connection limit
             if(connectionLimitReached)
             {
-                connectivity.pollList->events &= ~POLLRDNORM;
+                connectivity.pollList[i].events &= ~POLLRDNORM;
             }
             else
             {
-                connectivity.pollList->events |= POLLRDNORM;
+                connectivity.pollList[i].events |= POLLRDNORM;
             }
         }
     }
 
     int pollResult = poll(connectivity.pollList, connectivity.connectionListLength, timeout);
+    connectivity.metrics.pollIterations++;
+    if(pollResult >= 0)
+    {
+        crust_histogram_record(&connectivity.metrics.readyConnections, (u_int64_t)pollResult);
+    }
 
     if(!pollResult)
     {
@@ -386,6 +526,11 @@ void crust_connectivity_execute(int timeout)
     }
     if(pollResult == -1)
     {
+        if(errno == EINTR)
+        {
+            // A signal arrived, let the caller deal with it before polling again
+            return;
+        }
         crust_terminal_print("Poll error.");
         exit(EXIT_FAILURE);
     }
@@ -422,14 +567,24 @@ void crust_connectivity_execute(int timeout)
         // Handle reads and new inbounds
         if(connectivity.pollList[i].revents & POLLRDNORM)
         {
-            // Handle new inbound connections opening
+            // Handle new inbound connections opening, accepting everything that is waiting
             if(connectivity.connectionList[i]->type == CONNECTION_TYPE_SOCKET)
             {
-                CRUST_CONNECTION * newConnection = crust_connection_socket_accept(connectivity.connectionList[i], connectivity.pollList[i].fd);
-                if(newConnection != NULL)
+                CRUST_CONNECTION * newConnection;
+                u_int64_t accepted = 0;
+                while((newConnection = crust_connection_socket_accept(connectivity.connectionList[i],
+                                                                      connectivity.pollList[i].fd)) != NULL)
                 {
                     connectivity.connectionList[i]->openFunction(newConnection);
+                    accepted++;
                 }
+                crust_histogram_record(&connectivity.metrics.acceptedConnections, accepted);
+            }
+            else if(connectivity.connectionList[i]->type == CONNECTION_TYPE_NOTIFY)
+            {
+                // Empty the pipe then run the read function once for all the notifications it held
+                while(read(connectivity.pollList[i].fd, localReadBuffer, CRUST_MAX_MESSAGE_LENGTH) > 0);
+                connectivity.connectionList[i]->readFunction(connectivity.connectionList[i]);
             }
             else if(connectivity.connectionList[i]->type == CONNECTION_TYPE_KEYBOARD)
             {
@@ -444,13 +599,18 @@ void crust_connectivity_execute(int timeout)
 #endif
             else
             {
-                size_t bytesRead = read(connectivity.pollList[i].fd, localReadBuffer, CRUST_MAX_MESSAGE_LENGTH - 1);
-                if(bytesRead == 0) //The connection is closing
+                ssize_t bytesRead = read(connectivity.pollList[i].fd, localReadBuffer, CRUST_MAX_MESSAGE_LENGTH - 1);
+                if(bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                {
+                    // Nothing to read after all
+                }
+                else if(bytesRead <= 0) //The connection is closing
                 {
                     shutdown(connectivity.pollList[i].fd, SHUT_RDWR);
                 }
                 else
                 {
+                    connectivity.metrics.bytesRead += bytesRead;
                     localReadBuffer[bytesRead] = '\0';
                     size_t connectivityReadBufferLength;
                     if(connectivity.connectionList[i]->readBuffer == NULL)
@@ -476,22 +636,7 @@ void crust_connectivity_execute(int timeout)
                     // Tell the program that there is data to read
                     connectivity.connectionList[i]->readFunction(connectivity.connectionList[i]);
 
-                    // Calculate how much has been left in the read buffer
-                    size_t bytesLeft = strlen(&connectivity.connectionList[i]->readBuffer[connectivity.connectionList[i]->readTo]);
-                    if(!bytesLeft)
-                    {
-                        free(connectivity.connectionList[i]->readBuffer);
-                        connectivity.connectionList[i]->readBuffer = NULL;
-                        connectivity.connectionList[i]->readTo = 0;
-                    }
-                    else
-                    {
-                        char * newReadBuffer = malloc(bytesLeft + 1);
-                        strncpy(newReadBuffer, &connectivity.connectionList[i]->readBuffer[connectivity.connectionList[i]->readTo], bytesLeft + 1);
-                        free(connectivity.connectionList[i]->readBuffer);
-                        connectivity.connectionList[i]->readBuffer = newReadBuffer;
-                        connectivity.connectionList[i]->readTo = 0;
-                    }
+                    crust_connection_consume(connectivity.connectionList[i]);
                 }
             }
         }
@@ -499,24 +644,48 @@ void crust_connectivity_execute(int timeout)
         // Handle writes
         if(connectivity.pollList[i].revents & POLLWRNORM)
         {
-            size_t bytesToWrite = strlen(connectivity.connectionList[i]->writeBuffer);
-            size_t bytesWritten = write(connectivity.pollList[i].fd,
+            size_t bytesToWrite = connectivity.connectionList[i]->writeBufferLength;
+            ssize_t writeResult = write(connectivity.pollList[i].fd,
                                         connectivity.connectionList[i]->writeBuffer,
                                         bytesToWrite);
+            // Try again when poll next says the connection is writable, or let the hangup be seen if it has gone
+            size_t bytesWritten = writeResult == -1 ? 0 : (size_t)writeResult;
+            if(bytesWritten)
+            {
+                connectivity.metrics.bytesWritten += bytesWritten;
+                if(connectivity.connectionList[i]->markedBytes > bytesWritten)
+                {
+                    connectivity.connectionList[i]->markedBytes -= bytesWritten;
+                }
+                else if(connectivity.connectionList[i]->markedBytes)
+                {
+                    connectivity.connectionList[i]->markedBytes = 0;
+                    crust_histogram_record(&connectivity.metrics.markedWriteTime,
+                                           crust_metrics_nanoseconds() - connectivity.connectionList[i]->markedAt);
+                }
+            }
             if(bytesToWrite == bytesWritten)
             {
                 free(connectivity.connectionList[i]->writeBuffer);
                 connectivity.connectionList[i]->writeBuffer = NULL;
+                connectivity.connectionList[i]->writeBufferLength = 0;
                 connectivity.pollList[i].events &= ~POLLWRNORM; // Stop write polling
             }
-            else
+            else if(bytesWritten)
             {
                 size_t bytesLeft = bytesToWrite - bytesWritten;
                 char * newWriteBuffer = malloc(bytesLeft + 1);
                 strncpy(newWriteBuffer, &connectivity.connectionList[i]->writeBuffer[bytesWritten], bytesLeft + 1);
                 free(connectivity.connectionList[i]->writeBuffer);
                 connectivity.connectionList[i]->writeBuffer = newWriteBuffer;
+                connectivity.connectionList[i]->writeBufferLength = bytesLeft;
             }
         }
     }
 }
+
+// The metrics are only changed by crust_connectivity_execute(), so they can be read between calls without copying.
+const CRUST_CONNECTIVITY_METRICS * crust_connectivity_metrics()
+{
+    return &connectivity.metrics;
+}
@@ -25,6 +25,7 @@
 #include <poll.h>
 #include <stdbool.h>
 #include <netinet/in.h>
+#include "metrics.h"
 #ifdef GPIO
 #include <gpiod.h>
 #endif
@@ -36,7 +37,8 @@ enum crustConnectionType {
 #ifdef GPIO
     CONNECTION_TYPE_GPIO_LINE,
 #endif
-    CONNECTION_TYPE_KEYBOARD
+    CONNECTION_TYPE_KEYBOARD,
+    CONNECTION_TYPE_NOTIFY
 };
 
 #define CRUST_CONNECTION struct crustConnection
@@ -47,11 +49,26 @@ struct crustConnection{
     void (*closeFunction)(CRUST_CONNECTION *); // Called when the connection is closed
     char * readBuffer;
     size_t readTo; // Used by the receiving code to indicate how far it has read
+    bool readPaused;
     char * writeBuffer;
+    size_t writeBufferLength;
     bool didConnect;
     bool didClose;
     long long customIdentifier;
     CRUST_CONNECTION * parentSocket;
+    int notifyFD; // The write end of the pipe behind a notify connection
+    size_t markedBytes; // How much must still be written to reach the mark set by crust_connection_mark(), 0 if none
+    u_int64_t markedAt;
+};
+
+#define CRUST_CONNECTIVITY_METRICS struct crustConnectivityMetrics
+struct crustConnectivityMetrics {
+    u_int64_t pollIterations;
+    u_int64_t bytesRead;
+    u_int64_t bytesWritten;
+    CRUST_HISTOGRAM readyConnections; // How many connections had something to do after each poll
+    CRUST_HISTOGRAM acceptedConnections; // How many connections were accepted each time a listening socket was ready
+    CRUST_HISTOGRAM markedWriteTime; // Nanoseconds from each mark being set to the write reaching it
 };
 
 #define CRUST_CONNECTIVITY struct crustConnectivity
@@ -59,10 +76,17 @@ struct crustConnectivity {
     CRUST_CONNECTION ** connectionList;
     size_t connectionListLength;
     struct pollfd * pollList;
+    CRUST_CONNECTIVITY_METRICS metrics;
 };
 
 void crust_connection_write(CRUST_CONNECTION * connection, char * data);
+void crust_connection_mark(CRUST_CONNECTION * connection, u_int64_t markedAt);
+void crust_connection_close(CRUST_CONNECTION * connection);
+int crust_connection_fd(CRUST_CONNECTION * connection);
+void crust_connection_consume(CRUST_CONNECTION * connection);
+void crust_connection_set_reading(CRUST_CONNECTION * connection, bool reading);
 void crust_connectivity_execute(int timeout);
+const CRUST_CONNECTIVITY_METRICS * crust_connectivity_metrics();
 CRUST_CONNECTION * crust_connection_read_write_open(void (*readFunction)(CRUST_CONNECTION *),
                                                     void (*openFunction)(CRUST_CONNECTION *),
                                                     void (*closeFunction)(CRUST_CONNECTION *),
@@ -70,6 +94,8 @@ CRUST_CONNECTION * crust_connection_read_write_open(void (*readFunction)(CRUST_C
                                                     in_port_t port);
 
 CRUST_CONNECTION * crust_connection_read_keyboard_open(void (*readFunction)(CRUST_CONNECTION *));
+CRUST_CONNECTION * crust_connection_notify_open(void (*readFunction)(CRUST_CONNECTION *));
+void crust_connection_notify(CRUST_CONNECTION * connection);
 CRUST_CONNECTION * crust_connection_socket_open(void (*readFunction)(CRUST_CONNECTION *),
                                                 void (*openFunction)(CRUST_CONNECTION *),
                                                 void (*closeFunction)(CRUST_CONNECTION *),
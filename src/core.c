@@ -0,0 +1,608 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "core.h"
+#include "terminal.h"
+
+// The command that produces each opcode, used to label the metrics
+const char * crustOpcodeNames[NUM_OPCODES] = {
+        [NO_OPERATION] = "NO",
+        [RESEND_STATE] = "RS",
+#ifdef TESTING
+        [RESEND_LIPSUM] = "RL",
+#endif
+        [INSERT_BLOCK] = "IB",
+        [UPDATE_BLOCK] = "UB",
+        [INSERT_TRACK_CIRCUIT] = "IC",
+        [START_LISTENING] = "SL",
+        [CLEAR_TRACK_CIRCUIT] = "CC",
+        [OCCUPY_TRACK_CIRCUIT] = "OC",
+        [LOOSE_TRACK_CIRCUIT] = "LT",
+        [ENABLE_BERTH_UP] = "EU",
+        [ENABLE_BERTH_DOWN] = "ED",
+        [INTERPOSE] = "IP",
+        [BERTH_STEP] = "BS",
+        [SEND_METRICS] = "ST"
+};
+
+void crust_core_init(CRUST_CORE ** core)
+{
+    *core = malloc(sizeof(CRUST_CORE));
+    if(*core == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    crust_state_init(&(*core)->state);
+    (*core)->state->closedLayout = true;
+    (*core)->writeToListeners = NULL;
+    (*core)->sendState = NULL;
+    (*core)->sendMetrics = NULL;
+    (*core)->recordTrackCircuit = NULL;
+    (*core)->recordEnableBerth = NULL;
+    (*core)->recordHeadcode = NULL;
+    (*core)->journal = NULL;
+    (*core)->owner = NULL;
+    memset((*core)->metrics.commands, 0, sizeof((*core)->metrics.commands));
+    crust_histogram_init(&(*core)->metrics.autoAdvanceTime);
+}
+
+void crust_core_session_init(CRUST_CORE * core, CRUST_SESSION * session)
+{
+    session->core = core;
+    session->connection = NULL;
+    session->channel = NULL;
+    session->listening = false;
+    session->closed = false;
+    session->ownsCircuits = false;
+    session->inputPending = false;
+    session->outputHead = NULL;
+    session->outputTail = NULL;
+    session->coalescing = false;
+    session->coalescingSince = 0;
+    session->dirtyBlocks = NULL;
+    session->dirtyBlocksLength = 0;
+    session->dirtyTrackCircuits = NULL;
+    session->dirtyTrackCircuitsLength = 0;
+}
+
+// Sends a block as it now stands to the listeners.
+void crust_core_publish_block(CRUST_CORE * core, CRUST_BLOCK * block)
+{
+    char * writeBuffer;
+
+    if(core->writeToListeners != NULL)
+    {
+        crust_print_block(block, &writeBuffer, core->state);
+        core->writeToListeners(core, writeBuffer, block, NULL);
+        free(writeBuffer);
+    }
+}
+
+// Sends a track circuit as it now stands to the listeners.
+void crust_core_publish_track_circuit(CRUST_CORE * core, CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    char * writeBuffer;
+
+    if(core->writeToListeners != NULL)
+    {
+        crust_print_track_circuit(trackCircuit, &writeBuffer, core->state);
+        core->writeToListeners(core, writeBuffer, NULL, trackCircuit);
+        free(writeBuffer);
+    }
+}
+
+void crust_core_send_state(CRUST_CORE * core, CRUST_SESSION * session)
+{
+    if(core->sendState != NULL)
+    {
+        core->sendState(core, session);
+    }
+}
+
+void crust_core_record_track_circuit(CRUST_CORE * core, enum crustJournalRecordType type, CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    if(core->recordTrackCircuit != NULL)
+    {
+        core->recordTrackCircuit(core->journal, type, trackCircuit);
+    }
+}
+
+void crust_core_record_enable_berth(CRUST_CORE * core, CRUST_BLOCK * block)
+{
+    if(core->recordEnableBerth != NULL)
+    {
+        core->recordEnableBerth(core->journal, block);
+    }
+}
+
+void crust_core_record_headcode(CRUST_CORE * core,
+                                enum crustJournalRecordType type,
+                                CRUST_BLOCK * fromBlock,
+                                CRUST_BLOCK * toBlock,
+                                CRUST_STATE * state)
+{
+    if(core->recordHeadcode != NULL)
+    {
+        core->recordHeadcode(core->journal, type, fromBlock, toBlock, state);
+    }
+}
+
+/*
+ * Takes a pointer to a CRUST message and the length of the message and returns the detected opcode. If there is an input
+ * to go with the operation, fills operationInput. See CRUST_MIXED_OPERATION_INPUT for details. If the opcode is not
+ * recognised or there is an error, returns NO_OPERATION.
+ */
+CRUST_OPCODE crust_core_interpret_message(CRUST_CORE * core, char * message, CRUST_MIXED_OPERATION_INPUT * operationInput)
+{
+    CRUST_STATE * state = core->state;
+
+    // Return NOP if the message is too short
+    if(strlen(message) < 2)
+    {
+        return NO_OPERATION;
+    }
+
+    switch(message[0])
+    {
+        case 'B':
+            switch(message[1])
+            {
+                case 'S':
+                    operationInput->manualStepInstruction = malloc(sizeof(CRUST_BERTH_STEP_INSTRUCTION));
+                    if(crust_interpret_berth_step_instruction(&message[2], operationInput->manualStepInstruction))
+                    {
+                        crust_terminal_print_verbose("Invalid manual step instruction");
+                        free(operationInput->manualStepInstruction);
+                        return NO_OPERATION;
+                    }
+                    return BERTH_STEP;
+            }
+
+        case 'C':
+            switch(message[1])
+            {
+                case 'C':
+                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
+                    {
+                        crust_terminal_print_verbose("Invalid identifier");
+                        return NO_OPERATION;
+                    }
+                    return CLEAR_TRACK_CIRCUIT;
+
+                default:
+                    return NO_OPERATION;
+            }
+
+        case 'E':
+            switch(message[1])
+            {
+                case 'U':
+                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
+                    {
+                        crust_terminal_print_verbose("Invalid identifier");
+                        return NO_OPERATION;
+                    }
+                    return ENABLE_BERTH_UP;
+
+                case 'D':
+                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
+                    {
+                        crust_terminal_print_verbose("Invalid identifier");
+                        return NO_OPERATION;
+                    }
+                    return ENABLE_BERTH_DOWN;
+
+                default:
+                    return NO_OPERATION;
+            }
+
+        case 'I':
+            switch(message[1])
+            {
+                case 'B':
+                    // Initialise a block and try to fill it.
+                    crust_block_init(&operationInput->block, state);
+                    if(crust_interpret_block(&message[2], operationInput->block, state))
+                    {
+                        crust_terminal_print_verbose("Invalid block description message");
+                        free(operationInput->block);
+                        return NO_OPERATION;
+                    }
+                    return INSERT_BLOCK;
+
+                case 'C':
+                    crust_track_circuit_init(&operationInput->trackCircuit, state);
+                    if(crust_interpret_track_circuit(&message[2], operationInput->trackCircuit, state))
+                    {
+                        crust_terminal_print_verbose("Invalid circuit member list");
+                        free(operationInput->trackCircuit);
+                        return NO_OPERATION;
+                    }
+                    return INSERT_TRACK_CIRCUIT;
+
+                case 'P':
+                    operationInput->interposeInstruction = malloc(sizeof(CRUST_INTERPOSE_INSTRUCTION));
+                    if(crust_interpret_interpose_instruction(&message[2], operationInput->interposeInstruction))
+                    {
+                        crust_terminal_print_verbose("Invalid interpose instruction");
+                        free(operationInput->interposeInstruction);
+                        return NO_OPERATION;
+                    }
+                    return INTERPOSE;
+
+
+                default:
+                    return NO_OPERATION;
+            }
+
+        case 'O':
+            switch(message[1])
+            {
+                case 'C':
+                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
+                    {
+                        crust_terminal_print_verbose("Invalid identifier");
+                        return NO_OPERATION;
+                    }
+                    return OCCUPY_TRACK_CIRCUIT;
+            }
+
+        case 'R':
+            switch(message[1])
+            {
+                case 'S':
+                    return RESEND_STATE;
+
+                default:
+                    return NO_OPERATION;
+            }
+
+        case 'S':
+            switch(message[1])
+            {
+                case 'L':
+                    return START_LISTENING;
+
+                case 'T':
+                    return SEND_METRICS;
+
+                default:
+                    return NO_OPERATION;
+            }
+
+        default:
+            return NO_OPERATION;
+    }
+}
+
+void crust_core_process_opcode(CRUST_CORE * core,
+                               CRUST_OPCODE opcode,
+                               CRUST_MIXED_OPERATION_INPUT * operationInput,
+                               CRUST_SESSION * session)
+{
+    CRUST_STATE * state = core->state;
+    CRUST_TRACK_CIRCUIT * identifiedTrackCircuit;
+    CRUST_BLOCK * sourceBlock;
+    CRUST_BLOCK * targetBlock;
+    CRUST_BLOCK ** affectedBlocks = NULL;
+    size_t affectedBlockCount = 0;
+    u_int64_t autoAdvanceStart;
+
+    core->metrics.commands[opcode]++;
+
+    // Process the user's operation
+    switch(opcode)
+    {
+        // Attempt to insert a block and generate the appropriate response
+        case INSERT_BLOCK:
+            crust_terminal_print_verbose("OPCODE: Insert Block");
+            switch(crust_block_insert(operationInput->block, state))
+            {
+                case 0:
+                    crust_terminal_print_verbose("Block inserted successfully");
+                    crust_core_publish_block(core, operationInput->block);
+                    break;
+
+                case 1:
+                    crust_terminal_print_verbose("Failed to insert block - name is not unique");
+                    if(operationInput->block->blockName != NULL)
+                    {
+                        free(operationInput->block->blockName);
+                    }
+                    free(operationInput->block);
+                    break;
+
+                case 2:
+                    crust_terminal_print_verbose("Failed to insert block - conflicting link(s)");
+                    if(operationInput->block->blockName != NULL)
+                    {
+                        free(operationInput->block->blockName);
+                    }
+                    free(operationInput->block);
+                    break;
+
+                case 3:
+                    crust_terminal_print_verbose("Failed to insert block - no links");
+                    if(operationInput->block->blockName != NULL)
+                    {
+                        free(operationInput->block->blockName);
+                    }
+                    free(operationInput->block);
+                    break;
+            }
+            break;
+
+        case INSERT_TRACK_CIRCUIT:
+            crust_terminal_print_verbose("OPCODE: Insert track circuit");
+            switch(crust_track_circuit_insert(operationInput->trackCircuit, state))
+            {
+                case 0:
+                    crust_terminal_print_verbose("Track circuit inserted successfully.");
+                    crust_core_publish_track_circuit(core, operationInput->trackCircuit);
+                    break;
+
+                case 1:
+                    crust_terminal_print_verbose("Failed to insert track circuit - no blocks");
+                    free(operationInput->trackCircuit->blocks);
+                    free(operationInput->trackCircuit);
+                    break;
+
+                case 2:
+                    crust_terminal_print_verbose("Failed to insert track circuit - blocks already part of a different track circuit");
+                    free(operationInput->trackCircuit->blocks);
+                    free(operationInput->trackCircuit);
+                    break;
+
+                case 3:
+                    crust_terminal_print_verbose("Failed to insert track circuit - not all blocks are connected together");
+                    free(operationInput->trackCircuit->blocks);
+                    free(operationInput->trackCircuit);
+            }
+            break;
+
+            // Resend the entire state to the user
+        case RESEND_STATE:
+            if(session == NULL) break;
+            crust_terminal_print_verbose("OPCODE: Resend State");
+            crust_core_send_state(core, session);
+            break;
+
+            // Send the state then send updates as it changes.
+        case START_LISTENING:
+            if(session == NULL) break;
+            crust_terminal_print_verbose("OPCODE: Start Listening");
+            crust_core_send_state(core, session);
+            session->listening = true;
+            break;
+
+        case CLEAR_TRACK_CIRCUIT:
+            if(session == NULL) break;
+            crust_terminal_print_verbose("OPCODE: Clear Track Circuit");
+            if(crust_track_circuit_get(operationInput->identifier, &identifiedTrackCircuit, state)
+               && crust_track_circuit_set_occupation(identifiedTrackCircuit, false, state, session))
+            {
+                crust_core_record_track_circuit(core, CRUST_JOURNAL_CLEAR, identifiedTrackCircuit);
+                crust_core_publish_track_circuit(core, identifiedTrackCircuit);
+            }
+            break;
+
+        case OCCUPY_TRACK_CIRCUIT:
+            if(session == NULL) break;
+            crust_terminal_print_verbose("OPCODE: Occupy Track Circuit");
+            if(crust_track_circuit_get(operationInput->identifier, &identifiedTrackCircuit, state)
+               && crust_track_circuit_set_occupation(identifiedTrackCircuit, true, state, session))
+            {
+                crust_core_record_track_circuit(core, CRUST_JOURNAL_OCCUPY, identifiedTrackCircuit);
+                crust_core_publish_track_circuit(core, identifiedTrackCircuit);
+                autoAdvanceStart = crust_metrics_nanoseconds();
+                affectedBlockCount = crust_headcode_auto_advance(identifiedTrackCircuit, &affectedBlocks, state);
+                crust_histogram_record(&core->metrics.autoAdvanceTime, crust_metrics_nanoseconds() - autoAdvanceStart);
+                if(affectedBlockCount)
+                {
+                    crust_core_record_headcode(core, CRUST_JOURNAL_AUTO_ADVANCE, affectedBlocks[0], affectedBlocks[1], state);
+                }
+                for(int i = 0; i < affectedBlockCount; i++)
+                {
+                    crust_core_publish_block(core, affectedBlocks[i]);
+                }
+                free(affectedBlocks);
+                affectedBlocks = NULL;
+                affectedBlockCount = 0;
+            }
+            break;
+
+        case ENABLE_BERTH_UP:
+            crust_terminal_print_verbose("OPCODE: Enable Berth UP");
+            if(crust_block_get(operationInput->identifier, &targetBlock, state)
+                && crust_enable_berth(targetBlock, UP, state))
+            {
+                crust_core_record_enable_berth(core, targetBlock);
+                crust_core_publish_block(core, targetBlock);
+            }
+            break;
+
+        case ENABLE_BERTH_DOWN:
+            crust_terminal_print_verbose("OPCODE: Enable Berth DOWN");
+            if(crust_block_get(operationInput->identifier, &targetBlock, state)
+               && crust_enable_berth(targetBlock, DOWN, state))
+            {
+                crust_core_record_enable_berth(core, targetBlock);
+                crust_core_publish_block(core, targetBlock);
+            }
+            break;
+
+        case INTERPOSE:
+            crust_terminal_print_verbose("OPCODE: Interpose");
+            if(!crust_block_get(operationInput->interposeInstruction->blockID, &targetBlock, state))
+            {
+                crust_terminal_print_verbose("Invalid block");
+                break;
+            }
+            if(!crust_interpose(targetBlock, operationInput->interposeInstruction->headcode, state))
+            {
+                crust_terminal_print_verbose("Block is not a berth");
+                break;
+            }
+            crust_core_record_headcode(core, CRUST_JOURNAL_INTERPOSE, NULL, targetBlock, state);
+
+            crust_core_publish_block(core, targetBlock);
+            break;
+
+        case BERTH_STEP:
+            crust_terminal_print_verbose("OPCODE: Berth Step");
+            if(!crust_block_get(operationInput->manualStepInstruction->sourceBlockID, &sourceBlock, state))
+            {
+                crust_terminal_print_verbose("Invalid source block");
+            }
+            if(!crust_block_get(operationInput->manualStepInstruction->destinationBlockID, &targetBlock, state))
+            {
+                crust_terminal_print_verbose("Invalid destination block");
+            }
+            if(!crust_headcode_advance(sourceBlock, targetBlock, state))
+            {
+                crust_terminal_print_verbose("Failed to step headcode");
+            }
+            else
+            {
+                crust_core_record_headcode(core, CRUST_JOURNAL_BERTH_STEP, sourceBlock, targetBlock, state);
+            }
+
+            crust_core_publish_block(core, sourceBlock);
+
+            crust_core_publish_block(core, targetBlock);
+            break;
+
+            // Send the metrics to the user
+        case SEND_METRICS:
+            if(session == NULL) break;
+            crust_terminal_print_verbose("OPCODE: Send Metrics");
+            if(core->sendMetrics != NULL)
+            {
+                core->sendMetrics(core, session);
+            }
+            break;
+
+            // Do nothing
+        case NO_OPERATION:
+            crust_terminal_print_verbose("OPCODE: No Operation");
+            break;
+
+            // Report that the opcode was unrecognised.
+        default:
+            crust_terminal_print_verbose("Unrecognised OPCODE");
+            break;
+    }
+}
+
+// Carries out a single command on behalf of a session.
+void crust_core_execute(CRUST_CORE * core, char * message, CRUST_SESSION * session)
+{
+    CRUST_MIXED_OPERATION_INPUT operationInput;
+    CRUST_OPCODE opcode = crust_core_interpret_message(core, message, &operationInput);
+    crust_core_process_opcode(core, opcode, &operationInput, session);
+}
+
+/*
+ * Builds the layout from the commands in a config file. Returns 0 on success, 1 if the file could not be opened or 2 if
+ * it holds a line that is not a valid command.
+ */
+int crust_core_read_config(CRUST_CORE * core, const char * path)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH];
+
+    FILE * configFile = fopen(path, "r");
+    if(configFile == NULL)
+    {
+        return 1;
+    }
+    while(fgets(line, CRUST_MAX_MESSAGE_LENGTH, configFile) != NULL)
+    {
+        for(int i = 0; i < CRUST_MAX_MESSAGE_LENGTH; i++)
+        {
+            if(line[i] == '\r' || line[i] == '\n')
+            {
+                line[i] = '\0';
+                break;
+            }
+        }
+
+        CRUST_MIXED_OPERATION_INPUT operationInput;
+        CRUST_OPCODE opcode = crust_core_interpret_message(core, line, &operationInput);
+        if(opcode == NO_OPERATION)
+        {
+            fclose(configFile);
+            return 2;
+        }
+        crust_core_process_opcode(core, opcode, &operationInput, NULL);
+    }
+
+    fclose(configFile);
+    return 0;
+}
+
+// Releases every track circuit held by a session that has gone away.
+void crust_core_release_session(CRUST_CORE * core, CRUST_SESSION * session)
+{
+    CRUST_STATE * state = core->state;
+
+    if(!session->ownsCircuits)
+    {
+        return;
+    }
+
+    for(unsigned int i = 0; i < state->trackCircuitIndexPointer; i++)
+    {
+        if(state->trackCircuitIndex[i]->owningSession == session)
+        {
+            crust_track_circuit_release(state->trackCircuitIndex[i], state);
+            crust_core_record_track_circuit(core, CRUST_JOURNAL_RELEASE, state->trackCircuitIndex[i]);
+            crust_core_publish_track_circuit(core, state->trackCircuitIndex[i]);
+        }
+    }
+    session->ownsCircuits = false;
+}
+
+// Prints the metrics kept by the core in the Prometheus text format.
+void crust_core_print_metrics(CRUST_CORE * core, CRUST_DYNAMIC_PRINT_BUFFER ** buffer)
+{
+    char sampleLabels[CRUST_MAX_MESSAGE_LENGTH];
+
+    crust_metrics_print_family(buffer, "crust_commands_total", "counter", "Commands carried out, by opcode.");
+    for(int i = 0; i < NUM_OPCODES; i++)
+    {
+        if(crustOpcodeNames[i] != NULL && core->metrics.commands[i])
+        {
+            snprintf(sampleLabels, CRUST_MAX_MESSAGE_LENGTH, "opcode=\"%s\"", crustOpcodeNames[i]);
+            crust_metrics_print_value(buffer, "crust_commands_total", sampleLabels, core->metrics.commands[i]);
+        }
+    }
+
+    crust_metrics_print_family(buffer, "crust_state_generation", "counter", "Changes made to the runtime state.");
+    crust_metrics_print_value(buffer, "crust_state_generation", NULL, core->state->generation);
+
+    crust_metrics_print_histogram(buffer,
+                                  "crust_auto_advance_nanoseconds",
+                                  "Time spent moving headcodes after a track circuit became occupied.",
+                                  &core->metrics.autoAdvanceTime);
+}
@@ -0,0 +1,79 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_CORE_H
+#define CRUST_CORE_H
+
+#include "state.h"
+#include "session.h"
+#include "messaging.h"
+#include "journal.h"
+#include "metrics.h"
+
+/*
+ * The core turns commands into changes to one state and reports what changed through its callbacks. It holds nothing
+ * outside the CRUST_CORE, so a program can run several cores side by side, drive one without any sockets (as
+ * crust-replay and crust-bench do) or put the daemon's network layer in front of one. Every callback may be NULL.
+ */
+
+#define CRUST_CORE struct crustCore
+#define CRUST_CORE_METRICS struct crustCoreMetrics
+
+struct crustCoreMetrics {
+    u_int64_t commands[NUM_OPCODES]; // Commands carried out, by opcode
+    CRUST_HISTOGRAM autoAdvanceTime; // Nanoseconds spent moving headcodes after each occupation
+};
+
+struct crustCore {
+    CRUST_STATE * state;
+    // Called with each change as it should be printed. The change is to either block or trackCircuit, the other is NULL.
+    void (*writeToListeners)(CRUST_CORE * core, char * message, CRUST_BLOCK * block, CRUST_TRACK_CIRCUIT * trackCircuit);
+    void (*sendState)(CRUST_CORE * core, CRUST_SESSION * session); // Called when a session asks for the whole state
+    void (*sendMetrics)(CRUST_CORE * core, CRUST_SESSION * session); // Called when a session asks for the metrics
+    // Called with each change to the runtime state so that it can be recorded in journal
+    void (*recordTrackCircuit)(CRUST_JOURNAL * journal,
+                               enum crustJournalRecordType type,
+                               CRUST_TRACK_CIRCUIT * trackCircuit);
+    void (*recordEnableBerth)(CRUST_JOURNAL * journal, CRUST_BLOCK * block);
+    void (*recordHeadcode)(CRUST_JOURNAL * journal,
+                           enum crustJournalRecordType type,
+                           CRUST_BLOCK * fromBlock,
+                           CRUST_BLOCK * toBlock,
+                           CRUST_STATE * state);
+    CRUST_JOURNAL * journal;
+    void * owner; // For the use of whatever is driving the core
+    CRUST_CORE_METRICS metrics;
+};
+
+extern const char * crustOpcodeNames[NUM_OPCODES];
+
+void crust_core_init(CRUST_CORE ** core);
+void crust_core_session_init(CRUST_CORE * core, CRUST_SESSION * session);
+CRUST_OPCODE crust_core_interpret_message(CRUST_CORE * core, char * message, CRUST_MIXED_OPERATION_INPUT * operationInput);
+void crust_core_process_opcode(CRUST_CORE * core,
+                               CRUST_OPCODE opcode,
+                               CRUST_MIXED_OPERATION_INPUT * operationInput,
+                               CRUST_SESSION * session);
+void crust_core_execute(CRUST_CORE * core, char * message, CRUST_SESSION * session);
+int crust_core_read_config(CRUST_CORE * core, const char * path);
+void crust_core_release_session(CRUST_CORE * core, CRUST_SESSION * session);
+void crust_core_print_metrics(CRUST_CORE * core, CRUST_DYNAMIC_PRINT_BUFFER ** buffer);
+
+#endif //CRUST_CORE_H
@@ -28,12 +28,22 @@
 #include <poll.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
 #include "daemon.h"
 #include "terminal.h"
 #include "state.h"
 #include "config.h"
 #include "messaging.h"
 #include "connectivity.h"
+#include "image.h"
+#include "checkpoint.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "core.h"
+#include "metrics.h"
+#include "worker.h"
+#include "view.h"
+#include "multicast.h"
 #ifdef SYSTEMD
 #include <systemd/sd-daemon.h>
 #endif
@@ -41,6 +51,9 @@
 #define CRUST_WRITE struct crustWrite
 #define CRUST_BUFFER_LIST_ENTRY struct crustBufferListEntry
 #define CRUST_MAX_WRITE_QUEUE_LENGTH 5
+#define CRUST_DAEMON_METRICS struct crustDaemonMetrics
+#define CRUST_DAEMON_TRACE struct crustDaemonTrace
+#define CRUST_DAEMON_FRAME struct crustDaemonFrame
 
 struct crustWrite {
     char * writeBuffer;
@@ -57,12 +70,69 @@ struct crustBufferListEntry {
     bool listening; // Indicates that the user wants state change updates
 };
 
+struct crustDaemonMetrics {
+    CRUST_HISTOGRAM snapshotTakeTime; // Nanoseconds the daemon loop spent taking each snapshot
+    CRUST_HISTOGRAM snapshotPrintTime; // Nanoseconds the printer thread spent turning each snapshot into text
+    // The stages between a track circuit changing and the change reaching the listeners, in nanoseconds
+    CRUST_HISTOGRAM traceDebounceTime; // From the edge on the node to the node sending the change
+    CRUST_HISTOGRAM traceNetworkTime; // From the node sending the change to the daemon reading it
+    CRUST_HISTOGRAM traceApplyTime; // From reading the command to the change being made
+    CRUST_HISTOGRAM traceEnqueueTime; // From reading the command to every listener having the change queued
+    u_int64_t coalescingSessions; // Listeners currently too far behind to be sent each update
+    u_int64_t coalescedUpdates; // Updates marked for a listener instead of being queued
+    u_int64_t laggingDisconnects; // Listeners disconnected for not catching up
+    CRUST_HISTOGRAM frameUpdates; // Updates sent together in each frame when batching with -f
+    u_int64_t deferredInputs; // Times a session had commands left over at the end of its turn
+};
+
+// The command being carried out, followed through the daemon so that each stage can be timed
+struct crustDaemonTrace {
+    bool active;
+    bool applied; // Whether the command has changed anything yet
+    u_int64_t receivedAt;
+};
+
+// The updates made to a layout since its listeners were last written to, when batching with -f
+struct crustDaemonFrame {
+    CRUST_DYNAMIC_PRINT_BUFFER * buffer;
+    u_int64_t updates;
+    u_int64_t tracedAt; // When the first traced change in the frame was made, or 0
+};
+
 CRUST_SESSION ** daemonSessionList = NULL;
 size_t daemonSessionListLength = 0;
 
-CRUST_CONNECTION * daemonSocket;
-
-CRUST_STATE * state;
+CRUST_CONNECTION * daemonPrinterConnection; // Wakes the daemon loop when the printer thread has finished a snapshot
+CRUST_CONNECTION * daemonWorkerConnection; // Wakes the daemon loop when a worker has caught a lagging listener up
+
+CRUST_CORE * daemonCores[CRUST_MAX_EXTRA_LAYOUTS + 1]; // The first holds the layout given by -b and -c
+unsigned int daemonCoreCount = 0;
+CRUST_DAEMON_FRAME daemonFrames[CRUST_MAX_EXTRA_LAYOUTS + 1]; // Each core's frame is also its owner
+CRUST_JOURNAL daemonJournals[CRUST_MAX_EXTRA_LAYOUTS + 1]; // Each core's changes when started with -j
+CRUST_CHECKPOINT_WRITER daemonCheckpointWriters[CRUST_MAX_EXTRA_LAYOUTS + 1]; // Each core's checkpoints with -s
+bool daemonFramesPending = false;
+bool daemonInputPending = false; // Whether any session has commands waiting to be carried out
+size_t daemonInputTurn = 0; // The session that goes first among those that are not nodes
+CRUST_SNAPSHOT_PRINTER daemonSnapshotPrinter;
+CRUST_WORKER daemonWorkers[CRUST_MAX_WORKERS]; // Write to the clients when started with -z
+CRUST_VIEW daemonView; // The runtime state of the first layout in shared memory when started with -M
+CRUST_MULTICAST daemonMulticast; // The first layout's updates sent to a multicast group when started with -U
+bool daemonCarouselPending = false; // Whether a snapshot for the multicast group is with the printer thread
+u_int64_t daemonCarouselSequence; // The last update datagram sent before that snapshot was taken
+CRUST_DAEMON_METRICS daemonMetrics;
+CRUST_DAEMON_TRACE daemonTrace = {.active = false};
+
+volatile sig_atomic_t daemonStopSignal = 0;
+
+FILE * daemonRecording = NULL; // Commands received from clients, in the format read by crust-replay
+long long daemonRecordingStart;
+
+long long crust_daemon_milliseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
 _Noreturn void crust_daemon_stop()
 {
@@ -73,12 +143,50 @@ _Noreturn void crust_daemon_stop()
 //    crust_terminal_print_verbose("Closing the CRUST socket...");
 //    close(socketFp);
 
+    for(unsigned int i = 0; i < daemonCoreCount && crustOptionJournalPath[0] != '\0'; i++)
+    {
+        char statusText[CRUST_MAX_MESSAGE_LENGTH];
+        CRUST_JOURNAL_METRICS journalMetrics;
+
+        crust_journal_flush(&daemonJournals[i]);
+        crust_journal_metrics(&daemonJournals[i], &journalMetrics);
+        snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1,
+                 "Journal %u: %llu records written in %llu commits, %llu dropped, maximum queue depth %u",
+                 i,
+                 (unsigned long long)journalMetrics.recordsWritten,
+                 (unsigned long long)journalMetrics.commits,
+                 (unsigned long long)journalMetrics.recordsDropped,
+                 journalMetrics.maxQueueDepth);
+        crust_terminal_print_verbose(statusText);
+    }
+    if(daemonRecording != NULL)
+    {
+        fclose(daemonRecording);
+    }
+    for(unsigned int i = 0; i < daemonCoreCount && crustOptionCheckpointPath[0] != '\0'; i++)
+    {
+        if(!crust_checkpoint_write(&daemonCheckpointWriters[i], daemonCores[i]->state))
+        {
+            crust_terminal_print("Failed to write checkpoint.");
+        }
+    }
+    if(crustOptionViewName[0] != '\0')
+    {
+        crust_view_close(&daemonView);
+    }
+
     exit(EXIT_SUCCESS);
 }
 
+// The daemon stops from its loop rather than from the handler so that it never saves a change that is half made
 void crust_daemon_handle_signal(int signal)
 {
-    switch(signal)
+    daemonStopSignal = signal;
+}
+
+void crust_daemon_handle_stop_signal()
+{
+    switch(daemonStopSignal)
     {
         case SIGINT:
             crust_terminal_print_verbose("Received SIGINT, shutting down...");
@@ -92,15 +200,7 @@ void crust_daemon_handle_signal(int signal)
     }
 }
 
-void crust_daemon_session_init(CRUST_SESSION * session)
-{
-    session->connection = NULL;
-    session->listening = false;
-    session->closed = false;
-    session->ownsCircuits = false;
-}
-
-void crust_daemon_session_list_extend()
+void crust_daemon_session_list_extend(CRUST_CORE * core)
 {
     daemonSessionListLength++;
     daemonSessionList = realloc(daemonSessionList, sizeof(CRUST_SESSION *) * daemonSessionListLength);
@@ -109,484 +209,1168 @@ void crust_daemon_session_list_extend()
         crust_terminal_print("Memory allocation error.");
         exit(EXIT_FAILURE);
     }
-    daemonSessionList[daemonSessionListLength - 1] = malloc(sizeof(CRUST_SESSION));
-    crust_daemon_session_init(daemonSessionList[daemonSessionListLength - 1]);
+    daemonSessionList[daemonSessionListLength - 1] = malloc(sizeof(CRUST_SESSION));
+    crust_core_session_init(core, daemonSessionList[daemonSessionListLength - 1]);
+}
+
+CRUST_SESSION_OUTPUT * crust_daemon_session_output_append(CRUST_SESSION * session, char * text)
+{
+    CRUST_SESSION_OUTPUT * output = malloc(sizeof(CRUST_SESSION_OUTPUT));
+    if(output == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    output->text = text;
+    output->session = session;
+    output->next = NULL;
+
+    if(session->outputTail == NULL)
+    {
+        session->outputHead = output;
+    }
+    else
+    {
+        session->outputTail->next = output;
+    }
+    session->outputTail = output;
+
+    return output;
+}
+
+// Sends a session everything at the front of its output that is ready to go.
+void crust_daemon_session_output_flush(CRUST_SESSION * session)
+{
+    while(session->outputHead != NULL && session->outputHead->text != NULL)
+    {
+        CRUST_SESSION_OUTPUT * output = session->outputHead;
+        if(!session->closed && session->channel != NULL)
+        {
+            // The worker takes the text over rather than copying what may be the whole state
+            CRUST_WORKER_BUFFER * buffer = crust_worker_buffer_create(output->text, strlen(output->text));
+            crust_worker_channel_write(session->channel, buffer, 0);
+            crust_worker_buffer_release(buffer);
+            output->text = NULL;
+        }
+        else if(!session->closed)
+        {
+            crust_connection_write(session->connection, output->text);
+        }
+        session->outputHead = output->next;
+        free(output->text);
+        free(output);
+    }
+    if(session->outputHead == NULL)
+    {
+        session->outputTail = NULL;
+    }
+}
+
+// Queues text to be written to a session's socket, by its worker if it has one.
+void crust_daemon_session_send(CRUST_SESSION * session, char * text)
+{
+    if(session->channel != NULL)
+    {
+        CRUST_WORKER_BUFFER * buffer = crust_worker_buffer_create(strdup(text), strlen(text));
+        crust_worker_channel_write(session->channel, buffer, 0);
+        crust_worker_buffer_release(buffer);
+    }
+    else
+    {
+        crust_connection_write(session->connection, text);
+    }
+}
+
+// Returns how many bytes are waiting to be written to a session's socket.
+size_t crust_daemon_session_queued_bytes(CRUST_SESSION * session)
+{
+    if(session->channel != NULL)
+    {
+        return crust_worker_channel_queued_bytes(session->channel);
+    }
+    return session->connection->writeBuffer != NULL ? session->connection->writeBufferLength : 0;
+}
+
+void crust_daemon_session_write(CRUST_SESSION * session, char * message)
+{
+    if(session->outputHead == NULL)
+    {
+        crust_daemon_session_send(session, message);
+    }
+    else
+    {
+        crust_daemon_session_output_append(session, strdup(message));
+    }
+}
+
+// Stops queueing updates for a listener that has fallen behind. Whatever changes is marked to be sent once it catches up.
+void crust_daemon_session_start_coalescing(CRUST_SESSION * session)
+{
+    crust_terminal_print_verbose("A listener has fallen behind, holding back its updates.");
+    session->coalescing = true;
+    session->coalescingSince = crust_daemon_milliseconds();
+    daemonMetrics.coalescingSessions++;
+    if(session->channel != NULL)
+    {
+        crust_worker_channel_watch(session->channel);
+    }
+}
+
+void crust_daemon_session_stop_coalescing(CRUST_SESSION * session)
+{
+    free(session->dirtyBlocks);
+    free(session->dirtyTrackCircuits);
+    session->dirtyBlocks = NULL;
+    session->dirtyBlocksLength = 0;
+    session->dirtyTrackCircuits = NULL;
+    session->dirtyTrackCircuitsLength = 0;
+    session->coalescing = false;
+    daemonMetrics.coalescingSessions--;
+}
+
+void crust_daemon_session_mark_dirty(CRUST_SESSION * session, CRUST_BLOCK * block, CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    CRUST_STATE * state = session->core->state;
+
+    if(block != NULL)
+    {
+        if(block->blockId >= session->dirtyBlocksLength)
+        {
+            crust_bitset_regrow(&session->dirtyBlocks, session->dirtyBlocksLength, state->blockIndexLength);
+            session->dirtyBlocksLength = state->blockIndexLength;
+        }
+        crust_bitset_set(session->dirtyBlocks, block->blockId, true);
+    }
+    if(trackCircuit != NULL)
+    {
+        if(trackCircuit->trackCircuitId >= session->dirtyTrackCircuitsLength)
+        {
+            crust_bitset_regrow(&session->dirtyTrackCircuits, session->dirtyTrackCircuitsLength,
+                                state->trackCircuitIndexLength);
+            session->dirtyTrackCircuitsLength = state->trackCircuitIndexLength;
+        }
+        crust_bitset_set(session->dirtyTrackCircuits, trackCircuit->trackCircuitId, true);
+    }
+    daemonMetrics.coalescedUpdates++;
+}
+
+// Sends a listener that has caught up everything that changed while it was behind, as it now stands.
+void crust_daemon_session_send_dirty(CRUST_SESSION * session)
+{
+    CRUST_STATE * state = session->core->state;
+    CRUST_DYNAMIC_PRINT_BUFFER * buffer;
+    char * writeBuffer;
+    crust_dynamic_print_buffer_init(&buffer);
+    buffer->buffer[0] = '\0';
+
+    for(unsigned int i = 0; i < session->dirtyTrackCircuitsLength && i < state->trackCircuitIndexPointer; i++)
+    {
+        if(CRUST_BITSET_TEST(session->dirtyTrackCircuits, i))
+        {
+            crust_print_track_circuit(state->trackCircuitIndex[i], &writeBuffer, state);
+            crust_dynamic_print_buffer_cat(&buffer, writeBuffer);
+            free(writeBuffer);
+        }
+    }
+    for(unsigned int i = 0; i < session->dirtyBlocksLength && i < state->blockIndexPointer; i++)
+    {
+        if(CRUST_BITSET_TEST(session->dirtyBlocks, i))
+        {
+            crust_print_block(state->blockIndex[i], &writeBuffer, state);
+            crust_dynamic_print_buffer_cat(&buffer, writeBuffer);
+            free(writeBuffer);
+        }
+    }
+
+    crust_daemon_session_stop_coalescing(session);
+    if(buffer->pointer)
+    {
+        crust_daemon_session_send(session, buffer->buffer);
+    }
+    free(buffer->buffer);
+    free(buffer);
+}
+
+/*
+ * Looks in on the listeners that have fallen behind. Those whose sockets have drained are sent what they missed and
+ * those that have been behind for longer than the limit set by -y are disconnected.
+ */
+void crust_daemon_service_lagging_sessions()
+{
+    if(!daemonMetrics.coalescingSessions)
+    {
+        return;
+    }
+
+    long long now = crust_daemon_milliseconds();
+    for(size_t i = 0; i < daemonSessionListLength; i++)
+    {
+        CRUST_SESSION * session = daemonSessionList[i];
+        if(!session->coalescing || session->closed)
+        {
+            continue;
+        }
+
+        if(session->outputHead == NULL && !crust_daemon_session_queued_bytes(session))
+        {
+            crust_daemon_session_send_dirty(session);
+        }
+        else if(crustOptionListenerLagLimit
+                && session->coalescingSince >= 0
+                && now - session->coalescingSince >= (long long)crustOptionListenerLagLimit * 1000)
+        {
+            crust_terminal_print_verbose("Disconnecting a listener that has not caught up.");
+            crust_connection_close(session->connection);
+            session->coalescingSince = -1; // Disconnect once; the session is released when the hangup is seen
+            daemonMetrics.laggingDisconnects++;
+        }
+    }
+}
+
+/*
+ * Writes a message to every listener connected to a core that has not fallen behind. With workers the message is
+ * copied once and the copy shared between all of their queues.
+ */
+void crust_daemon_fan_out(CRUST_CORE * core, char * message, u_int64_t tracedAt)
+{
+    CRUST_WORKER_BUFFER * shared = NULL;
+
+    for(int i = 0; i < daemonSessionListLength; i++)
+    {
+        CRUST_SESSION * session = daemonSessionList[i];
+        if(session->listening && !(session->closed) && session->core == core && !session->coalescing)
+        {
+            size_t queuedBytes;
+            if(session->channel != NULL && session->outputHead == NULL)
+            {
+                if(shared == NULL)
+                {
+                    shared = crust_worker_buffer_create(strdup(message), strlen(message));
+                }
+                // Time how long the change waits to be written to the listener's socket
+                queuedBytes = crust_worker_channel_write(session->channel, shared, tracedAt);
+            }
+            else
+            {
+                crust_daemon_session_write(session, message);
+                queuedBytes = crust_daemon_session_queued_bytes(session);
+                if(tracedAt && session->outputHead == NULL)
+                {
+                    crust_connection_mark(session->connection, tracedAt);
+                }
+            }
+            if(crustOptionListenerHighWaterMark && queuedBytes > crustOptionListenerHighWaterMark)
+            {
+                crust_daemon_session_start_coalescing(session);
+            }
+        }
+    }
+
+    if(shared != NULL)
+    {
+        crust_worker_buffer_release(shared);
+    }
+}
+
+void crust_daemon_frame_reset(CRUST_DAEMON_FRAME * frame)
+{
+    frame->buffer->pointer = 0;
+    frame->buffer->buffer[0] = '\0';
+    frame->updates = 0;
+    frame->tracedAt = 0;
+}
+
+// Sends each layout's listeners the updates batched since the last flush, in one write each.
+void crust_daemon_flush_frames()
+{
+    for(unsigned int i = 0; i < daemonCoreCount; i++)
+    {
+        CRUST_DAEMON_FRAME * frame = daemonCores[i]->owner;
+        if(frame->updates)
+        {
+            crust_daemon_fan_out(daemonCores[i], frame->buffer->buffer, frame->tracedAt);
+            crust_histogram_record(&daemonMetrics.frameUpdates, frame->updates);
+            crust_daemon_frame_reset(frame);
+        }
+    }
+    daemonFramesPending = false;
+}
+
+void crust_daemon_write_to_listeners(CRUST_CORE * core, char * message, CRUST_BLOCK * block,
+                                     CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    u_int64_t now = 0;
+    if(daemonTrace.active)
+    {
+        now = crust_metrics_nanoseconds();
+        if(!daemonTrace.applied)
+        {
+            crust_histogram_record(&daemonMetrics.traceApplyTime, now - daemonTrace.receivedAt);
+            daemonTrace.applied = true;
+        }
+    }
+
+    if(crustOptionMulticast && core == daemonCores[0])
+    {
+        crust_multicast_append(&daemonMulticast, message);
+    }
+
+    if(daemonMetrics.coalescingSessions)
+    {
+        for(int i = 0; i < daemonSessionListLength; i++)
+        {
+            CRUST_SESSION * session = daemonSessionList[i];
+            if(session->coalescing && !(session->closed) && session->core == core)
+            {
+                crust_daemon_session_mark_dirty(session, block, trackCircuit);
+            }
+        }
+    }
+
+    if(crustOptionBatchUpdates)
+    {
+        CRUST_DAEMON_FRAME * frame = core->owner;
+        crust_dynamic_print_buffer_cat(&frame->buffer, message);
+        frame->updates++;
+        if(now && !frame->tracedAt)
+        {
+            frame->tracedAt = now;
+        }
+        daemonFramesPending = true;
+        return;
+    }
+
+    crust_daemon_fan_out(core, message, now);
+}
+
+// Takes a snapshot of the core's state and hands it to the printer thread. owner is given back with the text.
+void crust_daemon_snapshot_submit(CRUST_CORE * core, void * owner)
+{
+    CRUST_SNAPSHOT_JOB * job = malloc(sizeof(CRUST_SNAPSHOT_JOB));
+    if(job == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    u_int64_t takeStart = crust_metrics_nanoseconds();
+    crust_snapshot_take(core->state, &job->snapshot);
+    crust_histogram_record(&daemonMetrics.snapshotTakeTime, crust_metrics_nanoseconds() - takeStart);
+    job->owner = owner;
+    crust_snapshot_printer_submit(&daemonSnapshotPrinter, job);
+}
+
+/*
+ * Takes a snapshot of the state for the printer thread to turn into text for a session. Anything written to the
+ * session in the meantime waits until the snapshot has been sent. When the layout is also sent to a multicast group
+ * the state is preceded by the number of the last update datagram whose changes it includes, so that a display can
+ * carry on from the datagrams after it.
+ */
+void crust_daemon_session_send_state(CRUST_CORE * core, CRUST_SESSION * session)
+{
+    if(crustOptionMulticast && core == daemonCores[0])
+    {
+        char sequenceLine[32];
+        // Send the changes made so far this round, so that the snapshot includes every change in the numbered datagrams
+        crust_multicast_flush(&daemonMulticast);
+        snprintf(sequenceLine, sizeof(sequenceLine), "SQ%llu\n", (unsigned long long)daemonMulticast.sequence);
+        crust_daemon_session_write(session, sequenceLine);
+    }
+    crust_daemon_snapshot_submit(core, crust_daemon_session_output_append(session, NULL));
+}
+
+// Sends the whole of the first layout's state to the multicast group, so that displays can join and catch up.
+void crust_daemon_send_carousel()
+{
+    daemonCarouselSequence = daemonMulticast.sequence;
+    daemonCarouselPending = true;
+    crust_daemon_snapshot_submit(daemonCores[0], &daemonMulticast);
+}
+
+void crust_daemon_handle_printer_notification()
+{
+    crust_connection_notify(daemonPrinterConnection);
+}
+
+void crust_daemon_handle_worker_notification()
+{
+    crust_connection_notify(daemonWorkerConnection);
+}
+
+// The lagging listeners are looked at after every pass of the daemon loop, so waking it is enough.
+void crust_daemon_handle_drained_channels(CRUST_CONNECTION * connection)
+{
+}
+
+void crust_daemon_handle_printed_snapshots(CRUST_CONNECTION * connection)
+{
+    CRUST_SNAPSHOT_JOB * job = crust_snapshot_printer_collect(&daemonSnapshotPrinter);
+    while(job != NULL)
+    {
+        crust_histogram_record(&daemonMetrics.snapshotPrintTime, job->printTime);
+        if(job->owner == &daemonMulticast)
+        {
+            crust_multicast_start_state(&daemonMulticast, job->text, daemonCarouselSequence,
+                                        crust_daemon_milliseconds());
+            daemonCarouselPending = false;
+        }
+        else
+        {
+            CRUST_SESSION_OUTPUT * output = job->owner;
+            output->text = job->text;
+            crust_daemon_session_output_flush(output->session);
+        }
+
+        CRUST_SNAPSHOT_JOB * nextJob = job->next;
+        free(job);
+        job = nextJob;
+    }
+}
+
+// Prints how much each session connected to a core has waiting to be sent.
+void crust_daemon_print_session_metrics(CRUST_CORE * core, CRUST_DYNAMIC_PRINT_BUFFER ** buffer)
+{
+    char labels[32];
+
+    crust_metrics_print_family(buffer, "crust_session_queued_bytes", "gauge",
+                               "Bytes waiting to be written to each session.");
+    for(size_t i = 0; i < daemonSessionListLength; i++)
+    {
+        CRUST_SESSION * session = daemonSessionList[i];
+        size_t queuedBytes = session->core == core && !session->closed ? crust_daemon_session_queued_bytes(session) : 0;
+        if(queuedBytes)
+        {
+            snprintf(labels, sizeof(labels), "session=\"%zu\"", i);
+            crust_metrics_print_value(buffer, "crust_session_queued_bytes", labels, queuedBytes);
+        }
+    }
+
+    crust_metrics_print_family(buffer, "crust_session_queued_outputs", "gauge",
+                               "Outputs held back for each session until a snapshot has been printed for it.");
+    for(size_t i = 0; i < daemonSessionListLength; i++)
+    {
+        CRUST_SESSION * session = daemonSessionList[i];
+        u_int64_t outputs = 0;
+        for(CRUST_SESSION_OUTPUT * output = session->outputHead; output != NULL; output = output->next)
+        {
+            outputs++;
+        }
+        if(session->core == core && !session->closed && outputs)
+        {
+            snprintf(labels, sizeof(labels), "session=\"%zu\"", i);
+            crust_metrics_print_value(buffer, "crust_session_queued_outputs", labels, outputs);
+        }
+    }
+}
+
+void crust_daemon_print_journal_metrics(CRUST_DYNAMIC_PRINT_BUFFER ** buffer, CRUST_JOURNAL * journal)
+{
+    CRUST_JOURNAL_METRICS journalMetrics;
+    crust_journal_metrics(journal, &journalMetrics);
+
+    crust_metrics_print_family(buffer, "crust_journal_records_written_total", "counter",
+                               "Records written to the journal.");
+    crust_metrics_print_value(buffer, "crust_journal_records_written_total", NULL, journalMetrics.recordsWritten);
+    crust_metrics_print_family(buffer, "crust_journal_records_dropped_total", "counter",
+                               "Records lost because the journal queue was full.");
+    crust_metrics_print_value(buffer, "crust_journal_records_dropped_total", NULL, journalMetrics.recordsDropped);
+    crust_metrics_print_family(buffer, "crust_journal_commits_total", "counter",
+                               "Batches of records written to the journal and synced.");
+    crust_metrics_print_value(buffer, "crust_journal_commits_total", NULL, journalMetrics.commits);
+    crust_metrics_print_family(buffer, "crust_journal_queue_depth", "gauge",
+                               "Records waiting to be written to the journal.");
+    crust_metrics_print_value(buffer, "crust_journal_queue_depth", NULL, journalMetrics.queueDepth);
+}
+
+/*
+ * Sends a session the metrics for the layout it is connected to and for the daemon as a whole, in the Prometheus text
+ * format.
+ */
+void crust_daemon_session_send_metrics(CRUST_CORE * core, CRUST_SESSION * session)
+{
+    const CRUST_CONNECTIVITY_METRICS * connectivityMetrics = crust_connectivity_metrics();
+    CRUST_WORKER_METRICS workerMetrics[CRUST_MAX_WORKERS];
+    CRUST_DYNAMIC_PRINT_BUFFER * buffer;
+    crust_dynamic_print_buffer_init(&buffer);
+
+    // Whatever the workers wrote is added to what the daemon loop wrote itself
+    u_int64_t bytesWritten = connectivityMetrics->bytesWritten;
+    CRUST_HISTOGRAM markedWriteTime = connectivityMetrics->markedWriteTime;
+    for(unsigned int i = 0; i < crustOptionWorkerCount; i++)
+    {
+        crust_worker_metrics(&daemonWorkers[i], &workerMetrics[i]);
+        bytesWritten += workerMetrics[i].bytesWritten;
+        crust_histogram_merge(&markedWriteTime, &workerMetrics[i].markedWriteTime);
+    }
+
+    crust_core_print_metrics(core, &buffer);
+    crust_daemon_print_session_metrics(core, &buffer);
+
+    crust_metrics_print_family(&buffer, "crust_poll_iterations_total", "counter", "Times the daemon loop has polled.");
+    crust_metrics_print_value(&buffer, "crust_poll_iterations_total", NULL, connectivityMetrics->pollIterations);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_poll_ready_connections",
+                                  "Connections with something to do after each poll.",
+                                  &connectivityMetrics->readyConnections);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_accepted_connections",
+                                  "Connections accepted each time a listening socket was ready.",
+                                  &connectivityMetrics->acceptedConnections);
+    crust_metrics_print_family(&buffer, "crust_received_bytes_total", "counter", "Bytes read from clients.");
+    crust_metrics_print_value(&buffer, "crust_received_bytes_total", NULL, connectivityMetrics->bytesRead);
+    crust_metrics_print_family(&buffer, "crust_sent_bytes_total", "counter", "Bytes written to clients.");
+    crust_metrics_print_value(&buffer, "crust_sent_bytes_total", NULL, bytesWritten);
+    if(crustOptionWorkerCount)
+    {
+        char labels[32];
+        crust_metrics_print_family(&buffer, "crust_worker_writes_total", "counter",
+                                   "Calls each worker has made to write to its clients.");
+        for(unsigned int i = 0; i < crustOptionWorkerCount; i++)
+        {
+            snprintf(labels, sizeof(labels), "worker=\"%u\"", i);
+            crust_metrics_print_value(&buffer, "crust_worker_writes_total", labels, workerMetrics[i].writes);
+        }
+    }
+
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_snapshot_take_nanoseconds",
+                                  "Time the daemon loop spent taking each snapshot of the state.",
+                                  &daemonMetrics.snapshotTakeTime);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_snapshot_print_nanoseconds",
+                                  "Time the printer thread spent turning each snapshot into text.",
+                                  &daemonMetrics.snapshotPrintTime);
+
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_trace_debounce_nanoseconds",
+                                  "Time from an edge on a node to the node sending the change, for nodes started with -t.",
+                                  &daemonMetrics.traceDebounceTime);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_trace_network_nanoseconds",
+                                  "Time from a node sending a change to the daemon reading it, by the wall clocks.",
+                                  &daemonMetrics.traceNetworkTime);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_trace_apply_nanoseconds",
+                                  "Time from reading a command to the change being made.",
+                                  &daemonMetrics.traceApplyTime);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_trace_enqueue_nanoseconds",
+                                  "Time from reading a command to the change being queued for every listener.",
+                                  &daemonMetrics.traceEnqueueTime);
+    crust_metrics_print_histogram(&buffer,
+                                  "crust_trace_flush_nanoseconds",
+                                  "Time from a change being queued for a listener to it being written to the socket.",
+                                  &markedWriteTime);
+
+    if(crustOptionBatchUpdates)
+    {
+        crust_metrics_print_histogram(&buffer,
+                                      "crust_frame_updates",
+                                      "Updates sent to listeners together in each batch.",
+                                      &daemonMetrics.frameUpdates);
+    }
+    crust_metrics_print_family(&buffer, "crust_deferred_inputs_total", "counter",
+                               "Times a client had commands left over at the end of its turn.");
+    crust_metrics_print_value(&buffer, "crust_deferred_inputs_total", NULL, daemonMetrics.deferredInputs);
+    crust_metrics_print_family(&buffer, "crust_coalescing_sessions", "gauge",
+                                 "Listeners too far behind to be sent each update.");
+    crust_metrics_print_value(&buffer, "crust_coalescing_sessions", NULL, daemonMetrics.coalescingSessions);
+    crust_metrics_print_family(&buffer, "crust_coalesced_updates_total", "counter",
+                               "Updates held back from listeners that were too far behind.");
+    crust_metrics_print_value(&buffer, "crust_coalesced_updates_total", NULL, daemonMetrics.coalescedUpdates);
+    crust_metrics_print_family(&buffer, "crust_lagging_disconnects_total", "counter",
+                               "Listeners disconnected for not catching up in time.");
+    crust_metrics_print_value(&buffer, "crust_lagging_disconnects_total", NULL, daemonMetrics.laggingDisconnects);
+
+    if(core == daemonCores[0] && crustOptionViewName[0] != '\0')
+    {
+        crust_metrics_print_family(&buffer, "crust_view_publishes_total", "counter",
+                                   "Times the state was copied into the shared memory view.");
+        crust_metrics_print_value(&buffer, "crust_view_publishes_total", NULL, daemonView.publishes);
+    }
+
+    if(core == daemonCores[0] && crustOptionMulticast)
+    {
+        crust_metrics_print_family(&buffer, "crust_multicast_datagrams_total", "counter",
+                                   "Datagrams sent to the multicast group.");
+        crust_metrics_print_value(&buffer, "crust_multicast_datagrams_total", NULL, daemonMulticast.datagrams);
+        crust_metrics_print_family(&buffer, "crust_multicast_dropped_datagrams_total", "counter",
+                                   "Datagrams dropped because the multicast socket was full.");
+        crust_metrics_print_value(&buffer, "crust_multicast_dropped_datagrams_total", NULL,
+                                  daemonMulticast.droppedDatagrams);
+    }
+
+    if(crustOptionJournalPath[0] != '\0')
+    {
+        crust_daemon_print_journal_metrics(&buffer, core->journal);
+    }
+
+    crust_daemon_session_write(session, buffer->buffer);
+    free(buffer->buffer);
+    free(buffer);
+}
+
+/*
+ * Creates a core for another layout, which sends its changes to the listeners connected to it and records them in its
+ * own journal.
+ */
+CRUST_CORE * crust_daemon_core_add()
+{
+    CRUST_CORE * core;
+
+    crust_core_init(&core);
+    core->writeToListeners = crust_daemon_write_to_listeners;
+    core->sendState = crust_daemon_session_send_state;
+    core->sendMetrics = crust_daemon_session_send_metrics;
+    core->recordTrackCircuit = crust_journal_track_circuit;
+    core->recordEnableBerth = crust_journal_enable_berth;
+    core->recordHeadcode = crust_journal_headcode;
+    core->journal = &daemonJournals[daemonCoreCount];
+    if(crustOptionBatchUpdates)
+    {
+        crust_dynamic_print_buffer_init(&daemonFrames[daemonCoreCount].buffer);
+        crust_daemon_frame_reset(&daemonFrames[daemonCoreCount]);
+    }
+    core->owner = &daemonFrames[daemonCoreCount];
+    daemonCores[daemonCoreCount++] = core;
+
+    return core;
+}
+
+// Builds the layout from the config file named by -c.
+void crust_daemon_read_config()
+{
+    switch(crust_core_read_config(daemonCores[0], crustOptionDaemonConfigFilePath))
+    {
+        case 0:
+            break;
+
+        case 1:
+            crust_terminal_print("Failed to open config file.");
+            exit(EXIT_FAILURE);
+
+        default:
+            crust_terminal_print("Invalid initial config.");
+            exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Loads the layout from the image named by -b. Returns false if the image is older than the config file, in which case
+ * the config file should be read instead.
+ */
+bool crust_daemon_load_image()
+{
+    const char * sourcePath = crustOptionDaemonConfigFilePath[0] != '\0' ? crustOptionDaemonConfigFilePath : NULL;
+
+    switch(crust_image_load(daemonCores[0]->state, crustOptionLayoutImagePath, sourcePath))
+    {
+        case 0:
+            return true;
+
+        case 1:
+            crust_terminal_print("Failed to open layout image.");
+            exit(EXIT_FAILURE);
+
+        case 2:
+            crust_terminal_print("Unrecognised layout image.");
+            exit(EXIT_FAILURE);
+
+        case 3:
+            crust_terminal_print_verbose("Layout image is out of date, reading config instead.");
+            return false;
+
+        default:
+            crust_terminal_print("Layout image is damaged.");
+            exit(EXIT_FAILURE);
+    }
 }
 
-void crust_write_to_listeners(char * message)
+/*
+ * Builds the layout from the image named by -b, or from the config file named by -c if there is no usable image.
+ * Returns false if there is neither.
+ */
+bool crust_daemon_load_layout()
 {
-    for(int i = 0; i < daemonSessionListLength; i++)
+    crust_daemon_core_add();
+
+    if(crustOptionLayoutImagePath[0] != '\0')
     {
-        if(daemonSessionList[i]->listening && !(daemonSessionList[i]->closed))
+        crust_terminal_print_verbose("Loading layout image...");
+        if(crust_daemon_load_image())
         {
-            crust_connection_write(daemonSessionList[i]->connection, message);
+            return true;
         }
     }
+
+    if(crustOptionDaemonConfigFilePath[0] != '\0')
+    {
+        crust_terminal_print_verbose("Reading config...");
+        crust_daemon_read_config();
+        return true;
+    }
+
+    return false;
 }
 
 /*
- * Takes a pointer to a CRUST message and the length of the message and returns the detected opcode. If there is an input
- * to go with the operation, fills operationInput. See CRUST_MIXED_OPERATION_INPUT for details. If the opcode is not
- * recognised or there is an error, returns NO_OPERATION.
+ * Fills path with the name of the file a layout keeps in place of the one named by basePath: basePath itself for the
+ * first layout, and basePath followed by a dot and the port for the layouts given by -x.
  */
-CRUST_OPCODE crust_daemon_interpret_message(char * message, CRUST_MIXED_OPERATION_INPUT * operationInput)
+void crust_daemon_layout_path(char * path, const char * basePath, unsigned int layout)
 {
-    // Return NOP if the message is too short
-    if(strlen(message) < 2)
+    if(layout == 0)
     {
-        return NO_OPERATION;
+        strncpy(path, basePath, PATH_MAX);
+        path[PATH_MAX - 1] = '\0';
     }
-
-    switch(message[0])
+    else if(snprintf(path, PATH_MAX, "%s.%u", basePath, crustOptionExtraLayouts[layout - 1].port) >= PATH_MAX)
     {
-        case 'B':
-            switch(message[1])
-            {
-                case 'S':
-                    operationInput->manualStepInstruction = malloc(sizeof(CRUST_BERTH_STEP_INSTRUCTION));
-                    if(crust_interpret_berth_step_instruction(&message[2], operationInput->manualStepInstruction))
-                    {
-                        crust_terminal_print_verbose("Invalid manual step instruction");
-                        free(operationInput->manualStepInstruction);
-                        return NO_OPERATION;
-                    }
-                    return BERTH_STEP;
-            }
-
-        case 'C':
-            switch(message[1])
-            {
-                case 'C':
-                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
-                    {
-                        crust_terminal_print_verbose("Invalid identifier");
-                        return NO_OPERATION;
-                    }
-                    return CLEAR_TRACK_CIRCUIT;
-
-                default:
-                    return NO_OPERATION;
-            }
-
-        case 'E':
-            switch(message[1])
-            {
-                case 'U':
-                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
-                    {
-                        crust_terminal_print_verbose("Invalid identifier");
-                        return NO_OPERATION;
-                    }
-                    return ENABLE_BERTH_UP;
-
-                case 'D':
-                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
-                    {
-                        crust_terminal_print_verbose("Invalid identifier");
-                        return NO_OPERATION;
-                    }
-                    return ENABLE_BERTH_DOWN;
-
-                default:
-                    return NO_OPERATION;
-            }
-
-        case 'I':
-            switch(message[1])
-            {
-                case 'B':
-                    // Initialise a block and try to fill it.
-                    crust_block_init(&operationInput->block, state);
-                    if(crust_interpret_block(&message[2], operationInput->block, state))
-                    {
-                        crust_terminal_print_verbose("Invalid block description message");
-                        free(operationInput->block);
-                        return NO_OPERATION;
-                    }
-                    return INSERT_BLOCK;
-
-                case 'C':
-                    crust_track_circuit_init(&operationInput->trackCircuit, state);
-                    if(crust_interpret_track_circuit(&message[2], operationInput->trackCircuit, state))
-                    {
-                        crust_terminal_print_verbose("Invalid circuit member list");
-                        free(operationInput->trackCircuit);
-                        return NO_OPERATION;
-                    }
-                    return INSERT_TRACK_CIRCUIT;
-
-                case 'P':
-                    operationInput->interposeInstruction = malloc(sizeof(CRUST_INTERPOSE_INSTRUCTION));
-                    if(crust_interpret_interpose_instruction(&message[2], operationInput->interposeInstruction))
-                    {
-                        crust_terminal_print_verbose("Invalid interpose instruction");
-                        free(operationInput->interposeInstruction);
-                        return NO_OPERATION;
-                    }
-                    return INTERPOSE;
-
-
-                default:
-                    return NO_OPERATION;
-            }
-
-        case 'O':
-            switch(message[1])
-            {
-                case 'C':
-                    if(crust_interpret_identifier(&message[2], &operationInput->identifier))
-                    {
-                        crust_terminal_print_verbose("Invalid identifier");
-                        return NO_OPERATION;
-                    }
-                    return OCCUPY_TRACK_CIRCUIT;
-            }
-
-        case 'R':
-            switch(message[1])
-            {
-                case 'S':
-                    return RESEND_STATE;
-
-                default:
-                    return NO_OPERATION;
-            }
-
-        case 'S':
-            switch(message[1])
-            {
-                case 'L':
-                    return START_LISTENING;
-
-                default:
-                    return NO_OPERATION;
-            }
-
-        default:
-            return NO_OPERATION;
+        crust_terminal_print("Checkpoint or journal path too long");
+        exit(EXIT_FAILURE);
     }
 }
 
-void crust_daemon_process_opcode(CRUST_OPCODE opcode, CRUST_MIXED_OPERATION_INPUT * operationInput, CRUST_SESSION * session)
+/*
+ * Restores the runtime state of a layout from its checkpoint and journal, named as by crust_daemon_layout_path() from
+ * -s and -j, then starts recording further changes in both. Either may be missing.
+ */
+void crust_daemon_restore_state(unsigned int layout)
 {
-    CRUST_WRITE * write;
-    CRUST_TRACK_CIRCUIT * identifiedTrackCircuit;
-    CRUST_BLOCK * sourceBlock;
-    CRUST_BLOCK * targetBlock;
-    CRUST_BLOCK ** affectedBlocks = NULL;
-    size_t affectedBlockCount = 0;
-    char * writeBuffer;
+    char statusText[CRUST_MAX_MESSAGE_LENGTH];
+    char checkpointPath[PATH_MAX];
+    char journalPath[PATH_MAX];
+    CRUST_STATE * state = daemonCores[layout]->state;
+    u_int64_t journalSequence = 0;
 
-    // Process the user's operation
-    switch(opcode)
+    // Without a checkpoint the whole journal is replayed
+    if(crustOptionCheckpointPath[0] != '\0')
     {
-        // Attempt to insert a block and generate the appropriate response
-        case INSERT_BLOCK:
-            crust_terminal_print_verbose("OPCODE: Insert Block");
-            switch(crust_block_insert(operationInput->block, state))
-            {
-                case 0:
-                    crust_terminal_print_verbose("Block inserted successfully");
-                    crust_print_block(operationInput->block, &writeBuffer);
-                    crust_write_to_listeners(writeBuffer);
-                    free(writeBuffer);
-                    writeBuffer = NULL;
-                    break;
-
-                case 1:
-                    crust_terminal_print_verbose("Failed to insert block - name is not unique");
-                    if(operationInput->block->blockName != NULL)
-                    {
-                        free(operationInput->block->blockName);
-                    }
-                    free(operationInput->block);
-                    break;
-
-                case 2:
-                    crust_terminal_print_verbose("Failed to insert block - conflicting link(s)");
-                    if(operationInput->block->blockName != NULL)
-                    {
-                        free(operationInput->block->blockName);
-                    }
-                    free(operationInput->block);
-                    break;
-
-                case 3:
-                    crust_terminal_print_verbose("Failed to insert block - no links");
-                    if(operationInput->block->blockName != NULL)
-                    {
-                        free(operationInput->block->blockName);
-                    }
-                    free(operationInput->block);
-                    break;
-
-                case 4:
-                    crust_terminal_print_verbose("Cannot insert more blocks after track circuits have been inserted");
-                    if(operationInput->block->blockName != NULL)
-                    {
-                        free(operationInput->block->blockName);
-                    }
-                    free(operationInput->block);
-                    break;
-            }
-            break;
+        crust_daemon_layout_path(checkpointPath, crustOptionCheckpointPath, layout);
+        switch(crust_checkpoint_restore(state, checkpointPath, &journalSequence))
+        {
+            case 0:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Runtime state restored from %s.", checkpointPath);
+                crust_terminal_print_verbose(statusText);
+                break;
 
-        case INSERT_TRACK_CIRCUIT:
-            crust_terminal_print_verbose("OPCODE: Insert track circuit");
-            switch(crust_track_circuit_insert(operationInput->trackCircuit, state))
-            {
-                case 0:
-                    crust_terminal_print_verbose("Track circuit inserted successfully.");
-                    crust_print_track_circuit(operationInput->trackCircuit, &writeBuffer);
-                    crust_write_to_listeners(writeBuffer);
-                    free(writeBuffer);
-                    writeBuffer = NULL;
-                    break;
-
-                case 1:
-                    crust_terminal_print_verbose("Failed to insert track circuit - no blocks");
-                    free(operationInput->trackCircuit->blocks);
-                    free(operationInput->trackCircuit);
-                    break;
-
-                case 2:
-                    crust_terminal_print_verbose("Failed to insert track circuit - blocks already part of a different track circuit");
-                    free(operationInput->trackCircuit->blocks);
-                    free(operationInput->trackCircuit);
-                    break;
-
-                case 3:
-                    crust_terminal_print_verbose("Failed to insert track circuit - not all blocks are connected together");
-                    free(operationInput->trackCircuit->blocks);
-                    free(operationInput->trackCircuit);
-            }
-            break;
+            case 1:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "No checkpoint found at %s, starting from a clean "
+                                                                   "state.", checkpointPath);
+                crust_terminal_print_verbose(statusText);
+                break;
 
-            // Resend the entire state to the user
-        case RESEND_STATE:
-            if(session == NULL) break;
-            crust_terminal_print_verbose("OPCODE: Resend State");
-            crust_print_state(state, &writeBuffer);
-            crust_connection_write(session->connection, writeBuffer);
-            free(writeBuffer);
-            writeBuffer = NULL;
-            break;
+            case 2:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Unrecognised checkpoint %s, starting from a clean "
+                                                                   "state.", checkpointPath);
+                crust_terminal_print(statusText);
+                break;
 
-            // Send the state then send updates as it changes.
-        case START_LISTENING:
-            if(session == NULL) break;
-            crust_terminal_print_verbose("OPCODE: Start Listening");
-            crust_print_state(state, &writeBuffer);
-            crust_connection_write(session->connection, writeBuffer);
-            free(writeBuffer);
-            writeBuffer = NULL;
-            session->listening = true;
-            break;
+            case 3:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Checkpoint %s does not match the layout, starting "
+                                                                   "from a clean state.", checkpointPath);
+                crust_terminal_print(statusText);
+                break;
 
-        case CLEAR_TRACK_CIRCUIT:
-            if(session == NULL) break;
-            crust_terminal_print_verbose("OPCODE: Clear Track Circuit");
-            if(crust_track_circuit_get(operationInput->identifier, &identifiedTrackCircuit, state)
-               && crust_track_circuit_set_occupation(identifiedTrackCircuit, false, state, session))
-            {
-                crust_print_track_circuit(identifiedTrackCircuit, &writeBuffer);
-                crust_write_to_listeners(writeBuffer);
-                free(writeBuffer);
-                writeBuffer = NULL;
-            }
-            break;
+            default:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Checkpoint %s is damaged, starting from a clean "
+                                                                   "state.", checkpointPath);
+                crust_terminal_print(statusText);
+                break;
+        }
+    }
 
-        case OCCUPY_TRACK_CIRCUIT:
-            if(session == NULL) break;
-            crust_terminal_print_verbose("OPCODE: Occupy Track Circuit");
-            if(crust_track_circuit_get(operationInput->identifier, &identifiedTrackCircuit, state)
-               && crust_track_circuit_set_occupation(identifiedTrackCircuit, true, state, session))
-            {
-                crust_print_track_circuit(identifiedTrackCircuit, &writeBuffer);
-                crust_write_to_listeners(writeBuffer);
-                free(writeBuffer);
-                writeBuffer = NULL;
-                affectedBlockCount = crust_headcode_auto_advance(identifiedTrackCircuit, &affectedBlocks, state);
-                for(int i = 0; i < affectedBlockCount; i++)
+    if(crustOptionJournalPath[0] != '\0')
+    {
+        unsigned int numReplayed;
+        u_int64_t numLost;
+        crust_daemon_layout_path(journalPath, crustOptionJournalPath, layout);
+        switch(crust_journal_start(&daemonJournals[layout], journalPath, journalSequence, state, &numReplayed, &numLost))
+        {
+            case 0:
+                snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Replayed %u records from %s.", numReplayed,
+                         journalPath);
+                crust_terminal_print_verbose(statusText);
+                if(numLost)
                 {
-                    crust_print_block(affectedBlocks[i], &writeBuffer);
-                    crust_write_to_listeners(writeBuffer);
-                    free(writeBuffer);
-                    writeBuffer = NULL;
+                    snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1,
+                             "%llu changes were dropped from %s, the restored state may be out of date.",
+                             (unsigned long long)numLost, journalPath);
+                    crust_terminal_print(statusText);
                 }
-                free(affectedBlocks);
-                affectedBlocks = NULL;
-                affectedBlockCount = 0;
-            }
-            break;
+                break;
 
-        case ENABLE_BERTH_UP:
-            crust_terminal_print_verbose("OPCODE: Enable Berth UP");
-            if(crust_block_get(operationInput->identifier, &targetBlock, state)
-                && crust_enable_berth(targetBlock, UP, state))
-            {
-                crust_print_block(targetBlock, &writeBuffer);
-                crust_write_to_listeners(writeBuffer);
-                free(writeBuffer);
-                writeBuffer = NULL;
-            }
-            break;
+            case 1:
+                crust_terminal_print("Failed to open journal.");
+                exit(EXIT_FAILURE);
 
-        case ENABLE_BERTH_DOWN:
-            crust_terminal_print_verbose("OPCODE: Enable Berth DOWN");
-            if(crust_block_get(operationInput->identifier, &targetBlock, state)
-               && crust_enable_berth(targetBlock, DOWN, state))
-            {
-                crust_print_block(targetBlock, &writeBuffer);
-                crust_write_to_listeners(writeBuffer);
-                free(writeBuffer);
-                writeBuffer = NULL;
-            }
-            break;
+            default:
+                crust_terminal_print("Failed to read journal.");
+                exit(EXIT_FAILURE);
+        }
+    }
 
-        case INTERPOSE:
-            crust_terminal_print_verbose("OPCODE: Interpose");
-            if(!crust_block_get(operationInput->interposeInstruction->blockID, &targetBlock, state))
-            {
-                crust_terminal_print_verbose("Invalid block");
-                break;
-            }
-            if(!crust_interpose(targetBlock, operationInput->interposeInstruction->headcode))
-            {
-                crust_terminal_print_verbose("Block is not a berth");
+    if(crustOptionCheckpointPath[0] != '\0')
+    {
+        crust_checkpoint_start(&daemonCheckpointWriters[layout], checkpointPath, state, &daemonJournals[layout]);
+    }
+}
+
+// Builds each of the layouts given by -x and restores their runtime state.
+void crust_daemon_load_extra_layouts()
+{
+    char statusText[CRUST_MAX_MESSAGE_LENGTH];
+
+    for(unsigned int i = 0; i < crustOptionExtraLayoutCount; i++)
+    {
+        CRUST_CORE * core = crust_daemon_core_add();
+        switch(crust_core_read_config(core, crustOptionExtraLayouts[i].configFilePath))
+        {
+            case 0:
                 break;
-            }
 
-            crust_print_block(targetBlock, &writeBuffer);
-            crust_write_to_listeners(writeBuffer);
-            free(writeBuffer);
-            writeBuffer = NULL;
-            break;
+            case 1:
+                crust_terminal_print("Failed to open layout config file.");
+                exit(EXIT_FAILURE);
 
-        case BERTH_STEP:
-            crust_terminal_print_verbose("OPCODE: Berth Step");
-            if(!crust_block_get(operationInput->manualStepInstruction->sourceBlockID, &sourceBlock, state))
-            {
-                crust_terminal_print_verbose("Invalid source block");
-            }
-            if(!crust_block_get(operationInput->manualStepInstruction->destinationBlockID, &targetBlock, state))
-            {
-                crust_terminal_print_verbose("Invalid destination block");
-            }
-            if(!crust_headcode_advance(sourceBlock, targetBlock))
-            {
-                crust_terminal_print_verbose("Failed to step headcode");
-            }
+            default:
+                crust_terminal_print("Invalid layout config.");
+                exit(EXIT_FAILURE);
+        }
+        crust_daemon_restore_state(daemonCoreCount - 1);
+        crust_compile_path_circuits(core->state);
+
+        snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Layout %u: %u blocks, %u track circuits, port %u",
+                 daemonCoreCount - 1,
+                 core->state->blockIndexPointer,
+                 core->state->trackCircuitIndexPointer,
+                 crustOptionExtraLayouts[i].port);
+        crust_terminal_print_verbose(statusText);
+    }
+}
 
-            crust_print_block(sourceBlock, &writeBuffer);
-            crust_write_to_listeners(writeBuffer);
-            free(writeBuffer);
-            writeBuffer = NULL;
+/*
+ * Reads the config file and compiles the resulting layout into the image named by -k.
+ */
+void crust_daemon_compile_layout()
+{
+    if(crustOptionDaemonConfigFilePath[0] == '\0')
+    {
+        crust_terminal_print("A config file must be specified with -c to compile a layout image.");
+        exit(EXIT_FAILURE);
+    }
 
-            crust_print_block(targetBlock, &writeBuffer);
-            crust_write_to_listeners(writeBuffer);
-            free(writeBuffer);
-            writeBuffer = NULL;
-            break;
+    crust_daemon_core_add();
+    crust_terminal_print_verbose("Reading config...");
+    crust_daemon_read_config();
 
-            // Do nothing
-        case NO_OPERATION:
-            crust_terminal_print_verbose("OPCODE: No Operation");
+    crust_terminal_print_verbose("Writing layout image...");
+    switch(crust_image_write(daemonCores[0]->state, crustOptionLayoutImagePath, crustOptionDaemonConfigFilePath))
+    {
+        case 0:
             break;
 
-            // Report that the opcode was unrecognised.
+        case 1:
+            crust_terminal_print("Failed to examine config file.");
+            exit(EXIT_FAILURE);
+
         default:
-            crust_terminal_print_verbose("Unrecognised OPCODE");
-            break;
+            crust_terminal_print("Failed to write layout image.");
+            exit(EXIT_FAILURE);
     }
 }
 
-void crust_daemon_read_config()
+/*
+ * Starts timing a command read from a session. A node started with -t follows OC and CC with @ and the wall clock times,
+ * in microseconds, of the edge and of sending the command. They are removed from the command here and used to time the
+ * stages before the command reached the daemon.
+ */
+void crust_daemon_trace_begin(char * message)
 {
-    char line[CRUST_MAX_MESSAGE_LENGTH];
+    daemonTrace.active = true;
+    daemonTrace.applied = false;
+    daemonTrace.receivedAt = crust_metrics_nanoseconds();
 
-    FILE * configFile = fopen(crustOptionDaemonConfigFilePath, "r");
-    if(configFile == NULL)
+    // Other commands may carry an @ of their own, as block names can
+    if(strncmp(message, "OC", 2) && strncmp(message, "CC", 2))
     {
-        crust_terminal_print("Failed to open config file.");
-        exit(EXIT_FAILURE);
+        return;
     }
-    while(fgets(line, CRUST_MAX_MESSAGE_LENGTH, configFile) != NULL)
+    char * edgeTimes = strchr(message, '@');
+    if(edgeTimes == NULL)
     {
-        for(int i = 0; i < CRUST_MAX_MESSAGE_LENGTH; i++)
-        {
-            if(line[i] == '\r' || line[i] == '\n')
-            {
-                line[i] = '\0';
-                break;
-            }
-        }
+        return;
+    }
+    *edgeTimes = '\0';
 
-        CRUST_MIXED_OPERATION_INPUT operationInput;
-        CRUST_OPCODE opcode = crust_daemon_interpret_message(line, &operationInput);
-        if(opcode == NO_OPERATION)
-        {
-            crust_terminal_print("Invalid initial config.");
-            exit(EXIT_FAILURE);
-        }
-        crust_daemon_process_opcode(opcode, &operationInput, NULL);
+    char * endPointer;
+    long long edgeAt = strtoll(edgeTimes + 1, &endPointer, 10);
+    if(*endPointer != ',')
+    {
+        return;
+    }
+    long long sentAt = strtoll(endPointer + 1, &endPointer, 10);
+    if(*endPointer != '\0' || sentAt < edgeAt)
+    {
+        return;
+    }
+    crust_histogram_record(&daemonMetrics.traceDebounceTime, (u_int64_t)(sentAt - edgeAt) * 1000);
+
+    // Only meaningful if the clocks on the node and the daemon agree
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long receivedAt = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if(receivedAt >= sentAt)
+    {
+        crust_histogram_record(&daemonMetrics.traceNetworkTime, (u_int64_t)(receivedAt - sentAt) * 1000);
+    }
+}
+
+void crust_daemon_trace_end()
+{
+    if(daemonTrace.applied)
+    {
+        crust_histogram_record(&daemonMetrics.traceEnqueueTime, crust_metrics_nanoseconds() - daemonTrace.receivedAt);
     }
+    daemonTrace.active = false;
 }
 
 void crust_daemon_handle_socket_connection(CRUST_CONNECTION * connection)
 {
     crust_terminal_print_verbose("New client connection accepted.");
-    crust_daemon_session_list_extend();
+    // Each listening socket is identified by the layout it serves
+    crust_daemon_session_list_extend(daemonCores[connection->parentSocket->customIdentifier]);
     daemonSessionList[daemonSessionListLength - 1]->connection = connection;
     connection->customIdentifier = (long long)daemonSessionListLength - 1;
+
+    // The connections are dealt out to the workers in turn
+    if(crustOptionWorkerCount)
+    {
+        daemonSessionList[daemonSessionListLength - 1]->channel = crust_worker_channel_open(
+                &daemonWorkers[(daemonSessionListLength - 1) % crustOptionWorkerCount],
+                crust_connection_fd(connection));
+        // Without a channel the session is written to by the daemon loop, as it would be with no workers
+        if(daemonSessionList[daemonSessionListLength - 1]->channel == NULL)
+        {
+            crust_terminal_print_verbose("Out of descriptors, writing to the new connection from the daemon loop");
+        }
+    }
 }
 
+// Input is carried out by crust_daemon_service_input() once every connection has been read.
 void crust_daemon_handle_read(CRUST_CONNECTION * connection)
 {
-    size_t readBufferLength = strlen(connection->readBuffer);
+    daemonSessionList[connection->customIdentifier]->inputPending = true;
+    daemonInputPending = true;
+}
+
+/*
+ * Carries out up to budget of the commands waiting in a session's read buffer and adds the number carried out to
+ * executed. Returns true if complete commands remain.
+ */
+bool crust_daemon_session_execute(CRUST_SESSION * session, unsigned int budget, unsigned int * executed)
+{
+    CRUST_CONNECTION * connection = session->connection;
+    if(connection->readBuffer == NULL)
+    {
+        return false;
+    }
+
     char * instructionStart = connection->readBuffer;
-    for(size_t i = 0; i < readBufferLength; i++)
+    char * instructionEnd;
+    unsigned int commands = 0;
+    while(commands < budget && (instructionEnd = strchr(instructionStart, '\n')) != NULL)
     {
-        if(connection->readBuffer[i] == '\n')
+        *instructionEnd = '\0';
+        crust_daemon_trace_begin(instructionStart);
+        if(daemonRecording != NULL && session->core == daemonCores[0])
         {
-            connection->readBuffer[i] = '\0';
-            CRUST_MIXED_OPERATION_INPUT operationInput;
-            CRUST_OPCODE opcode = crust_daemon_interpret_message(instructionStart, &operationInput);
-            crust_daemon_process_opcode(opcode, &operationInput, daemonSessionList[connection->customIdentifier]);
-            connection->readTo = i;
-            instructionStart = &connection->readBuffer[i + 1];
+            fprintf(daemonRecording, "%lld %lld %s\n",
+                    crust_daemon_milliseconds() - daemonRecordingStart,
+                    connection->customIdentifier,
+                    instructionStart);
         }
+        crust_core_execute(session->core, instructionStart, session);
+        crust_daemon_trace_end();
+        instructionStart = instructionEnd + 1;
+        commands++;
     }
+    connection->readTo = instructionStart - connection->readBuffer;
+    crust_connection_consume(connection);
+    *executed += commands;
+
+    return connection->readBuffer != NULL && strchr(connection->readBuffer, '\n') != NULL;
 }
 
-void crust_daemon_handle_close(CRUST_CONNECTION * connection)
+/*
+ * Carries out the commands received from clients, a limited number per session on each pass of the daemon loop so
+ * that one busy client cannot hold up the others. Nodes go first so that occupancy changes are never stuck behind
+ * other work. The rest take turns to go first. A session with commands left over is not read from again until it
+ * has caught up.
+ */
+void crust_daemon_service_input()
 {
-    char * writeBuffer;
+    if(!daemonInputPending)
+    {
+        return;
+    }
+    daemonInputPending = false;
 
-    crust_terminal_print_verbose("Client connection closed.");
-    CRUST_SESSION * session = daemonSessionList[connection->customIdentifier];
-    session->closed = true;
-    session->connection = NULL;
-    if(session->ownsCircuits)
+    unsigned int executed = 0;
+    for(int priority = 1; priority >= 0; priority--)
     {
-        for(unsigned int i = 0; i < state->trackCircuitIndexPointer; i++)
+        for(size_t n = 0; n < daemonSessionListLength; n++)
         {
-            if(state->trackCircuitIndex[i]->owningSession == session)
+            size_t i = priority ? n : (daemonInputTurn + n) % daemonSessionListLength;
+            CRUST_SESSION * session = daemonSessionList[i];
+            if(!session->inputPending || session->closed || session->ownsCircuits != (bool)priority)
+            {
+                continue;
+            }
+
+            bool remaining = true;
+            if(priority || executed < CRUST_LOOP_COMMAND_BUDGET)
             {
-                state->trackCircuitIndex[i]->owningSession = NULL;
-                crust_print_track_circuit(state->trackCircuitIndex[i], &writeBuffer);
-                crust_write_to_listeners(writeBuffer);
-                free(writeBuffer);
+                remaining = crust_daemon_session_execute(session,
+                                                         priority ? CRUST_NODE_COMMAND_BUDGET
+                                                                  : CRUST_CLIENT_COMMAND_BUDGET,
+                                                         &executed);
             }
+            if(remaining)
+            {
+                daemonMetrics.deferredInputs++;
+                daemonInputPending = true;
+            }
+            session->inputPending = remaining;
+            crust_connection_set_reading(session->connection, !remaining);
         }
     }
+    if(daemonSessionListLength)
+    {
+        daemonInputTurn = (daemonInputTurn + 1) % daemonSessionListLength;
+    }
+}
+
+void crust_daemon_handle_close(CRUST_CONNECTION * connection)
+{
+    crust_terminal_print_verbose("Client connection closed.");
+    CRUST_SESSION * session = daemonSessionList[connection->customIdentifier];
+    session->closed = true;
+    session->connection = NULL;
+    if(session->channel != NULL)
+    {
+        crust_worker_channel_close(session->channel);
+        session->channel = NULL;
+    }
+    if(session->coalescing)
+    {
+        crust_daemon_session_stop_coalescing(session);
+    }
+    crust_core_release_session(session->core, session);
 }
 
 _Noreturn void crust_daemon_loop()
 {
+    bool checkpointing = crustOptionCheckpointPath[0] != '\0';
+    bool publishing = crustOptionViewName[0] != '\0';
+    long long nextCheckpoint = crust_daemon_milliseconds() + CRUST_CHECKPOINT_INTERVAL;
+    long long nextCarousel = crust_daemon_milliseconds();
+    long long nextFlush = 0;
+
+    // Nobody was listening while the layouts were loaded
+    if(daemonFramesPending)
+    {
+        for(unsigned int i = 0; i < daemonCoreCount; i++)
+        {
+            crust_daemon_frame_reset(daemonCores[i]->owner);
+        }
+        daemonFramesPending = false;
+    }
+    // The multicast group is sent the layouts as they stand by the first carousel instead
+    if(crustOptionMulticast)
+    {
+        crust_multicast_discard(&daemonMulticast);
+    }
+
     for(;;)
     {
-        crust_connectivity_execute(-1);
+        if(daemonStopSignal)
+        {
+            crust_daemon_handle_stop_signal();
+        }
+
+        int timeout = -1;
+        if(checkpointing)
+        {
+            long long untilCheckpoint = nextCheckpoint - crust_daemon_milliseconds();
+            timeout = untilCheckpoint > 0 ? (int)untilCheckpoint : 0;
+        }
+
+        if(crustOptionMulticast)
+        {
+            long long untilCarousel = nextCarousel - crust_daemon_milliseconds();
+            if(crust_multicast_state_due(&daemonMulticast) != -1)
+            {
+                long long untilPart = crust_multicast_state_due(&daemonMulticast) - crust_daemon_milliseconds();
+                untilCarousel = untilPart < untilCarousel ? untilPart : untilCarousel;
+            }
+            untilCarousel = untilCarousel > 0 ? untilCarousel : 0;
+            timeout = timeout >= 0 && timeout < untilCarousel ? timeout : (int)untilCarousel;
+        }
+
+        // Hold batched updates back until the end of the tick
+        if(daemonFramesPending && crustOptionBatchInterval)
+        {
+            long long untilFlush = nextFlush - crust_daemon_milliseconds();
+            untilFlush = untilFlush > 0 ? untilFlush : 0;
+            timeout = timeout >= 0 && timeout < untilFlush ? timeout : (int)untilFlush;
+        }
+
+        // Don't wait for anything new while there are commands still to carry out
+        if(daemonInputPending)
+        {
+            timeout = 0;
+        }
+
+        crust_connectivity_execute(timeout);
+        crust_daemon_service_input();
+
+        // Readers of the view see the state as it stands after each round of input, before any batching
+        if(publishing)
+        {
+            crust_view_publish(&daemonView, daemonCores[0]->state);
+        }
+
+        // The multicast group is sent each round of updates whole, whether or not listeners are batched
+        if(crustOptionMulticast)
+        {
+            crust_multicast_flush(&daemonMulticast);
+            crust_multicast_send_state(&daemonMulticast, crust_daemon_milliseconds());
+            if(crust_daemon_milliseconds() >= nextCarousel)
+            {
+                // A carousel still being printed or sent is not doubled up behind a slow printer or a busy loop
+                if(!daemonCarouselPending && crust_multicast_state_due(&daemonMulticast) == -1)
+                {
+                    crust_daemon_send_carousel();
+                }
+                nextCarousel = crust_daemon_milliseconds() + CRUST_MULTICAST_CAROUSEL_INTERVAL;
+            }
+        }
+
+        if(daemonFramesPending && crust_daemon_milliseconds() >= nextFlush)
+        {
+            crust_daemon_flush_frames();
+            nextFlush = crust_daemon_milliseconds() + (long long)crustOptionBatchInterval;
+        }
+        crust_daemon_service_lagging_sessions();
+
+        if(checkpointing && crust_daemon_milliseconds() >= nextCheckpoint)
+        {
+            for(unsigned int i = 0; i < daemonCoreCount; i++)
+            {
+                crust_checkpoint_capture(&daemonCheckpointWriters[i], daemonCores[i]->state);
+            }
+            nextCheckpoint = crust_daemon_milliseconds() + CRUST_CHECKPOINT_INTERVAL;
+        }
     }
 }
 
@@ -605,6 +1389,12 @@ _Noreturn void crust_daemon_run()
     if(crustOptionConnectionLimit)
     {
         connectionRLimit.rlim_cur = connectionRLimit.rlim_max = crustOptionConnectionLimit;
+        // Each client handed to a worker may take more than one descriptor
+        if(crustOptionWorkerCount)
+        {
+            connectionRLimit.rlim_cur = connectionRLimit.rlim_max = crustOptionConnectionLimit
+                                                                   * CRUST_WORKER_CHANNEL_DESCRIPTORS;
+        }
     }
     else
     {
@@ -648,24 +1438,68 @@ _Noreturn void crust_daemon_run()
     // Register the signal handlers
     signal(SIGINT, crust_daemon_handle_signal);
     signal(SIGTERM, crust_daemon_handle_signal);
+    signal(SIGPIPE, SIG_IGN); // Clients that vanish are noticed by poll instead
+
+    if(crustOptionMulticast)
+    {
+        crust_multicast_open(&daemonMulticast, crustOptionMulticastGroup, crustOptionMulticastPort, crustOptionIPAddress);
+    }
 
     crust_terminal_print_verbose("Building initial state...");
 
+    bool layoutLoaded = crust_daemon_load_layout();
 
-    crust_state_init(&state);
+    crust_daemon_restore_state(0);
 
-    if(crustOptionDaemonConfigFilePath[0] != '\0')
+    if(layoutLoaded)
     {
-        crust_terminal_print_verbose("Reading config...");
-        crust_daemon_read_config();
+        crust_compile_path_circuits(daemonCores[0]->state);
+
+        CRUST_IDENTIFIER numPaths;
+        size_t pathMemory = crust_state_path_memory(daemonCores[0]->state, &numPaths);
+        snprintf(statusText, CRUST_MAX_MESSAGE_LENGTH - 1, "Berth paths: %u paths held in %zu bytes", numPaths, pathMemory);
+        crust_terminal_print_verbose(statusText);
+    }
+
+    crust_daemon_load_extra_layouts();
+
+    if(crustOptionViewName[0] != '\0')
+    {
+        crust_view_open(&daemonView, crustOptionViewName, daemonCores[0]->state);
+    }
+
+    if(crustOptionRecordPath[0] != '\0')
+    {
+        daemonRecording = fopen(crustOptionRecordPath, "w");
+        if(daemonRecording == NULL)
+        {
+            crust_terminal_print("Failed to open the recording file.");
+            exit(EXIT_FAILURE);
+        }
+        daemonRecordingStart = crust_daemon_milliseconds();
     }
 
     crust_terminal_print_verbose("Creating CRUST socket...");
-    daemonSocket = crust_connection_socket_open(crust_daemon_handle_read,
-                                                crust_daemon_handle_socket_connection,
-                                                crust_daemon_handle_close,
-                                                crustOptionIPAddress,
-                                                crustOptionPort);
+    for(unsigned int i = 0; i < daemonCoreCount; i++)
+    {
+        CRUST_CONNECTION * layoutSocket = crust_connection_socket_open(crust_daemon_handle_read,
+                                                                       crust_daemon_handle_socket_connection,
+                                                                       crust_daemon_handle_close,
+                                                                       crustOptionIPAddress,
+                                                                       i ? crustOptionExtraLayouts[i - 1].port
+                                                                         : crustOptionPort);
+        layoutSocket->customIdentifier = i;
+    }
+    daemonPrinterConnection = crust_connection_notify_open(crust_daemon_handle_printed_snapshots);
+    crust_snapshot_printer_start(&daemonSnapshotPrinter, crust_daemon_handle_printer_notification);
+    if(crustOptionWorkerCount)
+    {
+        daemonWorkerConnection = crust_connection_notify_open(crust_daemon_handle_drained_channels);
+    }
+    for(unsigned int i = 0; i < crustOptionWorkerCount; i++)
+    {
+        crust_worker_start(&daemonWorkers[i], crust_daemon_handle_worker_notification);
+    }
 
 #ifdef SYSTEMD
     sd_notify(0, "READY=1\n"
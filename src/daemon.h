@@ -22,16 +22,9 @@
 #define CRUST_DAEMON_H
 
 #include "connectivity.h"
-
-struct crustSession {
-    CRUST_CONNECTION * connection;
-    bool listening;
-    bool closed;
-    bool ownsCircuits;
-};
-
-#define CRUST_SESSION struct crustSession
+#include "session.h"
 
 _Noreturn void crust_daemon_run();
+void crust_daemon_compile_layout();
 
 #endif //CRUST_DAEMON_H
@@ -0,0 +1,418 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * crust-generate writes out a synthetic stretch of double track for scale testing: a daemon init file, a matching
+ * window layout and, optionally, a stream of trains running over it in the format read by crust-replay.
+ *
+ * The down line and the up line are laid side by side, one block per position along the line. Block 0 (the daemon's
+ * initial block) joins the two at the country end. Insertion order fixes the IDs, so the down line block at position i
+ * is always 1 + 2i and the up line block is 2 + 2i. Track circuits alternate in the same way, with the down line circuit
+ * c numbered 2c and the up line circuit 2c + 1. Crossovers join the lines at each junction: one from the down line to the
+ * up line, followed by one back again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "config.h"
+#include "terminal.h"
+
+#define CRUST_GENERATOR struct crustGenerator
+#define CRUST_GENERATE_WINDOW_WIDTH 120 // Positions drawn on each row of the window layout
+#define CRUST_GENERATE_CIRCUITS_PER_NODE 32 // Circuits on each line reported by a single simulated node
+
+struct crustGenerator {
+    double lineLength; // Kilometres
+    unsigned long blockLength; // The rest are metres
+    unsigned long circuitLength;
+    unsigned long berthSpacing;
+    unsigned long junctionSpacing; // 0 for plain line
+    unsigned long trainsPerLine;
+    unsigned long duration; // Seconds
+    unsigned long trainSpeed; // Metres per second
+
+    // Derived from the above
+    unsigned long positions;
+    unsigned long blocksPerCircuit;
+    unsigned long circuitsPerLine;
+    unsigned long berthInterval; // Positions between berths
+    unsigned long junctionInterval; // Positions between junctions, 0 for none
+};
+
+CRUST_GENERATOR generator = {
+        .lineLength = 10,
+        .blockLength = 200,
+        .circuitLength = 400,
+        .berthSpacing = 1600,
+        .junctionSpacing = 5000,
+        .trainsPerLine = 4,
+        .duration = 300,
+        .trainSpeed = 40
+};
+
+unsigned long crust_generate_down_block(unsigned long position)
+{
+    return 1 + 2 * position;
+}
+
+unsigned long crust_generate_up_block(unsigned long position)
+{
+    return 2 + 2 * position;
+}
+
+bool crust_generate_is_junction(unsigned long position)
+{
+    return generator.junctionInterval && position && position % generator.junctionInterval == 0;
+}
+
+bool crust_generate_is_berth(unsigned long position)
+{
+    return position % generator.berthInterval == 0;
+}
+
+// Opens a file for writing, exiting if it can't be opened.
+FILE * crust_generate_open(const char * path)
+{
+    FILE * file = fopen(path, "w");
+    if(file == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\r\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+void crust_generate_init(FILE * initFile)
+{
+    // The blocks, a position at a time
+    for(unsigned long i = 0; i < generator.positions; i++)
+    {
+        if(i == 0)
+        {
+            fprintf(initFile, "IBUM0\nIBUB0\n");
+        }
+        else if(crust_generate_is_junction(i - 1))
+        {
+            // The second half of the junction, back from the up line
+            fprintf(initFile, "IBUM%luUB%lu\nIBUM%lu\n",
+                    crust_generate_down_block(i - 1), crust_generate_up_block(i - 1),
+                    crust_generate_up_block(i - 1));
+        }
+        else if(crust_generate_is_junction(i))
+        {
+            // The first half of the junction, over from the down line
+            fprintf(initFile, "IBUM%lu\nIBUM%luUB%lu\n",
+                    crust_generate_down_block(i - 1),
+                    crust_generate_up_block(i - 1), crust_generate_down_block(i - 1));
+        }
+        else
+        {
+            fprintf(initFile, "IBUM%lu\nIBUM%lu\n", crust_generate_down_block(i - 1), crust_generate_up_block(i - 1));
+        }
+    }
+
+    // The track circuits, alternating between the lines
+    for(unsigned long c = 0; c < generator.circuitsPerLine; c++)
+    {
+        unsigned long first = c * generator.blocksPerCircuit;
+        unsigned long last = first + generator.blocksPerCircuit;
+        if(last > generator.positions)
+        {
+            last = generator.positions;
+        }
+
+        fprintf(initFile, "IC%lu", crust_generate_down_block(first));
+        for(unsigned long i = first + 1; i < last; i++)
+        {
+            fprintf(initFile, "/%lu", crust_generate_down_block(i));
+        }
+        fprintf(initFile, "\nIC%lu", crust_generate_up_block(first));
+        for(unsigned long i = first + 1; i < last; i++)
+        {
+            fprintf(initFile, "/%lu", crust_generate_up_block(i));
+        }
+        fprintf(initFile, "\n");
+    }
+
+    for(unsigned long i = 0; i < generator.positions; i += generator.berthInterval)
+    {
+        fprintf(initFile, "ED%lu\nEU%lu\n", crust_generate_down_block(i), crust_generate_up_block(i));
+    }
+}
+
+/*
+ * Draws both lines as rows of track, wrapped every CRUST_GENERATE_WINDOW_WIDTH positions. Each berth shows its headcode
+ * over the first four blocks from the berth, and each junction is drawn between the lines.
+ */
+void crust_generate_window_layout(FILE * layoutFile)
+{
+    fprintf(layoutFile, "# X,Y,Symbol\n");
+
+    for(unsigned long i = 0; i < generator.positions; i++)
+    {
+        unsigned long x = i % CRUST_GENERATE_WINDOW_WIDTH;
+        unsigned long y = i / CRUST_GENERATE_WINDOW_WIDTH * 4;
+        unsigned long circuit = i / generator.blocksPerCircuit * 2;
+        unsigned long berthPosition = i - i % generator.berthInterval;
+        unsigned long berthCharacter = i - berthPosition;
+
+        // Only draw the headcode where it fits on the berth's own row
+        if(berthCharacter < 4 && berthPosition / CRUST_GENERATE_WINDOW_WIDTH == i / CRUST_GENERATE_WINDOW_WIDTH)
+        {
+            fprintf(layoutFile, "%lu,%lu,-,%lu,%lu,%lu\n", x, y, circuit, crust_generate_down_block(berthPosition), berthCharacter);
+            fprintf(layoutFile, "%lu,%lu,-,%lu,%lu,%lu\n", x, y + 2, circuit + 1, crust_generate_up_block(berthPosition), berthCharacter);
+        }
+        else
+        {
+            fprintf(layoutFile, "%lu,%lu,-,%lu\n", x, y, circuit);
+            fprintf(layoutFile, "%lu,%lu,-,%lu\n", x, y + 2, circuit + 1);
+        }
+
+        if(crust_generate_is_junction(i))
+        {
+            fprintf(layoutFile, "%lu,%lu,\\\n", x, y + 1);
+        }
+        else if(i && crust_generate_is_junction(i - 1))
+        {
+            fprintf(layoutFile, "%lu,%lu,/\n", x, y + 1);
+        }
+    }
+}
+
+// The simulated node that reports a circuit
+unsigned long crust_generate_node(unsigned long circuit)
+{
+    return circuit / 2 / CRUST_GENERATE_CIRCUITS_PER_NODE;
+}
+
+/*
+ * Runs trains over both lines, down trains on the down line and up trains on the up line. Each starts on a berth with a
+ * headcode interposed, then steps a circuit at a time: occupying the circuit ahead and clearing the one behind. The
+ * nodes claim every circuit as clear before the first train moves.
+ */
+void crust_generate_events(FILE * eventFile)
+{
+    unsigned long circuitTime = generator.circuitLength * 1000 / generator.trainSpeed; // Milliseconds
+    unsigned long steps = generator.duration * 1000 / (circuitTime ? circuitTime : 1);
+    unsigned long numBerths = (generator.positions + generator.berthInterval - 1) / generator.berthInterval;
+    unsigned long trains = generator.trainsPerLine < numBerths ? generator.trainsPerLine : numBerths;
+
+    for(unsigned long c = 0; c < generator.circuitsPerLine * 2; c++)
+    {
+        fprintf(eventFile, "0 %lu CC%lu\n", crust_generate_node(c), c);
+    }
+
+    for(unsigned long step = 0; step <= steps; step++)
+    {
+        for(unsigned long t = 0; t < trains; t++)
+        {
+            unsigned long berthPosition = t * numBerths / trains * generator.berthInterval;
+            long long time = (long long)step * circuitTime;
+            char headcode[CRUST_MAX_MESSAGE_LENGTH];
+
+            // Down trains run towards the far end of the line
+            unsigned long downCircuit = berthPosition / generator.blocksPerCircuit + step;
+            if(downCircuit < generator.circuitsPerLine)
+            {
+                unsigned long circuit = downCircuit * 2;
+                if(step == 0)
+                {
+                    snprintf(headcode, sizeof(headcode), "1%c%02lu", 'A' + (int)(t / 100 % 26), t % 100);
+                    fprintf(eventFile, "0 %lu IP%lu/%.4s\n", crust_generate_node(circuit), crust_generate_down_block(berthPosition), headcode);
+                }
+                fprintf(eventFile, "%lld %lu OC%lu\n", time, crust_generate_node(circuit), circuit);
+                if(step)
+                {
+                    fprintf(eventFile, "%lld %lu CC%lu\n", time, crust_generate_node(circuit - 2), circuit - 2);
+                }
+            }
+
+            // Up trains run back towards block 0
+            long upCircuit = (long)(berthPosition / generator.blocksPerCircuit) - (long)step;
+            if(upCircuit >= 0)
+            {
+                unsigned long circuit = upCircuit * 2 + 1;
+                if(step == 0)
+                {
+                    snprintf(headcode, sizeof(headcode), "2%c%02lu", 'A' + (int)(t / 100 % 26), t % 100);
+                    fprintf(eventFile, "0 %lu IP%lu/%.4s\n", crust_generate_node(circuit), crust_generate_up_block(berthPosition), headcode);
+                }
+                fprintf(eventFile, "%lld %lu OC%lu\n", time, crust_generate_node(circuit), circuit);
+                if(step)
+                {
+                    fprintf(eventFile, "%lld %lu CC%lu\n", time, crust_generate_node(circuit + 2), circuit + 2);
+                }
+            }
+        }
+    }
+}
+
+unsigned long crust_generate_parse_number(const char * text)
+{
+    char * endPointer;
+    unsigned long value = strtoul(text, &endPointer, 10);
+    if(*text == '\0' || *endPointer != '\0')
+    {
+        crust_terminal_print("Invalid number specified.");
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char ** argv)
+{
+    char * initPath = NULL;
+    char * layoutPath = NULL;
+    char * eventPath = NULL;
+    char * endPointer;
+
+    int option;
+    while((option = getopt(argc, argv, "b:c:d:e:hj:k:n:r:s:t:w:")) != -1)
+    {
+        switch(option)
+        {
+            case 'b':
+                generator.blockLength = crust_generate_parse_number(optarg);
+                break;
+
+            case 'c':
+                initPath = optarg;
+                break;
+
+            case 'd':
+                generator.duration = crust_generate_parse_number(optarg);
+                break;
+
+            case 'e':
+                eventPath = optarg;
+                break;
+
+            case 'h':
+                crust_terminal_print("Usage: crust-generate [options] -c init_file");
+                crust_terminal_print("  -b  Length of a block in metres (defaults to 200)");
+                crust_terminal_print("  -c  Write the daemon init file to the named path.");
+                crust_terminal_print("  -d  Run the trains for this many seconds (defaults to 300)");
+                crust_terminal_print("  -e  Write a stream of trains running over the line to the named path, for "
+                                     "crust-replay.");
+                crust_terminal_print("  -h  Display this help.");
+                crust_terminal_print("  -j  Distance between junctions in metres, 0 for none (defaults to 5000)");
+                crust_terminal_print("  -k  Length of the line in kilometres (defaults to 10)");
+                crust_terminal_print("  -n  Trains on each line (defaults to 4)");
+                crust_terminal_print("  -r  Speed of the trains in metres per second (defaults to 40)");
+                crust_terminal_print("  -s  Distance between berths in metres (defaults to 1600). The daemon only looks "
+                                     "10 blocks back from a berth for the berth behind it.");
+                crust_terminal_print("  -t  Length of a track circuit in metres (defaults to 400)");
+                crust_terminal_print("  -w  Write a matching window layout to the named path.");
+                exit(EXIT_SUCCESS);
+
+            case 'j':
+                generator.junctionSpacing = crust_generate_parse_number(optarg);
+                break;
+
+            case 'k':
+                generator.lineLength = strtod(optarg, &endPointer);
+                if(*optarg == '\0' || *endPointer != '\0' || generator.lineLength <= 0)
+                {
+                    crust_terminal_print("Invalid line length specified.");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'n':
+                generator.trainsPerLine = crust_generate_parse_number(optarg);
+                break;
+
+            case 'r':
+                generator.trainSpeed = crust_generate_parse_number(optarg);
+                break;
+
+            case 's':
+                generator.berthSpacing = crust_generate_parse_number(optarg);
+                break;
+
+            case 't':
+                generator.circuitLength = crust_generate_parse_number(optarg);
+                break;
+
+            case 'w':
+                layoutPath = optarg;
+                break;
+
+            case '?':
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(initPath == NULL)
+    {
+        crust_terminal_print("An init file must be specified with -c.");
+        exit(EXIT_FAILURE);
+    }
+    if(!generator.blockLength || !generator.trainSpeed)
+    {
+        crust_terminal_print("The block length and train speed must be greater than 0.");
+        exit(EXIT_FAILURE);
+    }
+
+    generator.positions = (unsigned long)(generator.lineLength * 1000 / (double)generator.blockLength);
+    if(generator.positions < 2)
+    {
+        generator.positions = 2;
+    }
+    generator.blocksPerCircuit = generator.circuitLength / generator.blockLength;
+    if(!generator.blocksPerCircuit)
+    {
+        generator.blocksPerCircuit = 1;
+    }
+    generator.circuitsPerLine = (generator.positions + generator.blocksPerCircuit - 1) / generator.blocksPerCircuit;
+    generator.berthInterval = generator.berthSpacing / generator.blockLength;
+    if(!generator.berthInterval)
+    {
+        generator.berthInterval = 1;
+    }
+    generator.junctionInterval = generator.junctionSpacing / generator.blockLength;
+
+    FILE * initFile = crust_generate_open(initPath);
+    crust_generate_init(initFile);
+    fclose(initFile);
+
+    if(layoutPath != NULL)
+    {
+        FILE * layoutFile = crust_generate_open(layoutPath);
+        crust_generate_window_layout(layoutFile);
+        fclose(layoutFile);
+    }
+
+    if(eventPath != NULL)
+    {
+        FILE * eventFile = crust_generate_open(eventPath);
+        crust_generate_events(eventFile);
+        fclose(eventFile);
+    }
+
+    fprintf(stderr, "Generated %lu blocks in %lu track circuits\r\n",
+            generator.positions * 2 + 1,
+            generator.circuitsPerLine * 2);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,554 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "terminal.h"
+
+#define CRUST_IMAGE_ALIGNMENT 8
+
+/*
+ * Works out where each section will sit in the image, filling in the offsets in the header and returning the total
+ * size of the image.
+ */
+size_t crust_image_layout_sections(CRUST_IMAGE_HEADER * header, const size_t * entrySizes)
+{
+    size_t offset = sizeof(CRUST_IMAGE_HEADER);
+    for(int i = 0; i < CRUST_IMAGE_SECTION_COUNT; i++)
+    {
+        offset = (offset + CRUST_IMAGE_ALIGNMENT - 1) & ~(size_t)(CRUST_IMAGE_ALIGNMENT - 1);
+        header->sections[i].offset = offset;
+        offset += header->sections[i].length * entrySizes[i];
+    }
+    return offset;
+}
+
+const size_t crustImageEntrySizes[] = {
+        [CRUST_IMAGE_SECTION_BLOCKS] = sizeof(CRUST_IMAGE_BLOCK),
+        [CRUST_IMAGE_SECTION_TRACK_CIRCUITS] = sizeof(CRUST_IMAGE_TRACK_CIRCUIT),
+        [CRUST_IMAGE_SECTION_IDENTIFIERS] = sizeof(CRUST_IDENTIFIER),
+        [CRUST_IMAGE_SECTION_PATHS] = sizeof(CRUST_IMAGE_PATH),
+        [CRUST_IMAGE_SECTION_PATH_NODES] = sizeof(CRUST_PATH_NODE),
+        [CRUST_IMAGE_SECTION_HEADCODES] = CRUST_HEADCODE_LENGTH,
+        [CRUST_IMAGE_SECTION_NAMES] = 1
+};
+
+/*
+ * Hashes the contents of the file at path into hash. Returns false if the file could not be read.
+ */
+bool crust_image_source_hash(const char * path, u_int64_t * hash)
+{
+    char buffer[CRUST_IMAGE_SOURCE_CHUNK];
+    ssize_t bytesRead;
+
+    int sourceFD = open(path, O_RDONLY);
+    if(sourceFD == -1)
+    {
+        return false;
+    }
+
+    *hash = CRUST_HASH_BASIS;
+    while((bytesRead = read(sourceFD, buffer, CRUST_IMAGE_SOURCE_CHUNK)) > 0)
+    {
+        *hash = crust_hash(*hash, buffer, bytesRead);
+    }
+    close(sourceFD);
+
+    return bytesRead == 0;
+}
+
+/*
+ * Compiles the layout held in state into an image at imagePath. sourcePath names the text file the layout was read
+ * from so that stale images can be detected. The image is written beside its final path and moved into place once
+ * complete. Returns 0 on success or:
+ * 1: The source file could not be examined
+ * 2: The image could not be written
+ */
+int crust_image_write(CRUST_STATE * state, const char * imagePath, const char * sourcePath)
+{
+    CRUST_IMAGE_HEADER header;
+    struct stat sourceStat;
+
+    memset(&header, 0, sizeof(CRUST_IMAGE_HEADER));
+    if(stat(sourcePath, &sourceStat) || !crust_image_source_hash(sourcePath, &header.sourceHash))
+    {
+        return 1;
+    }
+
+    memcpy(header.magic, CRUST_IMAGE_MAGIC, CRUST_IMAGE_MAGIC_LENGTH);
+    header.version = CRUST_IMAGE_VERSION;
+    header.byteOrderMark = CRUST_IMAGE_BYTE_ORDER_MARK;
+    header.sourceSize = sourceStat.st_size;
+
+    // Count everything up so that the image can be built in one buffer
+    size_t numPaths = 0;
+    size_t numIdentifiers = 0;
+    size_t namesLength = 0;
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        numPaths += state->blockIndex[i]->numRearBerths;
+        namesLength += strlen(state->blockIndex[i]->blockName) + 1;
+    }
+    for(CRUST_IDENTIFIER i = 0; i < state->trackCircuitIndexPointer; i++)
+    {
+        numIdentifiers += state->trackCircuitIndex[i]->numBlocks
+                + state->trackCircuitIndex[i]->numUpEdgeBlocks
+                + state->trackCircuitIndex[i]->numDownEdgeBlocks;
+    }
+
+    header.sections[CRUST_IMAGE_SECTION_BLOCKS].length = state->blockIndexPointer;
+    header.sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].length = state->trackCircuitIndexPointer;
+    header.sections[CRUST_IMAGE_SECTION_IDENTIFIERS].length = numIdentifiers;
+    header.sections[CRUST_IMAGE_SECTION_PATHS].length = numPaths;
+    header.sections[CRUST_IMAGE_SECTION_PATH_NODES].length = state->pathNodesInUse;
+    header.sections[CRUST_IMAGE_SECTION_HEADCODES].length = state->blockIndexPointer;
+    header.sections[CRUST_IMAGE_SECTION_NAMES].length = namesLength;
+    size_t imageLength = crust_image_layout_sections(&header, crustImageEntrySizes);
+
+    char * image = calloc(imageLength, 1);
+    if(image == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(image, &header, sizeof(CRUST_IMAGE_HEADER));
+
+    CRUST_IMAGE_BLOCK * imageBlocks = (CRUST_IMAGE_BLOCK *)&image[header.sections[CRUST_IMAGE_SECTION_BLOCKS].offset];
+    CRUST_IMAGE_TRACK_CIRCUIT * imageTrackCircuits = (CRUST_IMAGE_TRACK_CIRCUIT *)&image[header.sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].offset];
+    CRUST_IDENTIFIER * imageIdentifiers = (CRUST_IDENTIFIER *)&image[header.sections[CRUST_IMAGE_SECTION_IDENTIFIERS].offset];
+    CRUST_IMAGE_PATH * imagePaths = (CRUST_IMAGE_PATH *)&image[header.sections[CRUST_IMAGE_SECTION_PATHS].offset];
+    CRUST_PATH_NODE * imagePathNodes = (CRUST_PATH_NODE *)&image[header.sections[CRUST_IMAGE_SECTION_PATH_NODES].offset];
+    char * imageNames = &image[header.sections[CRUST_IMAGE_SECTION_NAMES].offset];
+
+    memcpy(&image[header.sections[CRUST_IMAGE_SECTION_HEADCODES].offset], state->headcodes, state->blockIndexPointer * CRUST_HEADCODE_LENGTH);
+
+    CRUST_IDENTIFIER pathPointer = 0;
+    CRUST_IDENTIFIER pathNodePointer = 0;
+    size_t namesPointer = 0;
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        CRUST_BLOCK * block = state->blockIndex[i];
+        for(int j = 0; j < CRUST_MAX_LINKS; j++)
+        {
+            imageBlocks[i].links[j] = block->links[j] == NULL ? CRUST_IMAGE_NO_ID : block->links[j]->blockId;
+        }
+        imageBlocks[i].trackCircuitId = block->trackCircuit == NULL ? CRUST_IMAGE_NO_ID : block->trackCircuit->trackCircuitId;
+        imageBlocks[i].berth = block->berth;
+        imageBlocks[i].berthDirection = block->berthDirection;
+
+        imageBlocks[i].nameOffset = namesPointer;
+        strcpy(&imageNames[namesPointer], block->blockName);
+        namesPointer += strlen(block->blockName) + 1;
+
+        // Only the nodes still in use are written, so each berth's nodes move up to sit straight after the last
+        imageBlocks[i].pathNodeBase = pathNodePointer;
+        imageBlocks[i].numPathNodes = block->numPathNodes;
+        memcpy(&imagePathNodes[pathNodePointer], &state->pathNodes[block->pathNodeBase], sizeof(CRUST_PATH_NODE) * block->numPathNodes);
+        pathNodePointer += block->numPathNodes;
+
+        imageBlocks[i].pathBase = pathPointer;
+        imageBlocks[i].numRearBerths = block->numRearBerths;
+        for(CRUST_IDENTIFIER j = 0; j < block->numRearBerths; j++)
+        {
+            imagePaths[pathPointer].rearBerthId = block->rearBerths[j]->blockId;
+            imagePaths[pathPointer].lastNode = block->pathsToRearBerths[j].lastNode;
+            imagePaths[pathPointer].numLinkedBlocks = block->pathsToRearBerths[j].numLinkedBlocks;
+            pathPointer++;
+        }
+    }
+
+    CRUST_IDENTIFIER identifierPointer = 0;
+    for(CRUST_IDENTIFIER i = 0; i < state->trackCircuitIndexPointer; i++)
+    {
+        CRUST_TRACK_CIRCUIT * trackCircuit = state->trackCircuitIndex[i];
+
+        imageTrackCircuits[i].blockBase = identifierPointer;
+        imageTrackCircuits[i].numBlocks = trackCircuit->numBlocks;
+        for(CRUST_IDENTIFIER j = 0; j < trackCircuit->numBlocks; j++)
+        {
+            imageIdentifiers[identifierPointer++] = trackCircuit->blocks[j]->blockId;
+        }
+
+        imageTrackCircuits[i].upEdgeBase = identifierPointer;
+        imageTrackCircuits[i].numUpEdgeBlocks = trackCircuit->numUpEdgeBlocks;
+        for(CRUST_IDENTIFIER j = 0; j < trackCircuit->numUpEdgeBlocks; j++)
+        {
+            imageIdentifiers[identifierPointer++] = trackCircuit->upEdgeBlocks[j]->blockId;
+        }
+
+        imageTrackCircuits[i].downEdgeBase = identifierPointer;
+        imageTrackCircuits[i].numDownEdgeBlocks = trackCircuit->numDownEdgeBlocks;
+        for(CRUST_IDENTIFIER j = 0; j < trackCircuit->numDownEdgeBlocks; j++)
+        {
+            imageIdentifiers[identifierPointer++] = trackCircuit->downEdgeBlocks[j]->blockId;
+        }
+    }
+
+    // Write beside the final path then move the image into place so that a daemon never maps half an image
+    char * temporaryPath;
+    asprintf(&temporaryPath, "%s.tmp", imagePath);
+    FILE * imageFile = fopen(temporaryPath, "wb");
+    if(imageFile == NULL)
+    {
+        free(temporaryPath);
+        free(image);
+        return 2;
+    }
+    bool written = fwrite(image, 1, imageLength, imageFile) == imageLength;
+    written = !fclose(imageFile) && written;
+    if(!written || rename(temporaryPath, imagePath))
+    {
+        unlink(temporaryPath);
+        free(temporaryPath);
+        free(image);
+        return 2;
+    }
+
+    free(temporaryPath);
+    free(image);
+    return 0;
+}
+
+/*
+ * Checks that a section lies within the image and is suitably aligned.
+ */
+bool crust_image_section_valid(const CRUST_IMAGE_HEADER * header, enum crustImageSectionType section, size_t imageLength)
+{
+    u_int64_t offset = header->sections[section].offset;
+    u_int64_t length = header->sections[section].length;
+    return offset % CRUST_IMAGE_ALIGNMENT == 0
+        && offset <= imageLength
+        && length <= (imageLength - offset) / crustImageEntrySizes[section];
+}
+
+/*
+ * Checks every ID and offset in an image so that nothing built from it can point outside the layout.
+ */
+bool crust_image_contents_valid(const CRUST_IMAGE_HEADER * header, const char * image)
+{
+    const CRUST_IMAGE_BLOCK * imageBlocks = (const CRUST_IMAGE_BLOCK *)&image[header->sections[CRUST_IMAGE_SECTION_BLOCKS].offset];
+    const CRUST_IMAGE_TRACK_CIRCUIT * imageTrackCircuits = (const CRUST_IMAGE_TRACK_CIRCUIT *)&image[header->sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].offset];
+    const CRUST_IDENTIFIER * imageIdentifiers = (const CRUST_IDENTIFIER *)&image[header->sections[CRUST_IMAGE_SECTION_IDENTIFIERS].offset];
+    const CRUST_IMAGE_PATH * imagePaths = (const CRUST_IMAGE_PATH *)&image[header->sections[CRUST_IMAGE_SECTION_PATHS].offset];
+    const CRUST_PATH_NODE * imagePathNodes = (const CRUST_PATH_NODE *)&image[header->sections[CRUST_IMAGE_SECTION_PATH_NODES].offset];
+    const char * imageNames = &image[header->sections[CRUST_IMAGE_SECTION_NAMES].offset];
+
+    u_int64_t numBlocks = header->sections[CRUST_IMAGE_SECTION_BLOCKS].length;
+    u_int64_t numTrackCircuits = header->sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].length;
+    u_int64_t numIdentifiers = header->sections[CRUST_IMAGE_SECTION_IDENTIFIERS].length;
+    u_int64_t numPaths = header->sections[CRUST_IMAGE_SECTION_PATHS].length;
+    u_int64_t numPathNodes = header->sections[CRUST_IMAGE_SECTION_PATH_NODES].length;
+    u_int64_t namesLength = header->sections[CRUST_IMAGE_SECTION_NAMES].length;
+
+    if(!numBlocks
+       || numBlocks >= CRUST_IMAGE_NO_ID
+       || header->sections[CRUST_IMAGE_SECTION_HEADCODES].length != numBlocks
+       || !namesLength
+       || imageNames[namesLength - 1] != '\0')
+    {
+        return false;
+    }
+
+    for(u_int64_t i = 0; i < numBlocks; i++)
+    {
+        for(int j = 0; j < CRUST_MAX_LINKS; j++)
+        {
+            if(imageBlocks[i].links[j] != CRUST_IMAGE_NO_ID && imageBlocks[i].links[j] >= numBlocks)
+            {
+                return false;
+            }
+        }
+        if((imageBlocks[i].trackCircuitId != CRUST_IMAGE_NO_ID && imageBlocks[i].trackCircuitId >= numTrackCircuits)
+           || imageBlocks[i].nameOffset >= namesLength
+           || imageBlocks[i].berthDirection > DOWN
+           || (u_int64_t)imageBlocks[i].pathBase + imageBlocks[i].numRearBerths > numPaths
+           || (u_int64_t)imageBlocks[i].pathNodeBase + imageBlocks[i].numPathNodes > numPathNodes)
+        {
+            return false;
+        }
+
+        // Parents always come before their children so following them back must end at the berth
+        const CRUST_PATH_NODE * berthPathNodes = &imagePathNodes[imageBlocks[i].pathNodeBase];
+        for(CRUST_IDENTIFIER j = 0; j < imageBlocks[i].numPathNodes; j++)
+        {
+            if(berthPathNodes[j].blockId >= numBlocks
+               || (berthPathNodes[j].parent != CRUST_PATH_NO_PARENT && berthPathNodes[j].parent >= j))
+            {
+                return false;
+            }
+        }
+
+        // Each path must lead back from its last node to the berth through exactly as many nodes as it says it has
+        for(CRUST_IDENTIFIER j = 0; j < imageBlocks[i].numRearBerths; j++)
+        {
+            const CRUST_IMAGE_PATH * path = &imagePaths[imageBlocks[i].pathBase + j];
+            if(path->rearBerthId >= numBlocks
+               || path->lastNode >= imageBlocks[i].numPathNodes
+               || path->numLinkedBlocks > CRUST_BLOCK_WALK_DEPTH_LIMIT)
+            {
+                return false;
+            }
+            CRUST_IDENTIFIER node = path->lastNode;
+            CRUST_IDENTIFIER chainLength = 0;
+            while(node != CRUST_PATH_NO_PARENT && chainLength <= CRUST_BLOCK_WALK_DEPTH_LIMIT)
+            {
+                node = berthPathNodes[node].parent;
+                chainLength++;
+            }
+            if(chainLength != path->numLinkedBlocks)
+            {
+                return false;
+            }
+        }
+    }
+
+    for(u_int64_t i = 0; i < numTrackCircuits; i++)
+    {
+        if((u_int64_t)imageTrackCircuits[i].blockBase + imageTrackCircuits[i].numBlocks > numIdentifiers
+           || (u_int64_t)imageTrackCircuits[i].upEdgeBase + imageTrackCircuits[i].numUpEdgeBlocks > numIdentifiers
+           || (u_int64_t)imageTrackCircuits[i].downEdgeBase + imageTrackCircuits[i].numDownEdgeBlocks > numIdentifiers)
+        {
+            return false;
+        }
+    }
+
+    for(u_int64_t i = 0; i < numIdentifiers; i++)
+    {
+        if(imageIdentifiers[i] >= numBlocks)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Copies a list of block IDs from an image into a list of blocks.
+ */
+void crust_image_resolve_blocks(CRUST_BLOCK ** blocks, const CRUST_IDENTIFIER * identifiers, CRUST_IDENTIFIER count, CRUST_STATE * state)
+{
+    for(CRUST_IDENTIFIER i = 0; i < count; i++)
+    {
+        blocks[i] = state->blockIndex[identifiers[i]];
+    }
+}
+
+/*
+ * Maps the image at imagePath and builds the layout it holds into state, which must be freshly initialised. If
+ * sourcePath is not NULL the image is only used if it was compiled from the current version of that file. The image
+ * stays mapped for the life of the process because the block names are read from it in place. If the image turns out to
+ * be damaged after blocks have been added, state is left holding blocks that have been freed and must be discarded.
+ * Returns 0 on success or:
+ * 1: The image could not be opened
+ * 2: The file is not an image this version of CRUST can read
+ * 3: The image is out of date
+ * 4: The image is damaged
+ */
+int crust_image_load(CRUST_STATE * state, const char * imagePath, const char * sourcePath)
+{
+    struct stat imageStat, sourceStat;
+    u_int64_t sourceHash;
+
+    int imageFD = open(imagePath, O_RDONLY);
+    if(imageFD == -1)
+    {
+        return 1;
+    }
+    if(fstat(imageFD, &imageStat))
+    {
+        close(imageFD);
+        return 1;
+    }
+    if(imageStat.st_size < sizeof(CRUST_IMAGE_HEADER))
+    {
+        close(imageFD);
+        return 2;
+    }
+
+    size_t imageLength = imageStat.st_size;
+    char * image = mmap(NULL, imageLength, PROT_READ, MAP_PRIVATE, imageFD, 0);
+    close(imageFD);
+    if(image == MAP_FAILED)
+    {
+        return 1;
+    }
+
+    const CRUST_IMAGE_HEADER * header = (const CRUST_IMAGE_HEADER *)image;
+    if(memcmp(header->magic, CRUST_IMAGE_MAGIC, CRUST_IMAGE_MAGIC_LENGTH)
+       || header->version != CRUST_IMAGE_VERSION
+       || header->byteOrderMark != CRUST_IMAGE_BYTE_ORDER_MARK)
+    {
+        munmap(image, imageLength);
+        return 2;
+    }
+
+    if(sourcePath != NULL
+       && (stat(sourcePath, &sourceStat)
+           || header->sourceSize != sourceStat.st_size
+           || !crust_image_source_hash(sourcePath, &sourceHash)
+           || header->sourceHash != sourceHash))
+    {
+        munmap(image, imageLength);
+        return 3;
+    }
+
+    for(int i = 0; i < CRUST_IMAGE_SECTION_COUNT; i++)
+    {
+        if(!crust_image_section_valid(header, i, imageLength))
+        {
+            munmap(image, imageLength);
+            return 4;
+        }
+    }
+    if(!crust_image_contents_valid(header, image))
+    {
+        munmap(image, imageLength);
+        return 4;
+    }
+
+    const CRUST_IMAGE_BLOCK * imageBlocks = (const CRUST_IMAGE_BLOCK *)&image[header->sections[CRUST_IMAGE_SECTION_BLOCKS].offset];
+    const CRUST_IMAGE_TRACK_CIRCUIT * imageTrackCircuits = (const CRUST_IMAGE_TRACK_CIRCUIT *)&image[header->sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].offset];
+    const CRUST_IDENTIFIER * imageIdentifiers = (const CRUST_IDENTIFIER *)&image[header->sections[CRUST_IMAGE_SECTION_IDENTIFIERS].offset];
+    const CRUST_IMAGE_PATH * imagePaths = (const CRUST_IMAGE_PATH *)&image[header->sections[CRUST_IMAGE_SECTION_PATHS].offset];
+    char * imageNames = &image[header->sections[CRUST_IMAGE_SECTION_NAMES].offset];
+    CRUST_IDENTIFIER numBlocks = header->sections[CRUST_IMAGE_SECTION_BLOCKS].length;
+    CRUST_IDENTIFIER numTrackCircuits = header->sections[CRUST_IMAGE_SECTION_TRACK_CIRCUITS].length;
+    CRUST_IDENTIFIER numPathNodes = header->sections[CRUST_IMAGE_SECTION_PATH_NODES].length;
+
+    // The blocks and track circuits are never freed once inserted so each kind can be allocated in one go. Block 0
+    // already exists in a fresh state.
+    CRUST_BLOCK * blocks = calloc(numBlocks - 1, sizeof(CRUST_BLOCK));
+    CRUST_TRACK_CIRCUIT * trackCircuits = calloc(numTrackCircuits, sizeof(CRUST_TRACK_CIRCUIT));
+    CRUST_BLOCK ** trackCircuitBlocks = malloc(sizeof(CRUST_BLOCK *) * header->sections[CRUST_IMAGE_SECTION_IDENTIFIERS].length);
+    if((numBlocks > 1 && blocks == NULL)
+       || (numTrackCircuits && trackCircuits == NULL)
+       || (header->sections[CRUST_IMAGE_SECTION_IDENTIFIERS].length && trackCircuitBlocks == NULL))
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    for(CRUST_IDENTIFIER i = 1; i < numBlocks; i++)
+    {
+        blocks[i - 1].blockName = &imageNames[imageBlocks[i].nameOffset];
+        if(crust_block_index_add(&blocks[i - 1], state))
+        {
+            // Two blocks share a name. The blocks already indexed are freed with the rest so the state can't be used.
+            free(blocks);
+            free(trackCircuits);
+            free(trackCircuitBlocks);
+            munmap(image, imageLength);
+            return 4;
+        }
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < numBlocks; i++)
+    {
+        CRUST_BLOCK * block = state->blockIndex[i];
+        for(int j = 0; j < CRUST_MAX_LINKS; j++)
+        {
+            block->links[j] = imageBlocks[i].links[j] == CRUST_IMAGE_NO_ID ? NULL : state->blockIndex[imageBlocks[i].links[j]];
+        }
+        block->berth = imageBlocks[i].berth;
+        block->berthDirection = imageBlocks[i].berthDirection;
+        block->pathNodeBase = imageBlocks[i].pathNodeBase;
+        block->numPathNodes = imageBlocks[i].numPathNodes;
+        block->numRearBerths = imageBlocks[i].numRearBerths;
+        if(block->numRearBerths)
+        {
+            block->rearBerths = malloc(sizeof(CRUST_BLOCK *) * block->numRearBerths);
+            block->pathsToRearBerths = malloc(sizeof(CRUST_PATH) * block->numRearBerths);
+            if(block->rearBerths == NULL || block->pathsToRearBerths == NULL)
+            {
+                crust_terminal_print("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for(CRUST_IDENTIFIER j = 0; j < block->numRearBerths; j++)
+        {
+            const CRUST_IMAGE_PATH * imagePath = &imagePaths[imageBlocks[i].pathBase + j];
+            block->rearBerths[j] = state->blockIndex[imagePath->rearBerthId];
+            block->pathsToRearBerths[j].lastNode = imagePath->lastNode;
+            block->pathsToRearBerths[j].numLinkedBlocks = imagePath->numLinkedBlocks;
+            block->pathsToRearBerths[j].pathCircuitBase = 0;
+            block->pathsToRearBerths[j].numPathCircuits = 0;
+        }
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < numTrackCircuits; i++)
+    {
+        CRUST_TRACK_CIRCUIT * trackCircuit = &trackCircuits[i];
+        const CRUST_IMAGE_TRACK_CIRCUIT * imageTrackCircuit = &imageTrackCircuits[i];
+
+        trackCircuit->blocks = &trackCircuitBlocks[imageTrackCircuit->blockBase];
+        trackCircuit->numBlocks = imageTrackCircuit->numBlocks;
+        crust_image_resolve_blocks(trackCircuit->blocks, &imageIdentifiers[imageTrackCircuit->blockBase], trackCircuit->numBlocks, state);
+
+        // The edge lists are replaced when blocks are inserted next to the circuit so they need their own allocations
+        trackCircuit->numUpEdgeBlocks = imageTrackCircuit->numUpEdgeBlocks;
+        trackCircuit->upEdgeBlocks = malloc(sizeof(CRUST_BLOCK *) * trackCircuit->numUpEdgeBlocks);
+        trackCircuit->numDownEdgeBlocks = imageTrackCircuit->numDownEdgeBlocks;
+        trackCircuit->downEdgeBlocks = malloc(sizeof(CRUST_BLOCK *) * trackCircuit->numDownEdgeBlocks);
+        if((trackCircuit->numUpEdgeBlocks && trackCircuit->upEdgeBlocks == NULL)
+           || (trackCircuit->numDownEdgeBlocks && trackCircuit->downEdgeBlocks == NULL))
+        {
+            crust_terminal_print("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        crust_image_resolve_blocks(trackCircuit->upEdgeBlocks, &imageIdentifiers[imageTrackCircuit->upEdgeBase], trackCircuit->numUpEdgeBlocks, state);
+        crust_image_resolve_blocks(trackCircuit->downEdgeBlocks, &imageIdentifiers[imageTrackCircuit->downEdgeBase], trackCircuit->numDownEdgeBlocks, state);
+
+        trackCircuit->owningSession = NULL;
+        crust_track_circuit_index_add(trackCircuit, state);
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < numBlocks; i++)
+    {
+        if(imageBlocks[i].trackCircuitId != CRUST_IMAGE_NO_ID)
+        {
+            state->blockIndex[i]->trackCircuit = state->trackCircuitIndex[imageBlocks[i].trackCircuitId];
+        }
+    }
+
+    state->pathNodes = malloc(sizeof(CRUST_PATH_NODE) * numPathNodes);
+    if(numPathNodes && state->pathNodes == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(state->pathNodes, &image[header->sections[CRUST_IMAGE_SECTION_PATH_NODES].offset], sizeof(CRUST_PATH_NODE) * numPathNodes);
+    state->pathNodesLength = numPathNodes;
+    state->pathNodesPointer = numPathNodes;
+    state->pathNodesInUse = numPathNodes;
+
+    memcpy(state->headcodes, &image[header->sections[CRUST_IMAGE_SECTION_HEADCODES].offset], numBlocks * CRUST_HEADCODE_LENGTH);
+    crust_state_all_changed(state);
+
+    state->pathCircuitsStale = true;
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_IMAGE_H
+#define CRUST_IMAGE_H
+
+#include <sys/types.h>
+#include "state.h"
+
+/*
+ * A layout image is a compiled copy of a layout: the blocks, links, track circuits, edge lists, berth paths and initial
+ * headcodes that result from running a text init file. The daemon can map an image and start serving without parsing
+ * the text or searching for berth paths again. The text file remains the source of truth, an image is only a cache of
+ * it and should be recompiled whenever the text changes. An image records a hash of the text it was compiled from so
+ * that the daemon can tell when it is out of date.
+ *
+ * Everything in an image is referred to by ID or by offset from the start of the image so that it can be mapped at any
+ * address. Images use the byte order of the machine that compiled them and are rejected by machines that differ.
+ */
+
+#define CRUST_IMAGE_MAGIC "CRUSTLYT"
+#define CRUST_IMAGE_MAGIC_LENGTH 8
+#define CRUST_IMAGE_VERSION 2
+#define CRUST_IMAGE_BYTE_ORDER_MARK 0x01020304
+#define CRUST_IMAGE_NO_ID UINT32_MAX
+#define CRUST_IMAGE_SOURCE_CHUNK 65536 // Bytes of the text file read at a time when hashing it
+
+#define CRUST_IMAGE_HEADER struct crustImageHeader
+#define CRUST_IMAGE_SECTION struct crustImageSection
+#define CRUST_IMAGE_BLOCK struct crustImageBlock
+#define CRUST_IMAGE_TRACK_CIRCUIT struct crustImageTrackCircuit
+#define CRUST_IMAGE_PATH struct crustImagePath
+
+enum crustImageSectionType {
+    CRUST_IMAGE_SECTION_BLOCKS,
+    CRUST_IMAGE_SECTION_TRACK_CIRCUITS,
+    CRUST_IMAGE_SECTION_IDENTIFIERS, // Block IDs referred to by the track circuits
+    CRUST_IMAGE_SECTION_PATHS,
+    CRUST_IMAGE_SECTION_PATH_NODES,
+    CRUST_IMAGE_SECTION_HEADCODES,
+    CRUST_IMAGE_SECTION_NAMES,
+    CRUST_IMAGE_SECTION_COUNT
+};
+
+struct crustImageSection {
+    u_int64_t offset;
+    u_int64_t length; // In entries, except for the names which are measured in bytes
+};
+
+struct crustImageHeader {
+    char magic[CRUST_IMAGE_MAGIC_LENGTH];
+    u_int32_t version;
+    u_int32_t byteOrderMark;
+    u_int64_t sourceSize; // The size of the text file the image was compiled from
+    u_int64_t sourceHash; // A hash of the contents of that file
+    CRUST_IMAGE_SECTION sections[CRUST_IMAGE_SECTION_COUNT];
+};
+
+struct crustImageBlock {
+    CRUST_IDENTIFIER links[CRUST_MAX_LINKS];
+    CRUST_IDENTIFIER trackCircuitId;
+    u_int32_t nameOffset;
+    u_int8_t berth;
+    u_int8_t berthDirection;
+    u_int16_t reserved;
+    CRUST_IDENTIFIER pathBase;
+    CRUST_IDENTIFIER numRearBerths;
+    CRUST_IDENTIFIER pathNodeBase;
+    CRUST_IDENTIFIER numPathNodes;
+};
+
+struct crustImageTrackCircuit {
+    CRUST_IDENTIFIER blockBase;
+    CRUST_IDENTIFIER numBlocks;
+    CRUST_IDENTIFIER upEdgeBase;
+    CRUST_IDENTIFIER numUpEdgeBlocks;
+    CRUST_IDENTIFIER downEdgeBase;
+    CRUST_IDENTIFIER numDownEdgeBlocks;
+};
+
+struct crustImagePath {
+    CRUST_IDENTIFIER rearBerthId;
+    CRUST_IDENTIFIER lastNode;
+    CRUST_IDENTIFIER numLinkedBlocks;
+};
+
+int crust_image_write(CRUST_STATE * state, const char * imagePath, const char * sourcePath);
+int crust_image_load(CRUST_STATE * state, const char * imagePath, const char * sourcePath);
+
+#endif //CRUST_IMAGE_H
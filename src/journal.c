@@ -0,0 +1,460 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "terminal.h"
+#include "thread.h"
+
+u_int32_t crust_journal_checksum(const CRUST_JOURNAL_RECORD * record)
+{
+    u_int32_t hash = 2166136261u;
+    const unsigned char * byte = (const unsigned char *)record;
+    for(size_t i = 0; i < offsetof(CRUST_JOURNAL_RECORD, checksum); i++)
+    {
+        hash ^= byte[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Applies a record read back from the journal to the state. Records that refer to blocks or track circuits the layout
+ * does not have are skipped.
+ */
+void crust_journal_apply(const CRUST_JOURNAL_RECORD * record, CRUST_STATE * state)
+{
+    CRUST_TRACK_CIRCUIT * trackCircuit;
+    CRUST_BLOCK * block;
+    CRUST_BLOCK * targetBlock;
+
+    switch(record->type)
+    {
+        case CRUST_JOURNAL_OCCUPY:
+        case CRUST_JOURNAL_CLEAR:
+            if(crust_track_circuit_get(record->subject, &trackCircuit, state))
+            {
+                crust_track_circuit_restore(trackCircuit, record->type == CRUST_JOURNAL_OCCUPY, true, state);
+            }
+            break;
+
+        case CRUST_JOURNAL_RELEASE:
+            if(crust_track_circuit_get(record->subject, &trackCircuit, state))
+            {
+                crust_track_circuit_restore(trackCircuit, crust_track_circuit_is_occupied(trackCircuit, state), false, state);
+            }
+            break;
+
+        case CRUST_JOURNAL_ENABLE_BERTH:
+            if(crust_block_get(record->subject, &block, state) && record->direction <= DOWN)
+            {
+                crust_enable_berth(block, record->direction, state);
+            }
+            break;
+
+        case CRUST_JOURNAL_INTERPOSE:
+            if(crust_block_get(record->subject, &block, state))
+            {
+                crust_interpose(block, record->headcode, state);
+            }
+            break;
+
+        case CRUST_JOURNAL_BERTH_STEP:
+        case CRUST_JOURNAL_AUTO_ADVANCE:
+            if(crust_block_get(record->subject, &block, state)
+               && crust_block_get(record->target, &targetBlock, state))
+            {
+                crust_interpose(targetBlock, record->headcode, state);
+                crust_interpose(block, CRUST_EMPTY_BERTH_HEADCODE, state);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Writes out everything in the queue and syncs it. Must be called with the file lock held. If the batch can't be
+ * written, whatever part of it reached the file is cut off again so that a torn record does not end the replay of
+ * everything written after it, and the batch is counted as dropped.
+ */
+void crust_journal_commit(CRUST_JOURNAL * journal)
+{
+    CRUST_JOURNAL_RECORD batch[CRUST_JOURNAL_QUEUE_LENGTH];
+
+    pthread_mutex_lock(&journal->queueLock);
+    unsigned int batchLength = journal->queueDepth;
+    unsigned int firstPart = CRUST_JOURNAL_QUEUE_LENGTH - journal->queueStart;
+    if(firstPart > batchLength)
+    {
+        firstPart = batchLength;
+    }
+    memcpy(batch, &journal->queue[journal->queueStart], sizeof(CRUST_JOURNAL_RECORD) * firstPart);
+    memcpy(&batch[firstPart], journal->queue, sizeof(CRUST_JOURNAL_RECORD) * (batchLength - firstPart));
+    journal->queueStart = (journal->queueStart + batchLength) % CRUST_JOURNAL_QUEUE_LENGTH;
+    journal->queueDepth = 0;
+    journal->metrics.queueDepth = 0;
+    pthread_mutex_unlock(&journal->queueLock);
+
+    if(!batchLength)
+    {
+        return;
+    }
+
+    size_t batchSize = sizeof(CRUST_JOURNAL_RECORD) * batchLength;
+    size_t writtenTo = 0;
+    while(writtenTo < batchSize)
+    {
+        ssize_t writeResult = write(journal->fd, (char *)batch + writtenTo, batchSize - writtenTo);
+        if(writeResult <= 0)
+        {
+            crust_terminal_print("Failed to write to the journal.");
+            pthread_mutex_lock(&journal->queueLock);
+            if(ftruncate(journal->fd, journal->length) || lseek(journal->fd, journal->length, SEEK_SET) == -1)
+            {
+                crust_terminal_print("Failed to repair the journal, no further changes will be recorded.");
+                journal->failed = true;
+            }
+            journal->metrics.recordsDropped += batchLength;
+            pthread_mutex_unlock(&journal->queueLock);
+            return;
+        }
+        writtenTo += writeResult;
+    }
+    journal->length += batchSize;
+    if(fdatasync(journal->fd))
+    {
+        crust_terminal_print("Failed to sync the journal.");
+    }
+
+    pthread_mutex_lock(&journal->queueLock);
+    journal->metrics.recordsWritten += batchLength;
+    journal->metrics.bytesWritten += batchSize;
+    journal->metrics.commits++;
+    pthread_mutex_unlock(&journal->queueLock);
+}
+
+void * crust_journal_thread(void * argument)
+{
+    CRUST_JOURNAL * journal = argument;
+
+    crust_thread_block_stop_signals();
+
+    for(;;)
+    {
+        pthread_mutex_lock(&journal->queueLock);
+        while(!journal->queueDepth)
+        {
+            pthread_cond_wait(&journal->queueReady, &journal->queueLock);
+        }
+        pthread_mutex_unlock(&journal->queueLock);
+
+        // Anything queued while the last batch was being synced goes out together in this one
+        pthread_mutex_lock(&journal->fileLock);
+        crust_journal_commit(journal);
+        pthread_mutex_unlock(&journal->fileLock);
+    }
+}
+
+/*
+ * Replays the journal at path over the state, skipping the records already included in the checkpoint the state was
+ * restored from, then opens the journal to record further changes. A record torn by a crash ends the replay and is
+ * cut from the end of the file. numLost is filled with the number of records after the checkpoint that were dropped
+ * rather than written, found from the gaps in their sequence numbers. Returns 0 on success or:
+ * 1: The journal could not be opened
+ * 2: The journal could not be read
+ */
+int crust_journal_start(CRUST_JOURNAL * journal, const char * path, u_int64_t checkpointSequence, CRUST_STATE * state,
+                        unsigned int * numReplayed, u_int64_t * numLost)
+{
+    CRUST_JOURNAL_RECORD record;
+
+    strncpy(journal->path, path, PATH_MAX);
+    journal->path[PATH_MAX - 1] = '\0';
+    journal->sequence = checkpointSequence;
+    journal->queueStart = 0;
+    journal->queueDepth = 0;
+    journal->failed = false;
+    memset(&journal->metrics, 0, sizeof(CRUST_JOURNAL_METRICS));
+    *numReplayed = 0;
+    *numLost = 0;
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT, 0644);
+    if(journal->fd == -1)
+    {
+        return 1;
+    }
+
+    FILE * journalFile = fdopen(dup(journal->fd), "rb");
+    if(journalFile == NULL)
+    {
+        return 2;
+    }
+
+    off_t validLength = 0;
+    while(fread(&record, sizeof(CRUST_JOURNAL_RECORD), 1, journalFile) == 1
+          && record.checksum == crust_journal_checksum(&record))
+    {
+        if(record.sequence > checkpointSequence)
+        {
+            // Records dropped before the checkpoint was taken are already included in it
+            if((validLength || checkpointSequence) && record.sequence > journal->sequence + 1)
+            {
+                *numLost += record.sequence - journal->sequence - 1;
+            }
+            crust_journal_apply(&record, state);
+            (*numReplayed)++;
+        }
+        if(record.sequence > journal->sequence)
+        {
+            journal->sequence = record.sequence;
+        }
+        validLength += sizeof(CRUST_JOURNAL_RECORD);
+    }
+    fclose(journalFile);
+
+    if(ftruncate(journal->fd, validLength) || lseek(journal->fd, validLength, SEEK_SET) == -1)
+    {
+        return 2;
+    }
+    journal->length = validLength;
+
+    if(pthread_mutex_init(&journal->fileLock, NULL)
+       || pthread_mutex_init(&journal->queueLock, NULL)
+       || pthread_cond_init(&journal->queueReady, NULL)
+       || pthread_create(&journal->thread, NULL, crust_journal_thread, journal)
+       || pthread_detach(journal->thread))
+    {
+        crust_terminal_print("Failed to start the journal writer.");
+        exit(EXIT_FAILURE);
+    }
+
+    journal->running = true;
+    return 0;
+}
+
+// Returns the sequence number of the last record queued, or 0 if there have never been any.
+u_int64_t crust_journal_sequence(CRUST_JOURNAL * journal)
+{
+    return journal->sequence;
+}
+
+/*
+ * Stamps a record and adds it to the queue for the writer thread. Does nothing if the journal has not been started.
+ */
+void crust_journal_append(CRUST_JOURNAL * journal, CRUST_JOURNAL_RECORD * record)
+{
+    struct timespec now;
+
+    if(!journal->running)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    record->reserved = 0;
+    record->padding = 0;
+
+    pthread_mutex_lock(&journal->queueLock);
+    if(journal->failed || journal->queueDepth == CRUST_JOURNAL_QUEUE_LENGTH)
+    {
+        journal->sequence++;
+        journal->metrics.recordsDropped++;
+        pthread_mutex_unlock(&journal->queueLock);
+        return;
+    }
+
+    record->sequence = ++journal->sequence;
+    record->checksum = crust_journal_checksum(record);
+    journal->queue[(journal->queueStart + journal->queueDepth) % CRUST_JOURNAL_QUEUE_LENGTH] = *record;
+    journal->queueDepth++;
+    journal->metrics.recordsQueued++;
+    journal->metrics.queueDepth = journal->queueDepth;
+    if(journal->queueDepth > journal->metrics.maxQueueDepth)
+    {
+        journal->metrics.maxQueueDepth = journal->queueDepth;
+    }
+    pthread_cond_signal(&journal->queueReady);
+    pthread_mutex_unlock(&journal->queueLock);
+}
+
+void crust_journal_track_circuit(CRUST_JOURNAL * journal,
+                                 enum crustJournalRecordType type,
+                                 CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    CRUST_JOURNAL_RECORD record;
+    memset(&record, 0, sizeof(CRUST_JOURNAL_RECORD));
+    record.type = type;
+    record.subject = trackCircuit->trackCircuitId;
+    crust_journal_append(journal, &record);
+}
+
+void crust_journal_enable_berth(CRUST_JOURNAL * journal, CRUST_BLOCK * block)
+{
+    CRUST_JOURNAL_RECORD record;
+    memset(&record, 0, sizeof(CRUST_JOURNAL_RECORD));
+    record.type = CRUST_JOURNAL_ENABLE_BERTH;
+    record.subject = block->blockId;
+    record.direction = block->berthDirection;
+    crust_journal_append(journal, &record);
+}
+
+/*
+ * Records the headcode now held by toBlock. For interposes fromBlock is NULL, for steps it is the block the headcode
+ * came from.
+ */
+void crust_journal_headcode(CRUST_JOURNAL * journal,
+                            enum crustJournalRecordType type,
+                            CRUST_BLOCK * fromBlock,
+                            CRUST_BLOCK * toBlock,
+                            CRUST_STATE * state)
+{
+    CRUST_JOURNAL_RECORD record;
+    memset(&record, 0, sizeof(CRUST_JOURNAL_RECORD));
+    record.type = type;
+    if(fromBlock == NULL)
+    {
+        record.subject = toBlock->blockId;
+    }
+    else
+    {
+        record.subject = fromBlock->blockId;
+        record.target = toBlock->blockId;
+    }
+    memcpy(record.headcode, crust_block_headcode(toBlock, state), CRUST_HEADCODE_LENGTH);
+    crust_journal_append(journal, &record);
+}
+
+/*
+ * Writes and syncs everything queued so far, for use when the daemon is shutting down.
+ */
+void crust_journal_flush(CRUST_JOURNAL * journal)
+{
+    if(!journal->running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->fileLock);
+    crust_journal_commit(journal);
+    pthread_mutex_unlock(&journal->fileLock);
+}
+
+/*
+ * Drops the records up to and including sequence from the journal, once a checkpoint that includes them has been put
+ * in place. The records after them are copied to a new file beside the journal which is then moved over it, so a
+ * crash part way through leaves the journal as it was.
+ */
+void crust_journal_trim(CRUST_JOURNAL * journal, u_int64_t sequence)
+{
+    CRUST_JOURNAL_RECORD records[CRUST_JOURNAL_TRIM_CHUNK];
+    char * temporaryPath;
+
+    if(!journal->running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->fileLock);
+
+    // Records are written in order, so everything from the first one after sequence is kept
+    off_t keepFrom = 0;
+    while(keepFrom < journal->length)
+    {
+        ssize_t readResult = pread(journal->fd, records, sizeof(records), keepFrom);
+        if(readResult < (ssize_t)sizeof(CRUST_JOURNAL_RECORD))
+        {
+            pthread_mutex_unlock(&journal->fileLock);
+            crust_terminal_print("Failed to read the journal for trimming.");
+            return;
+        }
+        unsigned int numRecords = readResult / sizeof(CRUST_JOURNAL_RECORD);
+        unsigned int i = 0;
+        while(i < numRecords && keepFrom < journal->length && records[i].sequence <= sequence)
+        {
+            keepFrom += sizeof(CRUST_JOURNAL_RECORD);
+            i++;
+        }
+        if(i < numRecords)
+        {
+            break;
+        }
+    }
+
+    if(!keepFrom)
+    {
+        pthread_mutex_unlock(&journal->fileLock);
+        return;
+    }
+
+    asprintf(&temporaryPath, "%s.tmp", journal->path);
+    int trimmedFD = open(temporaryPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool trimmed = trimmedFD != -1;
+    for(off_t copiedFrom = keepFrom; trimmed && copiedFrom < journal->length;)
+    {
+        size_t chunkLength = journal->length - copiedFrom < (off_t)sizeof(records)
+                             ? journal->length - copiedFrom : sizeof(records);
+        trimmed = pread(journal->fd, records, chunkLength, copiedFrom) == (ssize_t)chunkLength
+                  && write(trimmedFD, records, chunkLength) == (ssize_t)chunkLength;
+        copiedFrom += chunkLength;
+    }
+    trimmed = trimmed && !fsync(trimmedFD) && !rename(temporaryPath, journal->path);
+
+    if(trimmed)
+    {
+        close(journal->fd);
+        journal->fd = trimmedFD;
+        journal->length -= keepFrom;
+    }
+    else
+    {
+        crust_terminal_print("Failed to trim the journal.");
+        if(trimmedFD != -1)
+        {
+            close(trimmedFD);
+            unlink(temporaryPath);
+        }
+    }
+    free(temporaryPath);
+
+    pthread_mutex_unlock(&journal->fileLock);
+}
+
+void crust_journal_metrics(CRUST_JOURNAL * journal, CRUST_JOURNAL_METRICS * metrics)
+{
+    if(!journal->running)
+    {
+        memset(metrics, 0, sizeof(CRUST_JOURNAL_METRICS));
+        return;
+    }
+
+    pthread_mutex_lock(&journal->queueLock);
+    *metrics = journal->metrics;
+    pthread_mutex_unlock(&journal->queueLock);
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_JOURNAL_H
+#define CRUST_JOURNAL_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "state.h"
+#include "config.h"
+
+/*
+ * The journal is an append-only file recording every change the daemon accepts to the runtime state. Each record holds
+ * the result of a change rather than the command that caused it, so replaying the records after a checkpoint in order
+ * brings the state back to where it was regardless of which session made each change.
+ *
+ * Records are queued by the daemon loop and written by a background thread, which syncs every batch it writes at once
+ * (a group commit). The loop never waits for the disk: if the queue is full the record is dropped and counted, and its
+ * sequence number is skipped so that the loss shows as a gap in the file when it is replayed.
+ *
+ * Once a checkpoint is in place the records it includes are trimmed from the front of the journal, so the journal
+ * only has to be replayed together with the checkpoint and does not grow without limit.
+ *
+ * Each layout the daemon serves has a journal of its own. A CRUST_JOURNAL that has not been started must be zeroed, and
+ * records appended to it are ignored.
+ */
+
+#define CRUST_JOURNAL_TRIM_CHUNK 256 // Records read at a time while trimming
+
+#define CRUST_JOURNAL_QUEUE_LENGTH 4096
+
+#define CRUST_JOURNAL_RECORD struct crustJournalRecord
+#define CRUST_JOURNAL_METRICS struct crustJournalMetrics
+#define CRUST_JOURNAL struct crustJournal
+
+enum crustJournalRecordType {
+    CRUST_JOURNAL_OCCUPY,       // subject: track circuit ID
+    CRUST_JOURNAL_CLEAR,        // subject: track circuit ID
+    CRUST_JOURNAL_RELEASE,      // subject: track circuit ID, the owning session disconnected
+    CRUST_JOURNAL_ENABLE_BERTH, // subject: block ID, direction: berth direction
+    CRUST_JOURNAL_INTERPOSE,    // subject: block ID, headcode: the headcode interposed
+    CRUST_JOURNAL_BERTH_STEP,   // subject: block stepped from, target: block stepped to, headcode: the headcode moved
+    CRUST_JOURNAL_AUTO_ADVANCE  // As CRUST_JOURNAL_BERTH_STEP but caused by a track circuit becoming occupied
+};
+
+struct crustJournalRecord {
+    u_int64_t sequence; // Increases by one for every record written, carried on across restarts
+    int64_t time; // Milliseconds since the epoch when the change was accepted
+    u_int8_t type;
+    u_int8_t direction;
+    u_int16_t reserved;
+    CRUST_IDENTIFIER subject;
+    CRUST_IDENTIFIER target;
+    char headcode[CRUST_HEADCODE_LENGTH];
+    u_int32_t checksum; // FNV-1a of the record up to this field, used to find a record torn by a crash
+    u_int32_t padding;
+};
+
+struct crustJournalMetrics {
+    u_int64_t recordsQueued;
+    u_int64_t recordsWritten;
+    u_int64_t recordsDropped; // Records lost because the queue was full
+    u_int64_t commits; // Batches written and synced
+    u_int64_t bytesWritten;
+    unsigned int queueDepth;
+    unsigned int maxQueueDepth;
+};
+
+struct crustJournal {
+    char path[PATH_MAX];
+    int fd;
+    off_t length; // The length of the whole records written to the file, only used with the file lock held
+    pthread_t thread;
+    pthread_mutex_t fileLock; // Held while a batch is taken from the queue and written so that batches stay in order
+    pthread_mutex_t queueLock; // Protects the queue and the metrics
+    pthread_cond_t queueReady;
+    CRUST_JOURNAL_RECORD queue[CRUST_JOURNAL_QUEUE_LENGTH];
+    unsigned int queueStart;
+    unsigned int queueDepth;
+    u_int64_t sequence; // The sequence number of the last record queued
+    CRUST_JOURNAL_METRICS metrics;
+    bool running;
+    bool failed; // A batch could not be written or cut back off the file, so nothing more can safely be added to it
+};
+
+int crust_journal_start(CRUST_JOURNAL * journal, const char * path, u_int64_t checkpointSequence, CRUST_STATE * state,
+                        unsigned int * numReplayed, u_int64_t * numLost);
+u_int64_t crust_journal_sequence(CRUST_JOURNAL * journal);
+void crust_journal_track_circuit(CRUST_JOURNAL * journal,
+                                 enum crustJournalRecordType type,
+                                 CRUST_TRACK_CIRCUIT * trackCircuit);
+void crust_journal_enable_berth(CRUST_JOURNAL * journal, CRUST_BLOCK * block);
+void crust_journal_headcode(CRUST_JOURNAL * journal,
+                            enum crustJournalRecordType type,
+                            CRUST_BLOCK * fromBlock,
+                            CRUST_BLOCK * toBlock,
+                            CRUST_STATE * state);
+void crust_journal_flush(CRUST_JOURNAL * journal);
+void crust_journal_trim(CRUST_JOURNAL * journal, u_int64_t sequence);
+void crust_journal_metrics(CRUST_JOURNAL * journal, CRUST_JOURNAL_METRICS * metrics);
+
+#endif //CRUST_JOURNAL_H
@@ -0,0 +1,482 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * crust-load puts a running daemon under load from many clients at once. Simulated nodes send OC and CC for their share
+ * of the track circuits at a fixed rate while simulated listeners follow the state with SL. Every command is timestamped
+ * as it is sent and every listener reports when the matching update reaches it, giving the end-to-end latency of the
+ * daemon including its fanout to listeners. All the clients are driven from one epoll loop.
+ *
+ * Each circuit has at most one change in flight. A node only changes a circuit again once every listener has reported
+ * the last change, or after CRUST_LOAD_TIMEOUT, when the change is counted as lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "client.h"
+#include "config.h"
+#include "terminal.h"
+#include "metrics.h"
+
+#define CRUST_LOAD_CIRCUIT struct crustLoadCircuit
+#define CRUST_LOAD_NODE struct crustLoadNode
+#define CRUST_LOAD_LISTENER struct crustLoadListener
+#define CRUST_LOAD_BUFFER_SIZE 4096
+#define CRUST_LOAD_TIMEOUT 5000000000LL // Nanoseconds before a change is counted as lost
+#define CRUST_LOAD_SETTLE_TIME 250 // Milliseconds of quiet that mark the end of the initial state
+
+struct crustLoadCircuit {
+    long long sentAt; // Nanoseconds, 0 while no change is in flight
+    bool occupied; // The last state sent
+    unsigned int awaiting; // Listeners yet to report the last change
+};
+
+struct crustLoadNode {
+    int socketFD;
+    unsigned long nextCircuit; // Where to start looking for a circuit to change
+    long long nextSend;
+};
+
+struct crustLoadListener {
+    int socketFD;
+    char buffer[CRUST_LOAD_BUFFER_SIZE];
+    size_t bufferLength;
+};
+
+CRUST_LOAD_CIRCUIT * loadCircuits = NULL;
+unsigned long loadCircuitCount = 0;
+unsigned int loadListenerCount = 4;
+unsigned int loadNodeCount = 4;
+
+u_int64_t * loadLatencies = NULL;
+size_t loadLatencyCount = 0;
+size_t loadLatenciesAllocated = 0;
+unsigned long long loadLost = 0;
+
+// Counts the track circuits inserted by an init file, which the daemon numbers from 0 in the order they appear.
+unsigned long crust_load_count_circuits(const char * path)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH];
+    unsigned long count = 0;
+
+    FILE * initFile = fopen(path, "r");
+    if(initFile == NULL)
+    {
+        crust_terminal_print("Failed to open the init file.");
+        exit(EXIT_FAILURE);
+    }
+    while(fgets(line, CRUST_MAX_MESSAGE_LENGTH, initFile) != NULL)
+    {
+        if(line[0] == 'I' && line[1] == 'C')
+        {
+            count++;
+        }
+    }
+    fclose(initFile);
+
+    return count;
+}
+
+void crust_load_record_latency(u_int64_t latency)
+{
+    if(loadLatencyCount == loadLatenciesAllocated)
+    {
+        loadLatenciesAllocated = loadLatenciesAllocated ? loadLatenciesAllocated * 2 : 4096;
+        loadLatencies = realloc(loadLatencies, sizeof(u_int64_t) * loadLatenciesAllocated);
+        if(loadLatencies == NULL)
+        {
+            crust_terminal_print("Memory allocation error.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    loadLatencies[loadLatencyCount++] = latency;
+}
+
+// Matches a line from a listener against the change in flight on its circuit, if there is one.
+void crust_load_handle_line(const char * line, long long now)
+{
+    char * endPointer;
+    size_t length = strlen(line);
+
+    if(length < 5 || line[0] != 'T' || line[1] != 'C')
+    {
+        return;
+    }
+    unsigned long circuitId = strtoul(&line[2], &endPointer, 10);
+    if(*endPointer != ':' || circuitId >= loadCircuitCount)
+    {
+        return;
+    }
+
+    CRUST_LOAD_CIRCUIT * circuit = &loadCircuits[circuitId];
+    const char * status = &line[length - 2];
+    if(circuit->sentAt && circuit->awaiting
+       && strcmp(status, circuit->occupied ? "OC" : "CL") == 0)
+    {
+        crust_load_record_latency(now - circuit->sentAt);
+        if(!--circuit->awaiting)
+        {
+            circuit->sentAt = 0;
+        }
+    }
+}
+
+// Reads everything waiting for a listener and handles each complete line. Returns the number of bytes read.
+size_t crust_load_read_listener(CRUST_LOAD_LISTENER * listener, bool measuring)
+{
+    size_t totalRead = 0;
+    for(;;)
+    {
+        if(listener->bufferLength == CRUST_LOAD_BUFFER_SIZE - 1)
+        {
+            // A line too long to matter to us, drop it
+            listener->bufferLength = 0;
+        }
+        ssize_t bytesRead = read(listener->socketFD,
+                                 &listener->buffer[listener->bufferLength],
+                                 CRUST_LOAD_BUFFER_SIZE - 1 - listener->bufferLength);
+        if(bytesRead == 0)
+        {
+            crust_terminal_print("The daemon closed a listener connection.");
+            exit(EXIT_FAILURE);
+        }
+        if(bytesRead < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return totalRead;
+            }
+            crust_terminal_print("Failed to read from the daemon.");
+            exit(EXIT_FAILURE);
+        }
+        totalRead += bytesRead;
+
+        long long now = crust_metrics_nanoseconds();
+        listener->bufferLength += bytesRead;
+        listener->buffer[listener->bufferLength] = '\0';
+        char * lineStart = listener->buffer;
+        char * lineEnd;
+        while((lineEnd = strchr(lineStart, '\n')) != NULL)
+        {
+            *lineEnd = '\0';
+            if(lineEnd > lineStart && lineEnd[-1] == '\r')
+            {
+                lineEnd[-1] = '\0';
+            }
+            if(measuring)
+            {
+                crust_load_handle_line(lineStart, now);
+            }
+            lineStart = lineEnd + 1;
+        }
+        listener->bufferLength -= lineStart - listener->buffer;
+        memmove(listener->buffer, lineStart, listener->bufferLength);
+    }
+}
+
+// Changes the next free circuit belonging to a node. Returns false if all of them are waiting on listeners.
+bool crust_load_send(CRUST_LOAD_NODE * node, unsigned int nodeNumber, long long now)
+{
+    char command[CRUST_MAX_MESSAGE_LENGTH];
+
+    for(unsigned long tried = 0; tried < loadCircuitCount; tried += loadNodeCount)
+    {
+        unsigned long circuitId = node->nextCircuit;
+        node->nextCircuit += loadNodeCount;
+        if(node->nextCircuit >= loadCircuitCount)
+        {
+            node->nextCircuit = nodeNumber;
+        }
+
+        CRUST_LOAD_CIRCUIT * circuit = &loadCircuits[circuitId];
+        if(circuit->sentAt && now - circuit->sentAt > CRUST_LOAD_TIMEOUT)
+        {
+            loadLost += circuit->awaiting;
+            circuit->sentAt = 0;
+        }
+        if(circuit->sentAt)
+        {
+            continue;
+        }
+
+        circuit->occupied = !circuit->occupied;
+        circuit->awaiting = loadListenerCount;
+        circuit->sentAt = now;
+        int length = snprintf(command, CRUST_MAX_MESSAGE_LENGTH, "%s%lu\n", circuit->occupied ? "OC" : "CC", circuitId);
+        if(write(node->socketFD, command, length) != length)
+        {
+            crust_terminal_print("Failed to write to the daemon.");
+            exit(EXIT_FAILURE);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+int main(int argc, char ** argv)
+{
+    char * initPath = NULL;
+    unsigned long rate = 50;
+    unsigned long duration = 10;
+    unsigned long prospectivePort;
+    struct in_addr prospectiveIPAddress;
+    char * endPointer;
+
+    int option;
+    while((option = getopt(argc, argv, "a:c:d:hl:n:p:r:")) != -1)
+    {
+        switch(option)
+        {
+            case 'a':
+                if(!inet_aton(optarg, &prospectiveIPAddress))
+                {
+                    crust_terminal_print("Invalid IP address specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionIPAddress = prospectiveIPAddress.s_addr;
+                break;
+
+            case 'c':
+                initPath = optarg;
+                break;
+
+            case 'd':
+                duration = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || !duration)
+                {
+                    crust_terminal_print("Invalid duration specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'h':
+                crust_terminal_print("Usage: crust-load [options] -c init_file");
+                crust_terminal_print("  -a  IP address of the CRUST server (defaults to 127.0.0.1)");
+                crust_terminal_print("  -c  The init file the daemon was started with, used to find the track "
+                                     "circuits.");
+                crust_terminal_print("  -d  Run for this many seconds (defaults to 10)");
+                crust_terminal_print("  -h  Display this help.");
+                crust_terminal_print("  -l  Number of listeners (defaults to 4)");
+                crust_terminal_print("  -n  Number of nodes (defaults to 4)");
+                crust_terminal_print("  -p  Port of the CRUST server (defaults to 12321)");
+                crust_terminal_print("  -r  Commands sent by each node per second (defaults to 50)");
+                exit(EXIT_SUCCESS);
+
+            case 'l':
+                loadListenerCount = (unsigned int)strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || !loadListenerCount)
+                {
+                    crust_terminal_print("Invalid number of listeners specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'n':
+                loadNodeCount = (unsigned int)strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || !loadNodeCount)
+                {
+                    crust_terminal_print("Invalid number of nodes specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'p':
+                prospectivePort = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || prospectivePort > 65535 || !prospectivePort)
+                {
+                    crust_terminal_print("Invalid port specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionPort = (in_port_t)prospectivePort;
+                break;
+
+            case 'r':
+                rate = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || !rate)
+                {
+                    crust_terminal_print("Invalid rate specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case '?':
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(initPath == NULL)
+    {
+        crust_terminal_print("The daemon's init file must be specified with -c.");
+        exit(EXIT_FAILURE);
+    }
+    loadCircuitCount = crust_load_count_circuits(initPath);
+    if(loadCircuitCount < loadNodeCount)
+    {
+        crust_terminal_print("The layout needs at least one track circuit for each node.");
+        exit(EXIT_FAILURE);
+    }
+
+    loadCircuits = calloc(loadCircuitCount, sizeof(CRUST_LOAD_CIRCUIT));
+    CRUST_LOAD_NODE * nodes = calloc(loadNodeCount, sizeof(CRUST_LOAD_NODE));
+    CRUST_LOAD_LISTENER * listeners = calloc(loadListenerCount, sizeof(CRUST_LOAD_LISTENER));
+    struct epoll_event * events = calloc(loadListenerCount, sizeof(struct epoll_event));
+    int epollFD = epoll_create1(0);
+    if(loadCircuits == NULL || nodes == NULL || listeners == NULL || events == NULL || epollFD == -1)
+    {
+        crust_terminal_print("Failed to set up the load generator.");
+        exit(EXIT_FAILURE);
+    }
+
+    for(unsigned int i = 0; i < loadListenerCount; i++)
+    {
+        listeners[i].socketFD = crust_client_connect();
+        if(write(listeners[i].socketFD, "SL\n", 3) != 3
+           || fcntl(listeners[i].socketFD, F_SETFL, O_NONBLOCK) == -1)
+        {
+            crust_terminal_print("Failed to start a listener.");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+        if(epoll_ctl(epollFD, EPOLL_CTL_ADD, listeners[i].socketFD, &event) == -1)
+        {
+            crust_terminal_print("Failed to watch a listener.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(unsigned int i = 0; i < loadNodeCount; i++)
+    {
+        nodes[i].socketFD = crust_client_connect();
+        nodes[i].nextCircuit = i;
+    }
+
+    // Let the listeners take in the initial state before anything changes
+    while(epoll_wait(epollFD, events, (int)loadListenerCount, CRUST_LOAD_SETTLE_TIME) > 0)
+    {
+        for(unsigned int i = 0; i < loadListenerCount; i++)
+        {
+            crust_load_read_listener(&listeners[i], false);
+        }
+    }
+
+    long long interval = 1000000000LL / (long long)rate;
+    long long start = crust_metrics_nanoseconds();
+    long long end = start + (long long)duration * 1000000000LL;
+    unsigned long long sent = 0;
+    unsigned long long stalled = 0;
+    unsigned long long bytesRead = 0;
+    for(unsigned int i = 0; i < loadNodeCount; i++)
+    {
+        nodes[i].nextSend = start + interval * i / loadNodeCount;
+    }
+
+    // Send until the end, then allow the changes still in flight time to arrive
+    long long now = start;
+    while(now < end + CRUST_LOAD_TIMEOUT)
+    {
+        int timeout = 10;
+        if(now < end)
+        {
+            long long nextSend = end;
+            for(unsigned int i = 0; i < loadNodeCount; i++)
+            {
+                if(nodes[i].nextSend < nextSend)
+                {
+                    nextSend = nodes[i].nextSend;
+                }
+            }
+            timeout = nextSend > now ? (int)((nextSend - now + 999999) / 1000000) : 0;
+        }
+        else
+        {
+            bool inFlight = false;
+            for(unsigned long i = 0; i < loadCircuitCount && !inFlight; i++)
+            {
+                inFlight = loadCircuits[i].sentAt != 0;
+            }
+            if(!inFlight)
+            {
+                break;
+            }
+        }
+
+        int numEvents = epoll_wait(epollFD, events, (int)loadListenerCount, timeout);
+        if(numEvents == -1 && errno != EINTR)
+        {
+            crust_terminal_print("Failed to wait for the daemon.");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < numEvents; i++)
+        {
+            bytesRead += crust_load_read_listener(&listeners[events[i].data.u32], true);
+        }
+
+        now = crust_metrics_nanoseconds();
+        for(unsigned int i = 0; i < loadNodeCount; i++)
+        {
+            while(nodes[i].nextSend <= now && nodes[i].nextSend < end)
+            {
+                if(crust_load_send(&nodes[i], i, now))
+                {
+                    sent++;
+                }
+                else
+                {
+                    stalled++;
+                }
+                nodes[i].nextSend += interval;
+            }
+        }
+    }
+
+    for(unsigned long i = 0; i < loadCircuitCount; i++)
+    {
+        if(loadCircuits[i].sentAt)
+        {
+            loadLost += loadCircuits[i].awaiting;
+        }
+    }
+
+    double seconds = (double)duration;
+    printf("Sent %llu commands from %u nodes in %lu s: %.0f commands/s (%llu sends skipped with every circuit in flight)\n",
+           sent, loadNodeCount, duration, (double)sent / seconds, stalled);
+    printf("Received %zu updates across %u listeners: %.0f updates/s, %llu lost, %llu bytes\n",
+           loadLatencyCount, loadListenerCount, (double)loadLatencyCount / seconds, loadLost, bytesRead);
+    if(loadLatencyCount)
+    {
+        crust_metrics_sort(loadLatencies, loadLatencyCount);
+        printf("Latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               (double)crust_metrics_percentile(loadLatencies, loadLatencyCount, 50) / 1000,
+               (double)crust_metrics_percentile(loadLatencies, loadLatencyCount, 99) / 1000,
+               (double)crust_metrics_percentile(loadLatencies, loadLatencyCount, 99.9) / 1000,
+               (double)loadLatencies[loadLatencyCount - 1] / 1000);
+    }
+
+    return EXIT_SUCCESS;
+}
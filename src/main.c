@@ -55,12 +55,14 @@ int main(int argc, char ** argv) {
     struct group * groupInfo = NULL;
 
     unsigned long prospectivePort = 0;
+    unsigned long prospectiveWorkerCount = 0;
     struct in_addr prospectiveIPAddress;
+    char multicastGroup[INET_ADDRSTRLEN];
     char * endPointer;
 
     opterr = true;
     int option;
-    while((option = getopt(argc, argv, "a:c:dg:hilm:n:o:p:r:u:vw:")) != -1)
+    while((option = getopt(argc, argv, "a:b:c:de:f:g:hij:k:lm:n:o:p:q:r:s:tu:vw:x:y:z:M:U:")) != -1)
     {
         switch(option)
         {
@@ -73,6 +75,11 @@ int main(int argc, char ** argv) {
                 crustOptionIPAddress = prospectiveIPAddress.s_addr;
                 break;
 
+            case 'b':
+                strncpy(crustOptionLayoutImagePath, optarg, PATH_MAX);
+                crustOptionLayoutImagePath[PATH_MAX - 1] = '\0';
+                break;
+
             case 'c':
                 strncpy(crustOptionDaemonConfigFilePath, optarg, PATH_MAX);
                 crustOptionDaemonConfigFilePath[PATH_MAX - 1] = '\0';
@@ -82,6 +89,22 @@ int main(int argc, char ** argv) {
                 crustOptionRunMode = CRUST_RUN_MODE_DAEMON;
                 break;
 
+            case 'e':
+                strncpy(crustOptionRecordPath, optarg, PATH_MAX);
+                crustOptionRecordPath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'f':
+                endPointer = optarg;
+                crustOptionBatchInterval = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0')
+                {
+                    crust_terminal_print("Invalid batch interval specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionBatchUpdates = true;
+                break;
+
             case 'g':
                 groupInfo = getgrnam(optarg);
                 if(groupInfo == NULL)
@@ -97,15 +120,26 @@ int main(int argc, char ** argv) {
                 crust_terminal_print("CRUST: Consolidated Realtime Updates on Status of Trains");
                 crust_terminal_print("Usage: crust [options]");
                 crust_terminal_print("  -a  IP address of the CRUST server (defaults to 127.0.0.1)");
+                crust_terminal_print("  -b  (Daemon mode only) load the layout from the named image compiled with -k. "
+                                     "If -c is also given the image is only used while it matches that file.");
                 crust_terminal_print("  -c  (Daemon mode only) execute the commands in the named file before accepting "
                                      "connections.");
                 crust_terminal_print("  -d  Run in daemon mode.");
+                crust_terminal_print("  -e  (Daemon mode only) record the commands received from clients in the named "
+                                     "file so that they can be replayed with crust-replay.");
+                crust_terminal_print("  -f  (Daemon mode only) batch the updates sent to listeners, writing to each "
+                                     "listener at most once every this many milliseconds. 0 batches the updates "
+                                     "made while handling each round of input.");
                 crust_terminal_print("  -g  Switch to this group after completing setup (if run as root) and set this "
                                      "group on the CRUST run directory. "
                                      "(Defaults to the primary group of the user specified by -u.)");
                 crust_terminal_print("  -h  Display this help.");
                 crust_terminal_print("  -i  Invert the logic of the GPIO pins. "
                                      "(High = clear instead of high = occupied.)");
+                crust_terminal_print("  -j  (Daemon mode only) record every change to the headcodes and track circuits "
+                                     "in the named journal and replay it on startup.");
+                crust_terminal_print("  -k  Compile the layout in the file given by -c into an image at the named path, "
+                                     "then exit.");
                 crust_terminal_print("  -l  If running in window mode, start into the log screen.");
                 crust_terminal_print("  -m  Specify track circuit to GPIO mapping in the format "
                                      "pin_number:circuit_number,[...]");
@@ -115,12 +149,38 @@ int main(int argc, char ** argv) {
                                      "only affects daemon mode. Note that a small number of connections are reserved "
                                      "for the daemon to use internally.");
                 crust_terminal_print("  -p  Port of the CRUST server (defaults to 12321)");
+                crust_terminal_print("  -q  (Daemon mode only) the number of bytes that may wait to be sent to a "
+                                     "listener before the daemon stops sending it each update and instead sends the "
+                                     "latest state of whatever changed once it catches up. 0 never does this. "
+                                     "(Defaults to 1048576.)");
                 crust_terminal_print("  -r  Specify the run directory used to hold the CRUST socket. ");
+                crust_terminal_print("  -s  (Daemon mode only) keep a checkpoint of the headcodes and track circuits in "
+                                     "the named file and restore from it on startup.");
+                crust_terminal_print("  -t  (Node mode only) send the time of each GPIO edge with the track circuit "
+                                     "updates so that the daemon can measure the latency of each stage.");
                 crust_terminal_print("  -u  Switch to this user after completing setup. "
                                      "(Only works if starting as root.)");
                 crust_terminal_print("  -v  Display verbose output.");
                 crust_terminal_print("  -w  Run in window mode. (Show a live view of the line.) Takes the "
                                      "path of a window layout file as an argument.");
+                crust_terminal_print("  -x  (Daemon mode only) host another layout in the same daemon, in the format "
+                                     "port:init_file. The layout is built from the commands in init_file and served "
+                                     "to clients that connect on port. May be given more than once. Each of these "
+                                     "layouts keeps its checkpoint and journal in the files named by -s and -j with "
+                                     "a dot and its port appended. Only the layout given by -b and -c is recorded.");
+                crust_terminal_print("  -y  (Daemon mode only) disconnect a listener that has not caught up this many "
+                                     "seconds after passing the limit set by -q. 0 never disconnects. "
+                                     "(Defaults to 60.)");
+                crust_terminal_print("  -z  (Daemon mode only) start this many worker threads to write to clients, "
+                                     "leaving the daemon loop to read commands and update the state. "
+                                     "(Defaults to 0, which writes on the daemon loop.)");
+                crust_terminal_print("  -M  (Daemon mode only) publish the occupancy of each track circuit and the "
+                                     "headcode in each block of the layout given by -b and -c in the named POSIX "
+                                     "shared memory object, for programs on the same host to read.");
+                crust_terminal_print("  -U  (Daemon mode only) send the updates to the layout given by -b and -c, and "
+                                     "the whole state every second, to a UDP multicast group, in the format "
+                                     "group_address:port. The datagrams leave through the interface with the address "
+                                     "given by -a.");
                 exit(EXIT_SUCCESS);
 
 #ifdef GPIO
@@ -128,6 +188,17 @@ int main(int argc, char ** argv) {
                 crustOptionInvertPinLogic = true;
                 break;
 #endif
+            case 'j':
+                strncpy(crustOptionJournalPath, optarg, PATH_MAX);
+                crustOptionJournalPath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'k':
+                crustOptionRunMode = CRUST_RUN_MODE_COMPILE;
+                strncpy(crustOptionLayoutImagePath, optarg, PATH_MAX);
+                crustOptionLayoutImagePath[PATH_MAX - 1] = '\0';
+                break;
+
 #ifdef NCURSES
             case 'l':
                 crustOptionWindowEnterLog = true;
@@ -174,6 +245,16 @@ int main(int argc, char ** argv) {
                 crustOptionPort = (in_port_t)prospectivePort;
                 break;
 
+            case 'q':
+                endPointer = optarg;
+                crustOptionListenerHighWaterMark = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0')
+                {
+                    crust_terminal_print("Invalid high-water mark specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'r':
                 strncpy(crustOptionRunDirectory, optarg, PATH_MAX);
                 crustOptionRunDirectory[PATH_MAX - 1] = '\0';
@@ -186,6 +267,16 @@ int main(int argc, char ** argv) {
                 strncat(crustOptionSocketPath, CRUST_SOCKET_NAME, PATH_MAX - strlen(crustOptionSocketPath) - 1);
                 break;
 
+            case 's':
+                strncpy(crustOptionCheckpointPath, optarg, PATH_MAX);
+                crustOptionCheckpointPath[PATH_MAX - 1] = '\0';
+                break;
+
+#ifdef GPIO
+            case 't':
+                crustOptionSendEdgeTimes = true;
+                break;
+#endif
             case 'u':
                 userInfo = getpwnam(optarg);
                 if(userInfo == NULL)
@@ -217,12 +308,111 @@ int main(int argc, char ** argv) {
 #endif
                 break;
 
+            case 'x':
+                if(crustOptionExtraLayoutCount == CRUST_MAX_EXTRA_LAYOUTS)
+                {
+                    crust_terminal_print("Too many layouts specified");
+                    exit(EXIT_FAILURE);
+                }
+                endPointer = optarg;
+                prospectivePort = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0'
+                    || *endPointer != ':'
+                    || endPointer[1] == '\0'
+                    || prospectivePort > 65535
+                    || !prospectivePort)
+                {
+                    crust_terminal_print("Invalid layout specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionExtraLayouts[crustOptionExtraLayoutCount].port = (in_port_t)prospectivePort;
+                strncpy(crustOptionExtraLayouts[crustOptionExtraLayoutCount].configFilePath, endPointer + 1, PATH_MAX);
+                crustOptionExtraLayouts[crustOptionExtraLayoutCount].configFilePath[PATH_MAX - 1] = '\0';
+                crustOptionExtraLayoutCount++;
+                break;
+
+            case 'y':
+                endPointer = optarg;
+                crustOptionListenerLagLimit = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0')
+                {
+                    crust_terminal_print("Invalid lag limit specified");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'z':
+                endPointer = optarg;
+                prospectiveWorkerCount = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0' || *endPointer != '\0' || prospectiveWorkerCount > CRUST_MAX_WORKERS)
+                {
+                    crust_terminal_print("Invalid number of workers specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionWorkerCount = (unsigned int)prospectiveWorkerCount;
+                break;
+
+            case 'M':
+                if(*optarg == '\0' || strnlen(optarg, NAME_MAX) > NAME_MAX - 2 || strchr(optarg + 1, '/') != NULL)
+                {
+                    crust_terminal_print("Invalid shared memory name specified");
+                    exit(EXIT_FAILURE);
+                }
+                strncpy(crustOptionViewName, optarg, NAME_MAX);
+                crustOptionViewName[NAME_MAX - 1] = '\0';
+                break;
+
+            case 'U':
+                endPointer = strchr(optarg, ':');
+                if(endPointer == NULL || endPointer - optarg >= INET_ADDRSTRLEN)
+                {
+                    crust_terminal_print("Invalid multicast group specified");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(multicastGroup, optarg, endPointer - optarg);
+                multicastGroup[endPointer - optarg] = '\0';
+                if(!inet_aton(multicastGroup, &prospectiveIPAddress)
+                   || !IN_MULTICAST(ntohl(prospectiveIPAddress.s_addr)))
+                {
+                    crust_terminal_print("Invalid multicast group specified");
+                    exit(EXIT_FAILURE);
+                }
+                optarg = endPointer + 1;
+                prospectivePort = strtoul(optarg, &endPointer, 10);
+                if(*optarg == '\0'
+                    || *endPointer != '\0'
+                    || prospectivePort > 65535
+                    || !prospectivePort)
+                {
+                    crust_terminal_print("Invalid multicast group specified");
+                    exit(EXIT_FAILURE);
+                }
+                crustOptionMulticast = true;
+                crustOptionMulticastGroup = prospectiveIPAddress.s_addr;
+                crustOptionMulticastPort = (in_port_t)prospectivePort;
+                break;
+
             case '?':
             default:
                 exit(EXIT_FAILURE);
         }
     }
 
+    // Refuse a port given twice before any layout is loaded
+    for(unsigned int i = 0; i < crustOptionExtraLayoutCount; i++)
+    {
+        bool duplicatePort = crustOptionExtraLayouts[i].port == crustOptionPort;
+        for(unsigned int j = 0; j < i; j++)
+        {
+            duplicatePort = duplicatePort || crustOptionExtraLayouts[i].port == crustOptionExtraLayouts[j].port;
+        }
+        if(duplicatePort)
+        {
+            crust_terminal_print("Each layout must be served on a different port");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     switch(crustOptionRunMode)
     {
         default:
@@ -232,6 +422,10 @@ int main(int argc, char ** argv) {
         case CRUST_RUN_MODE_DAEMON:
             crust_daemon_run();
 
+        case CRUST_RUN_MODE_COMPILE:
+            crust_daemon_compile_layout();
+            break;
+
 #ifdef GPIO
         case CRUST_RUN_MODE_NODE:
             crust_node_run();
@@ -155,9 +155,9 @@ int crust_interpret_block(char * message, CRUST_BLOCK * block, CRUST_STATE * sta
             // Link to the existing block
             block->links[linkType] = linkBlock;
         }
-        else if(crustOptionRunMode == CRUST_RUN_MODE_DAEMON)
+        else if(state->closedLayout)
         {
-            // Reject the block if we are in daemon mode. (Links that go nowhere are acceptable in other modes.)
+            // Reject the block if we are building a layout. (Links that go nowhere are acceptable in other modes.)
             return 1;
         }
 
@@ -318,42 +318,76 @@ int crust_interpret_berth_step_instruction(char * message, CRUST_BERTH_STEP_INST
     return 0;
 }
 
-size_t crust_print_block(CRUST_BLOCK * block, char ** outBuffer)
+/*
+ * Adds the line describing a block to a print buffer. The block is described by its snapshot form so that live blocks
+ * and snapshots are printed the same way.
+ */
+void crust_print_block_line(CRUST_DYNAMIC_PRINT_BUFFER ** dynamicBuffer, CRUST_IDENTIFIER blockId, const CRUST_SNAPSHOT_BLOCK * block, const char * headcode)
 {
-    CRUST_DYNAMIC_PRINT_BUFFER * dynamicBuffer;
-    crust_dynamic_print_buffer_init(&dynamicBuffer);
-
     char partBuffer[CRUST_MAX_MESSAGE_LENGTH];
-    char * dynamicPartBuffer;
 
-    sprintf(partBuffer,"BL%i", block->blockId);
-    crust_dynamic_print_buffer_cat(&dynamicBuffer, partBuffer);
+    sprintf(partBuffer,"BL%u", blockId);
+    crust_dynamic_print_buffer_cat(dynamicBuffer, partBuffer);
     for(int i = 0; i < CRUST_MAX_LINKS; i++)
     {
-        if(block->links[i] != NULL)
+        if(block->links[i] != CRUST_SNAPSHOT_NO_LINK)
         {
-            sprintf(partBuffer, "%s%i", crustLinkDesignations[i], block->links[i]->blockId);
-            crust_dynamic_print_buffer_cat(&dynamicBuffer, partBuffer);
+            sprintf(partBuffer, "%s%u", crustLinkDesignations[i], block->links[i]);
+            crust_dynamic_print_buffer_cat(dynamicBuffer, partBuffer);
         }
     }
 
     if(block->berth)
     {
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, "/");
+        crust_dynamic_print_buffer_cat(dynamicBuffer, "/");
         if(block->berthDirection == UP)
         {
-            crust_dynamic_print_buffer_cat(&dynamicBuffer, "U");
+            crust_dynamic_print_buffer_cat(dynamicBuffer, "U");
         }
         else if(block->berthDirection == DOWN)
         {
-            crust_dynamic_print_buffer_cat(&dynamicBuffer, "D");
+            crust_dynamic_print_buffer_cat(dynamicBuffer, "D");
         }
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, block->headcode);
+        sprintf(partBuffer, "%.*s", CRUST_HEADCODE_LENGTH, headcode);
+        crust_dynamic_print_buffer_cat(dynamicBuffer, partBuffer);
     }
 
-    asprintf(&dynamicPartBuffer, ":%s\n", block->blockName);
-    crust_dynamic_print_buffer_cat(&dynamicBuffer, dynamicPartBuffer);
-    free(dynamicPartBuffer);
+    crust_dynamic_print_buffer_cat(dynamicBuffer, ":");
+    crust_dynamic_print_buffer_cat(dynamicBuffer, (char *)block->blockName);
+    crust_dynamic_print_buffer_cat(dynamicBuffer, "\n");
+}
+
+// Adds the status that ends the line describing a track circuit to a print buffer.
+void crust_print_track_circuit_status(CRUST_DYNAMIC_PRINT_BUFFER ** dynamicBuffer, bool known, bool occupied)
+{
+    if(!known)
+    {
+        crust_dynamic_print_buffer_cat(dynamicBuffer, "UK\n");
+    }
+    else if(occupied)
+    {
+        crust_dynamic_print_buffer_cat(dynamicBuffer, "OC\n");
+    }
+    else
+    {
+        crust_dynamic_print_buffer_cat(dynamicBuffer, "CL\n");
+    }
+}
+
+size_t crust_print_block(CRUST_BLOCK * block, char ** outBuffer, CRUST_STATE * state)
+{
+    CRUST_DYNAMIC_PRINT_BUFFER * dynamicBuffer;
+    crust_dynamic_print_buffer_init(&dynamicBuffer);
+
+    CRUST_SNAPSHOT_BLOCK snapshotBlock;
+    for(int i = 0; i < CRUST_MAX_LINKS; i++)
+    {
+        snapshotBlock.links[i] = block->links[i] == NULL ? CRUST_SNAPSHOT_NO_LINK : block->links[i]->blockId;
+    }
+    snapshotBlock.berth = block->berth;
+    snapshotBlock.berthDirection = block->berthDirection;
+    snapshotBlock.blockName = block->blockName;
+    crust_print_block_line(&dynamicBuffer, block->blockId, &snapshotBlock, crust_block_headcode(block, state));
 
     *outBuffer = dynamicBuffer->buffer;
     size_t finalLength = dynamicBuffer->pointer;
@@ -361,14 +395,14 @@ size_t crust_print_block(CRUST_BLOCK * block, char ** outBuffer)
     return finalLength;
 }
 
-size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** outBuffer)
+size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** outBuffer, CRUST_STATE * state)
 {
     CRUST_DYNAMIC_PRINT_BUFFER * dynamicBuffer;
     crust_dynamic_print_buffer_init(&dynamicBuffer);
 
     char chunkBuffer[CRUST_MAX_MESSAGE_LENGTH];
 
-    sprintf(chunkBuffer, "TC%i:", trackCircuit->trackCircuitId);
+    sprintf(chunkBuffer, "TC%u:", trackCircuit->trackCircuitId);
     crust_dynamic_print_buffer_cat(&dynamicBuffer, chunkBuffer);
 
     for(u_int32_t i = 0; i < trackCircuit->numBlocks; i++)
@@ -377,22 +411,13 @@ size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** out
         {
             crust_dynamic_print_buffer_cat(&dynamicBuffer, "/");
         }
-        sprintf(chunkBuffer, "%i", trackCircuit->blocks[i]->blockId);
+        sprintf(chunkBuffer, "%u", trackCircuit->blocks[i]->blockId);
         crust_dynamic_print_buffer_cat(&dynamicBuffer, chunkBuffer);
     }
 
-    if(trackCircuit->owningSession == NULL)
-    {
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, "UK\n");
-    }
-    else if(trackCircuit->occupied)
-    {
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, "OC\n");
-    }
-    else
-    {
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, "CL\n");
-    }
+    crust_print_track_circuit_status(&dynamicBuffer,
+                                     crust_track_circuit_is_known(trackCircuit, state),
+                                     crust_track_circuit_is_occupied(trackCircuit, state));
 
     *outBuffer = dynamicBuffer->buffer;
     size_t finalLength = dynamicBuffer->pointer;
@@ -401,42 +426,60 @@ size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** out
 }
 
 /*
- * Creates a buffer containing the entire state as text, ready to be sent to listeners. A pointer to the text is placed
- * in outBuffer and the length of the text is returned.
+ * Creates a buffer containing an entire snapshot as text, ready to be sent to listeners. A pointer to the text is
+ * placed in outBuffer and the length of the text is returned. Only reads the snapshot so may be called on any thread.
  */
-unsigned long crust_print_state(CRUST_STATE * state, char ** outBuffer)
+unsigned long crust_print_snapshot(CRUST_SNAPSHOT * snapshot, char ** outBuffer)
 {
     CRUST_DYNAMIC_PRINT_BUFFER * dynamicBuffer;
     crust_dynamic_print_buffer_init(&dynamicBuffer);
 
-    char lineBuffer[CRUST_MAX_MESSAGE_LENGTH];
-    char * subDynamicBuffer;
+    char chunkBuffer[CRUST_MAX_MESSAGE_LENGTH];
+    CRUST_SNAPSHOT_LAYOUT * layout = snapshot->layout;
+    CRUST_SNAPSHOT_RUNTIME * runtime = snapshot->runtime;
 
-    // Look up every block in the index one by one
-    CRUST_BLOCK * blockToPrint;
-    unsigned int blockToPrintId = 0;
-    while(crust_block_get(blockToPrintId, &blockToPrint, state))
+    for(CRUST_IDENTIFIER i = 0; i < layout->numBlocks; i++)
     {
-        // Fill the line buffer with the details of the block, then add the line buffer to the end of the print buffer.
-        crust_print_block(blockToPrint, &subDynamicBuffer);
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, subDynamicBuffer);
-        free(subDynamicBuffer);
-        blockToPrintId++;
+        crust_print_block_line(&dynamicBuffer, i, &layout->blocks[i], &runtime->headcodes[i * CRUST_HEADCODE_LENGTH]);
     }
 
-    // Do the same with track circuits
-    CRUST_TRACK_CIRCUIT * trackCircuitToPrint;
-    unsigned int trackCircuitToPrintId = 0;
-    while(crust_track_circuit_get(trackCircuitToPrintId, &trackCircuitToPrint, state))
+    for(CRUST_IDENTIFIER i = 0; i < layout->numTrackCircuits; i++)
     {
-        crust_print_track_circuit(trackCircuitToPrint, &subDynamicBuffer);
-        crust_dynamic_print_buffer_cat(&dynamicBuffer, subDynamicBuffer);
-        free(subDynamicBuffer);
-        trackCircuitToPrintId++;
+        sprintf(chunkBuffer, "TC%u:", i);
+        crust_dynamic_print_buffer_cat(&dynamicBuffer, chunkBuffer);
+
+        for(CRUST_IDENTIFIER j = 0; j < layout->trackCircuits[i].numBlocks; j++)
+        {
+            if(j)
+            {
+                crust_dynamic_print_buffer_cat(&dynamicBuffer, "/");
+            }
+            sprintf(chunkBuffer, "%u", layout->members[layout->trackCircuits[i].blockBase + j]);
+            crust_dynamic_print_buffer_cat(&dynamicBuffer, chunkBuffer);
+        }
+
+        crust_print_track_circuit_status(&dynamicBuffer,
+                                         CRUST_BITSET_TEST(runtime->trackCircuitKnown, i),
+                                         CRUST_BITSET_TEST(runtime->trackCircuitOccupancy, i));
     }
 
     *outBuffer = dynamicBuffer->buffer;
     size_t finalLength = dynamicBuffer->pointer;
     free(dynamicBuffer);
     return finalLength;
-}
\ No newline at end of file
+}
+
+/*
+ * Creates a buffer containing the entire state as text, ready to be sent to listeners. A pointer to the text is placed
+ * in outBuffer and the length of the text is returned.
+ */
+unsigned long crust_print_state(CRUST_STATE * state, char ** outBuffer)
+{
+    CRUST_SNAPSHOT snapshot;
+
+    crust_snapshot_take(state, &snapshot);
+    unsigned long finalLength = crust_print_snapshot(&snapshot, outBuffer);
+    crust_snapshot_release(&snapshot);
+
+    return finalLength;
+}
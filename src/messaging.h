@@ -24,6 +24,7 @@
 #include <time.h>
 #include "state.h"
 #include "config.h"
+#include "snapshot.h"
 
 #define CRUST_OPCODE enum crustOpcode
 #define CRUST_INPUT_BUFFER struct crustInputBuffer
@@ -46,7 +47,9 @@ enum crustOpcode {
     ENABLE_BERTH_UP,
     ENABLE_BERTH_DOWN,
     INTERPOSE,
-    BERTH_STEP
+    BERTH_STEP,
+    SEND_METRICS,
+    NUM_OPCODES // Not an opcode, counts the opcodes above
 };
 
 struct crustInputBuffer {
@@ -71,13 +74,16 @@ union crustMixedOperationInput
     CRUST_BERTH_STEP_INSTRUCTION * manualStepInstruction;
 };
 
+void crust_dynamic_print_buffer_init(CRUST_DYNAMIC_PRINT_BUFFER ** dynamicPrintBuffer);
+void crust_dynamic_print_buffer_cat(CRUST_DYNAMIC_PRINT_BUFFER ** dst, char * src);
 int crust_interpret_identifier(char * message, CRUST_IDENTIFIER * identifier);
 int crust_interpret_block(char * message, CRUST_BLOCK * block, CRUST_STATE * state);
 int crust_interpret_track_circuit(char * message, CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
 int crust_interpret_interpose_instruction(char * message, CRUST_INTERPOSE_INSTRUCTION * interposeInstruction);
 int crust_interpret_berth_step_instruction(char * message, CRUST_BERTH_STEP_INSTRUCTION * berthStepInstruction);
-size_t crust_print_block(CRUST_BLOCK * block, char ** outBuffer);
-size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** outBuffer);
+size_t crust_print_block(CRUST_BLOCK * block, char ** outBuffer, CRUST_STATE * state);
+size_t crust_print_track_circuit(CRUST_TRACK_CIRCUIT * trackCircuit, char ** outBuffer, CRUST_STATE * state);
+unsigned long crust_print_snapshot(CRUST_SNAPSHOT * snapshot, char ** outBuffer);
 unsigned long crust_print_state(CRUST_STATE * state, char ** outBuffer);
 
 #endif //CRUST_MESSAGING_H
@@ -0,0 +1,140 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+u_int64_t crust_metrics_nanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000000 + (u_int64_t)now.tv_nsec;
+}
+
+int crust_metrics_compare(const void * a, const void * b)
+{
+    u_int64_t valueA = *(const u_int64_t *)a;
+    u_int64_t valueB = *(const u_int64_t *)b;
+    return (valueA > valueB) - (valueA < valueB);
+}
+
+// Sorts a list of values, such as latencies, into ascending order for crust_metrics_percentile()
+void crust_metrics_sort(u_int64_t * values, size_t count)
+{
+    qsort(values, count, sizeof(u_int64_t), crust_metrics_compare);
+}
+
+// Returns the given percentile of a list of at least one value sorted by crust_metrics_sort()
+u_int64_t crust_metrics_percentile(const u_int64_t * values, size_t count, double percentile)
+{
+    size_t index = (size_t)(percentile / 100 * (double)count);
+    return values[index < count ? index : count - 1];
+}
+
+void crust_histogram_init(CRUST_HISTOGRAM * histogram)
+{
+    memset(histogram, 0, sizeof(CRUST_HISTOGRAM));
+}
+
+void crust_histogram_record(CRUST_HISTOGRAM * histogram, u_int64_t value)
+{
+    unsigned int bucket = 0;
+    while(bucket < CRUST_HISTOGRAM_BUCKETS - 1 && value >> bucket)
+    {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+// Adds the values recorded in one histogram to another.
+void crust_histogram_merge(CRUST_HISTOGRAM * histogram, const CRUST_HISTOGRAM * other)
+{
+    for(unsigned int i = 0; i < CRUST_HISTOGRAM_BUCKETS; i++)
+    {
+        histogram->buckets[i] += other->buckets[i];
+    }
+    histogram->count += other->count;
+    histogram->sum += other->sum;
+}
+
+void crust_metrics_print_family(CRUST_DYNAMIC_PRINT_BUFFER ** buffer, const char * name, const char * type, const char * help)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH];
+
+    snprintf(line, CRUST_MAX_MESSAGE_LENGTH, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    crust_dynamic_print_buffer_cat(buffer, line);
+}
+
+// Prints one sample. labels is the text between the braces, or NULL for a sample without labels.
+void crust_metrics_print_value(CRUST_DYNAMIC_PRINT_BUFFER ** buffer, const char * name, const char * labels, u_int64_t value)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH];
+
+    if(labels == NULL)
+    {
+        snprintf(line, CRUST_MAX_MESSAGE_LENGTH, "%s %llu\n", name, (unsigned long long)value);
+    }
+    else
+    {
+        snprintf(line, CRUST_MAX_MESSAGE_LENGTH, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    }
+    crust_dynamic_print_buffer_cat(buffer, line);
+}
+
+// Prints a whole histogram family, leaving out the buckets above the largest value recorded.
+void crust_metrics_print_histogram(CRUST_DYNAMIC_PRINT_BUFFER ** buffer,
+                                   const char * name,
+                                   const char * help,
+                                   const CRUST_HISTOGRAM * histogram)
+{
+    char sampleName[CRUST_MAX_MESSAGE_LENGTH];
+    char labels[32];
+    unsigned int highestBucket = 0;
+    u_int64_t cumulative = 0;
+
+    crust_metrics_print_family(buffer, name, "histogram", help);
+
+    for(unsigned int i = 0; i < CRUST_HISTOGRAM_BUCKETS; i++)
+    {
+        if(histogram->buckets[i])
+        {
+            highestBucket = i;
+        }
+    }
+
+    snprintf(sampleName, CRUST_MAX_MESSAGE_LENGTH, "%s_bucket", name);
+    for(unsigned int i = 0; i <= highestBucket && i < CRUST_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        cumulative += histogram->buckets[i];
+        snprintf(labels, sizeof(labels), "le=\"%llu\"", (unsigned long long)((u_int64_t)1 << i));
+        crust_metrics_print_value(buffer, sampleName, labels, cumulative);
+    }
+    crust_metrics_print_value(buffer, sampleName, "le=\"+Inf\"", histogram->count);
+
+    snprintf(sampleName, CRUST_MAX_MESSAGE_LENGTH, "%s_sum", name);
+    crust_metrics_print_value(buffer, sampleName, NULL, histogram->sum);
+    snprintf(sampleName, CRUST_MAX_MESSAGE_LENGTH, "%s_count", name);
+    crust_metrics_print_value(buffer, sampleName, NULL, histogram->count);
+}
@@ -0,0 +1,56 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_METRICS_H
+#define CRUST_METRICS_H
+
+#include <sys/types.h>
+#include "messaging.h"
+
+/*
+ * Counters and histograms describing what the daemon is doing, printed in the Prometheus text format in reply to ST.
+ * Each is only ever changed by one thread, so recording a value is a plain increment with no locking.
+ */
+
+#define CRUST_HISTOGRAM_BUCKETS 40
+
+#define CRUST_HISTOGRAM struct crustHistogram
+
+// Bucket i counts the values below 2^i, so the buckets cover everything up to about 18 minutes in nanoseconds.
+struct crustHistogram {
+    u_int64_t buckets[CRUST_HISTOGRAM_BUCKETS];
+    u_int64_t count;
+    u_int64_t sum;
+};
+
+u_int64_t crust_metrics_nanoseconds();
+void crust_metrics_sort(u_int64_t * values, size_t count);
+u_int64_t crust_metrics_percentile(const u_int64_t * values, size_t count, double percentile);
+void crust_histogram_init(CRUST_HISTOGRAM * histogram);
+void crust_histogram_record(CRUST_HISTOGRAM * histogram, u_int64_t value);
+void crust_histogram_merge(CRUST_HISTOGRAM * histogram, const CRUST_HISTOGRAM * other);
+void crust_metrics_print_family(CRUST_DYNAMIC_PRINT_BUFFER ** buffer, const char * name, const char * type, const char * help);
+void crust_metrics_print_value(CRUST_DYNAMIC_PRINT_BUFFER ** buffer, const char * name, const char * labels, u_int64_t value);
+void crust_metrics_print_histogram(CRUST_DYNAMIC_PRINT_BUFFER ** buffer,
+                                   const char * name,
+                                   const char * help,
+                                   const CRUST_HISTOGRAM * histogram);
+
+#endif //CRUST_METRICS_H
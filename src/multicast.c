@@ -0,0 +1,223 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "multicast.h"
+#include "terminal.h"
+
+/*
+ * Opens a socket that sends to the group on port. Datagrams leave through the interface with interfaceAddress, or
+ * through whichever interface the routing table picks if that is INADDR_ANY.
+ */
+void crust_multicast_open(CRUST_MULTICAST * multicast, in_addr_t group, in_port_t port, in_addr_t interfaceAddress)
+{
+    struct sockaddr_in groupAddress;
+    struct in_addr multicastInterface;
+    unsigned char ttl = CRUST_MULTICAST_TTL;
+    unsigned char loop = 1; // Let displays on the daemon's own host follow the feed
+
+    memset(&groupAddress, 0, sizeof(groupAddress));
+    groupAddress.sin_family = AF_INET;
+    groupAddress.sin_addr.s_addr = group;
+    groupAddress.sin_port = htons(port);
+    multicastInterface.s_addr = interfaceAddress;
+
+    multicast->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(multicast->fd == -1
+       || setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))
+       || setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))
+       || (interfaceAddress != INADDR_ANY
+           && setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_IF, &multicastInterface, sizeof(multicastInterface)))
+       || fcntl(multicast->fd, F_SETFL, O_NONBLOCK)
+       || connect(multicast->fd, (struct sockaddr *)&groupAddress, sizeof(groupAddress)))
+    {
+        crust_terminal_print("Unable to open the multicast socket");
+        exit(EXIT_FAILURE);
+    }
+
+    crust_dynamic_print_buffer_init(&multicast->pending);
+    crust_multicast_discard(multicast);
+    multicast->sequence = 0;
+    multicast->datagrams = 0;
+    multicast->droppedDatagrams = 0;
+    multicast->state = NULL;
+}
+
+// Queues an update to go out with the next flush.
+void crust_multicast_append(CRUST_MULTICAST * multicast, char * message)
+{
+    crust_dynamic_print_buffer_cat(&multicast->pending, message);
+}
+
+/*
+ * Returns the length of the next part of text to send, which is as many whole lines as fit in a datagram. A line too
+ * long to fit is sent on its own.
+ */
+size_t crust_multicast_next_part(const char * text)
+{
+    size_t limit = CRUST_MULTICAST_DATAGRAM_LENGTH - CRUST_MULTICAST_HEADER_LENGTH;
+    size_t length = 0;
+    for(;;)
+    {
+        const char * lineEnd = strchr(text + length, '\n');
+        size_t nextLength = lineEnd == NULL ? length + strlen(text + length) : (size_t)(lineEnd - text) + 1;
+        if(nextLength == length || (nextLength > limit && length))
+        {
+            return length;
+        }
+        length = nextLength;
+        if(length >= limit)
+        {
+            return length;
+        }
+    }
+}
+
+// Sends a datagram made of header and the first length bytes of body. Datagrams the socket can't take are dropped.
+void crust_multicast_send(CRUST_MULTICAST * multicast, const char * header, const char * body, size_t length)
+{
+    char * datagram = multicast->datagram;
+    size_t headerLength = strlen(header);
+    size_t datagramLength = headerLength + length;
+    if(datagramLength > CRUST_MULTICAST_DATAGRAM_LENGTH)
+    {
+        datagram = malloc(datagramLength);
+        if(datagram == NULL)
+        {
+            crust_terminal_print("Memory allocation error.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(datagram, header, headerLength);
+    memcpy(datagram + headerLength, body, length);
+
+    for(;;)
+    {
+        if(send(multicast->fd, datagram, datagramLength, 0) != -1)
+        {
+            multicast->datagrams++;
+            break;
+        }
+        if(errno != EINTR)
+        {
+            multicast->droppedDatagrams++;
+            break;
+        }
+    }
+
+    if(datagram != multicast->datagram)
+    {
+        free(datagram);
+    }
+}
+
+// Throws away the updates queued since the last flush.
+void crust_multicast_discard(CRUST_MULTICAST * multicast)
+{
+    multicast->pending->pointer = 0;
+    multicast->pending->buffer[0] = '\0';
+}
+
+// Sends the updates queued since the last flush, each datagram numbered one more than the last.
+void crust_multicast_flush(CRUST_MULTICAST * multicast)
+{
+    char header[CRUST_MULTICAST_HEADER_LENGTH];
+    const char * text = multicast->pending->buffer;
+    size_t length;
+
+    if(!multicast->pending->pointer)
+    {
+        return;
+    }
+
+    while((length = crust_multicast_next_part(text)))
+    {
+        snprintf(header, sizeof(header), "SQ%llu\n", (unsigned long long)++multicast->sequence);
+        crust_multicast_send(multicast, header, text, length);
+        text += length;
+    }
+
+    crust_multicast_discard(multicast);
+}
+
+/*
+ * Starts sending text, the whole state as printed for RS, in as many datagrams as it takes. The multicast takes the
+ * text over. sequence is the number of the last update datagram whose changes are included in the state and now is the
+ * time in milliseconds that the parts are spread out from. Any state still being sent is abandoned.
+ */
+void crust_multicast_start_state(CRUST_MULTICAST * multicast, char * text, u_int64_t sequence, long long now)
+{
+    size_t length;
+
+    free(multicast->state);
+    multicast->state = text;
+    multicast->nextPart = text;
+    multicast->stateSequence = sequence;
+    multicast->stateParts = 0;
+    multicast->statePartsSent = 0;
+    multicast->stateStartedAt = now;
+    for(const char * part = text; (length = crust_multicast_next_part(part)); part += length)
+    {
+        multicast->stateParts++;
+    }
+    if(!multicast->stateParts)
+    {
+        free(multicast->state);
+        multicast->state = NULL;
+    }
+}
+
+// Returns the time in milliseconds that the next part of the state is due to be sent, or -1 if there is none.
+long long crust_multicast_state_due(CRUST_MULTICAST * multicast)
+{
+    if(multicast->state == NULL)
+    {
+        return -1;
+    }
+    return multicast->stateStartedAt
+           + (long long)multicast->statePartsSent * CRUST_MULTICAST_STATE_SPREAD / multicast->stateParts;
+}
+
+// Sends the parts of the state that are due by now.
+void crust_multicast_send_state(CRUST_MULTICAST * multicast, long long now)
+{
+    char header[CRUST_MULTICAST_HEADER_LENGTH];
+
+    while(multicast->state != NULL && crust_multicast_state_due(multicast) <= now)
+    {
+        size_t length = crust_multicast_next_part(multicast->nextPart);
+        snprintf(header, sizeof(header), "SS%llu:%u/%u\n", (unsigned long long)multicast->stateSequence,
+                 ++multicast->statePartsSent, multicast->stateParts);
+        crust_multicast_send(multicast, header, multicast->nextPart, length);
+        multicast->nextPart += length;
+        if(multicast->statePartsSent == multicast->stateParts)
+        {
+            free(multicast->state);
+            multicast->state = NULL;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_MULTICAST_H
+#define CRUST_MULTICAST_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "messaging.h"
+
+/*
+ * The multicast feed sends a layout's updates to a UDP multicast group, so that any number of passive displays can
+ * follow the layout for the cost of one send per datagram. Each round of updates goes out in numbered datagrams and
+ * the whole state is sent round again every CRUST_MULTICAST_CAROUSEL_INTERVAL milliseconds so that displays can join
+ * at any time and recover from lost datagrams. The parts of the state are spread out over CRUST_MULTICAST_STATE_SPREAD
+ * milliseconds rather than sent in one burst, which the socket buffer and the displays could not take for a large
+ * layout. See RESPONSES.md for the format.
+ */
+
+#define CRUST_MULTICAST_DATAGRAM_LENGTH 1400 // Small enough to pass through an Ethernet link without fragmenting
+#define CRUST_MULTICAST_HEADER_LENGTH 64 // Room kept at the start of each datagram for its header
+#define CRUST_MULTICAST_CAROUSEL_INTERVAL 1000 // Milliseconds between sending the whole state
+#define CRUST_MULTICAST_STATE_SPREAD 500 // Milliseconds the parts of the state are sent over
+#define CRUST_MULTICAST_TTL 1 // Keep the feed on the local network
+
+#define CRUST_MULTICAST struct crustMulticast
+
+struct crustMulticast {
+    int fd;
+    CRUST_DYNAMIC_PRINT_BUFFER * pending; // Updates made since the last flush
+    u_int64_t sequence; // The number of the last update datagram sent
+    u_int64_t datagrams; // Datagrams sent, including those of the state
+    u_int64_t droppedDatagrams; // Datagrams the socket had no room for
+    char datagram[CRUST_MULTICAST_DATAGRAM_LENGTH];
+    char * state; // The state being sent, NULL once every part has gone
+    const char * nextPart; // Where the next part of the state starts
+    u_int64_t stateSequence;
+    unsigned int stateParts;
+    unsigned int statePartsSent;
+    long long stateStartedAt; // In the milliseconds given to crust_multicast_start_state()
+};
+
+void crust_multicast_open(CRUST_MULTICAST * multicast, in_addr_t group, in_port_t port, in_addr_t interfaceAddress);
+void crust_multicast_append(CRUST_MULTICAST * multicast, char * message);
+void crust_multicast_discard(CRUST_MULTICAST * multicast);
+void crust_multicast_flush(CRUST_MULTICAST * multicast);
+void crust_multicast_start_state(CRUST_MULTICAST * multicast, char * text, u_int64_t sequence, long long now);
+void crust_multicast_send_state(CRUST_MULTICAST * multicast, long long now);
+long long crust_multicast_state_due(CRUST_MULTICAST * multicast);
+
+#endif //CRUST_MULTICAST_H
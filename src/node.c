@@ -54,6 +54,7 @@ struct crustGPIOPinMap {
     bool lastOccupationRead; // The last occupation state read on the line (true = occupied, false = clear)
     bool lastOccupationSent; // The last occupation state sent to the server
     struct timespec lastReadAt; // The time the last read occurred
+    struct timespec lastEdgeAt; // The wall clock time of the last edge, zero if the state was read rather than seen changing
     CRUST_CONNECTION * connection;
 };
 
@@ -106,6 +107,8 @@ void crust_generate_pin_map(char * mapText)
         pinMap[pinMapLength - 1].connection = NULL;
         pinMap[pinMapLength - 1].lastReadAt.tv_nsec = 0;
         pinMap[pinMapLength - 1].lastReadAt.tv_sec = 0;
+        pinMap[pinMapLength - 1].lastEdgeAt.tv_nsec = 0;
+        pinMap[pinMapLength - 1].lastEdgeAt.tv_sec = 0;
     }
 }
 
@@ -138,6 +141,8 @@ void crust_node_receive_read(CRUST_CONNECTION * connection)
             pin->lastOccupationRead = false;
         }
         clock_gettime(CLOCK_MONOTONIC, &pin->lastReadAt);
+        // The wall clock is what the daemon can compare with its own, given both are kept in sync
+        clock_gettime(CLOCK_REALTIME, &pin->lastEdgeAt);
     }
 }
 
@@ -155,6 +160,8 @@ void crust_node_receive_open(CRUST_CONNECTION * connection)
             pinMap[i].lastOccupationSent = !pinValue ^ crustOptionInvertPinLogic;
             pinMap[i].lastReadAt.tv_sec = 0;
             pinMap[i].lastReadAt.tv_nsec = 0;
+            pinMap[i].lastEdgeAt.tv_sec = 0;
+            pinMap[i].lastEdgeAt.tv_nsec = 0;
         }
     }
 }
@@ -191,9 +198,15 @@ void crust_node_handle_signal(int signal)
     }
 }
 
+long long crust_node_microseconds(const struct timespec * time)
+{
+    return (long long)time->tv_sec * 1000000 + time->tv_nsec / 1000;
+}
+
 _Noreturn void crust_node_loop()
 {
     struct timespec now;
+    struct timespec sentAt;
     char messageBuffer[CRUST_MAX_MESSAGE_LENGTH];
 
     for(;;)
@@ -214,13 +227,18 @@ _Noreturn void crust_node_loop()
 
                     if (pinMap[i].lastOccupationRead || differenceMilliseconds >= CRUST_NODE_SETTLE_TIME)
                     {
-                        if (pinMap[i].lastOccupationRead)
+                        const char * opcode = pinMap[i].lastOccupationRead ? "OC" : "CC";
+                        if (crustOptionSendEdgeTimes && pinMap[i].lastEdgeAt.tv_sec)
                         {
-                            sprintf(messageBuffer, "OC%i\n", pinMap[i].trackCircuitID);
+                            // Carry the time of the edge and the time it was sent for the daemon's latency tracing
+                            clock_gettime(CLOCK_REALTIME, &sentAt);
+                            sprintf(messageBuffer, "%s%i@%lld,%lld\n", opcode, pinMap[i].trackCircuitID,
+                                    crust_node_microseconds(&pinMap[i].lastEdgeAt),
+                                    crust_node_microseconds(&sentAt));
                         }
                         else
                         {
-                            sprintf(messageBuffer, "CC%i\n", pinMap[i].trackCircuitID);
+                            sprintf(messageBuffer, "%s%i\n", opcode, pinMap[i].trackCircuitID);
                         }
                         crust_connection_write(nodeServerConnection, messageBuffer);
                         pinMap[i].lastOccupationSent = pinMap[i].lastOccupationRead;
@@ -315,6 +333,8 @@ _Noreturn void crust_node_run()
         // Set to immediately trigger a state update when the loop starts
         pinMap[i].lastReadAt.tv_nsec = 0;
         pinMap[i].lastReadAt.tv_sec = 0;
+        pinMap[i].lastEdgeAt.tv_nsec = 0;
+        pinMap[i].lastEdgeAt.tv_sec = 0;
         if(crustOptionInvertPinLogic)
         {
             pinMap[i].lastOccupationRead = !gpiod_line_get_value(pinMap[i].gpioLine);
@@ -0,0 +1,278 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * crust-replay feeds a recorded command stream into the daemon core as fast as it will go and reports how quickly the
+ * core got through it. Each line of the stream holds the milliseconds since the recording started, the number of the
+ * session that sent the command, and the command itself, as written by the daemon's -e option:
+ *
+ *     1520 3 OC14
+ *
+ * Nothing touches a socket, so two runs over the same stream do the same work and finish in the same state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "core.h"
+#include "image.h"
+#include "state.h"
+#include "messaging.h"
+#include "config.h"
+#include "terminal.h"
+
+#define CRUST_REPLAY_EVENT struct crustReplayEvent
+
+struct crustReplayEvent {
+    long long time; // Milliseconds since the recording started
+    unsigned int session;
+    char * message;
+};
+
+CRUST_REPLAY_EVENT * replayEvents = NULL;
+size_t replayEventCount = 0;
+unsigned int replaySessionCount = 0;
+
+CRUST_CORE * replayCore;
+
+/*
+ * Reads the whole stream up front so that reading the file plays no part in the measurements. Exits if the stream is
+ * malformed or out of order.
+ */
+void crust_replay_read_events(const char * path)
+{
+    char line[CRUST_MAX_MESSAGE_LENGTH + 32];
+    size_t allocatedEvents = 0;
+    unsigned long lineNumber = 0;
+    char * endPointer;
+
+    FILE * eventFile = fopen(path, "r");
+    if(eventFile == NULL)
+    {
+        crust_terminal_print("Failed to open the event file.");
+        exit(EXIT_FAILURE);
+    }
+
+    while(fgets(line, sizeof(line), eventFile) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "\n")] = '\0';
+        if(line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+
+        CRUST_REPLAY_EVENT event;
+        event.time = strtoll(line, &endPointer, 10);
+        if(endPointer == line || *endPointer != ' ')
+        {
+            fprintf(stderr, "Invalid event time on line %lu\r\n", lineNumber);
+            exit(EXIT_FAILURE);
+        }
+        char * sessionStart = endPointer + 1;
+        event.session = (unsigned int)strtoul(sessionStart, &endPointer, 10);
+        if(endPointer == sessionStart || *endPointer != ' ')
+        {
+            fprintf(stderr, "Invalid session number on line %lu\r\n", lineNumber);
+            exit(EXIT_FAILURE);
+        }
+        if(replayEventCount && event.time < replayEvents[replayEventCount - 1].time)
+        {
+            fprintf(stderr, "Event on line %lu is earlier than the one before it\r\n", lineNumber);
+            exit(EXIT_FAILURE);
+        }
+        event.message = strdup(endPointer + 1);
+
+        if(replayEventCount == allocatedEvents)
+        {
+            allocatedEvents = allocatedEvents ? allocatedEvents * 2 : 1024;
+            replayEvents = realloc(replayEvents, sizeof(CRUST_REPLAY_EVENT) * allocatedEvents);
+        }
+        if(replayEvents == NULL || event.message == NULL)
+        {
+            crust_terminal_print("Memory allocation error.");
+            exit(EXIT_FAILURE);
+        }
+        replayEvents[replayEventCount++] = event;
+        if(event.session >= replaySessionCount)
+        {
+            replaySessionCount = event.session + 1;
+        }
+    }
+
+    fclose(eventFile);
+}
+
+// A 64-bit FNV-1a hash of the printed state, so that the outcome of two runs can be compared at a glance.
+u_int64_t crust_replay_state_digest()
+{
+    char * stateText;
+    u_int64_t digest = 0xcbf29ce484222325ULL;
+
+    unsigned long length = crust_print_state(replayCore->state, &stateText);
+    for(unsigned long i = 0; i < length; i++)
+    {
+        digest ^= (unsigned char)stateText[i];
+        digest *= 0x100000001b3ULL;
+    }
+    free(stateText);
+
+    return digest;
+}
+
+/*
+ * Builds the layout from the image named by -b, or from the commands in the file named by -c if there is no image.
+ * Exits if the layout can't be loaded.
+ */
+void crust_replay_load_layout()
+{
+    if(crustOptionLayoutImagePath[0] != '\0')
+    {
+        if(crust_image_load(replayCore->state, crustOptionLayoutImagePath, NULL))
+        {
+            crust_terminal_print("Failed to load the layout image.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(crustOptionDaemonConfigFilePath[0] != '\0')
+    {
+        switch(crust_core_read_config(replayCore, crustOptionDaemonConfigFilePath))
+        {
+            case 0:
+                break;
+
+            case 1:
+                crust_terminal_print("Failed to open the init file.");
+                exit(EXIT_FAILURE);
+
+            default:
+                crust_terminal_print("Invalid init file.");
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    int option;
+    while((option = getopt(argc, argv, "b:c:hv")) != -1)
+    {
+        switch(option)
+        {
+            case 'b':
+                strncpy(crustOptionLayoutImagePath, optarg, PATH_MAX);
+                crustOptionLayoutImagePath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'c':
+                strncpy(crustOptionDaemonConfigFilePath, optarg, PATH_MAX);
+                crustOptionDaemonConfigFilePath[PATH_MAX - 1] = '\0';
+                break;
+
+            case 'h':
+                crust_terminal_print("Usage: crust-replay [options] event_file");
+                crust_terminal_print("  -b  Load the layout from the named image compiled with crust -k.");
+                crust_terminal_print("  -c  Execute the commands in the named file before replaying the events.");
+                crust_terminal_print("  -h  Display this help.");
+                crust_terminal_print("  -v  Display verbose output.");
+                exit(EXIT_SUCCESS);
+
+            case 'v':
+                crustOptionVerbose = true;
+                break;
+
+            case '?':
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(optind != argc - 1)
+    {
+        crust_terminal_print("An event file must be specified.");
+        exit(EXIT_FAILURE);
+    }
+
+    crust_core_init(&replayCore);
+    crust_replay_load_layout();
+    crust_compile_path_circuits(replayCore->state);
+    crust_replay_read_events(argv[optind]);
+
+    CRUST_SESSION * sessions = malloc(sizeof(CRUST_SESSION) * (replaySessionCount ? replaySessionCount : 1));
+    u_int64_t * latencies = malloc(sizeof(u_int64_t) * (replayEventCount ? replayEventCount : 1));
+    if(sessions == NULL || latencies == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    for(unsigned int i = 0; i < replaySessionCount; i++)
+    {
+        crust_core_session_init(replayCore, &sessions[i]);
+    }
+
+    // Requests for the state have no connection to go to here, so they are counted and passed over
+    size_t skipped = 0;
+    size_t replayed = 0;
+    u_int64_t replayStart = crust_metrics_nanoseconds();
+    for(size_t i = 0; i < replayEventCount; i++)
+    {
+        if(strncmp(replayEvents[i].message, "RS", 2) == 0 || strncmp(replayEvents[i].message, "SL", 2) == 0)
+        {
+            skipped++;
+            continue;
+        }
+
+        u_int64_t eventStart = crust_metrics_nanoseconds();
+        crust_core_execute(replayCore, replayEvents[i].message, &sessions[replayEvents[i].session]);
+        latencies[replayed++] = crust_metrics_nanoseconds() - eventStart;
+    }
+    u_int64_t replayTime = crust_metrics_nanoseconds() - replayStart;
+
+    double replaySeconds = (double)replayTime / 1e9;
+    printf("Replayed %zu events (%zu skipped) from %u sessions in %.6f s: %.0f events/s\n",
+           replayed,
+           skipped,
+           replaySessionCount,
+           replaySeconds,
+           replaySeconds > 0 ? (double)replayed / replaySeconds : 0);
+    if(replayEventCount)
+    {
+        double recordedSeconds = (double)(replayEvents[replayEventCount - 1].time - replayEvents[0].time) / 1e3;
+        printf("Recording spans %.3f s, replayed %.0fx faster than recorded\n",
+               recordedSeconds,
+               replaySeconds > 0 ? recordedSeconds / replaySeconds : 0);
+    }
+    if(replayed)
+    {
+        crust_metrics_sort(latencies, replayed);
+        printf("Latency (ns): p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+               (unsigned long long)crust_metrics_percentile(latencies, replayed, 50),
+               (unsigned long long)crust_metrics_percentile(latencies, replayed, 90),
+               (unsigned long long)crust_metrics_percentile(latencies, replayed, 99),
+               (unsigned long long)crust_metrics_percentile(latencies, replayed, 99.9),
+               (unsigned long long)latencies[replayed - 1]);
+    }
+    printf("State generation %llu, digest %016llx\n",
+           (unsigned long long)replayCore->state->generation,
+           (unsigned long long)crust_replay_state_digest());
+
+    return EXIT_SUCCESS;
+}
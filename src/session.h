@@ -0,0 +1,63 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_SESSION_H
+#define CRUST_SESSION_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define CRUST_SESSION struct crustSession
+#define CRUST_SESSION_OUTPUT struct crustSessionOutput
+
+/*
+ * Output waiting to be sent to a session. While a snapshot of the state is being printed for a session, everything
+ * written to the session after it waits here so that it arrives after the snapshot.
+ */
+struct crustSessionOutput {
+    char * text; // NULL until the snapshot has been printed
+    CRUST_SESSION * session;
+    CRUST_SESSION_OUTPUT * next;
+};
+
+// A client of the core. Sessions driven by something other than a socket leave the connection NULL.
+struct crustSession {
+    struct crustCore * core; // The core that carries out the session's commands
+    struct crustConnection * connection;
+    struct crustWorkerChannel * channel; // Set when a worker writes to the session's socket
+    bool listening;
+    bool closed;
+    bool ownsCircuits;
+    bool inputPending; // Whether commands have been received but not yet carried out
+    CRUST_SESSION_OUTPUT * outputHead;
+    CRUST_SESSION_OUTPUT * outputTail;
+    /*
+     * A listener that has fallen too far behind is sent nothing more until it catches up. Meanwhile the blocks and
+     * track circuits that change are marked here, one bit per ID, and sent as they then stand.
+     */
+    bool coalescing;
+    long long coalescingSince; // Milliseconds on the daemon's clock
+    u_int64_t * dirtyBlocks;
+    unsigned int dirtyBlocksLength;
+    u_int64_t * dirtyTrackCircuits;
+    unsigned int dirtyTrackCircuitsLength;
+};
+
+#endif //CRUST_SESSION_H
@@ -0,0 +1,287 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "messaging.h"
+#include "terminal.h"
+#include "thread.h"
+#include "metrics.h"
+
+void * crust_snapshot_allocate(size_t size)
+{
+    void * allocation = malloc(size);
+    if(allocation == NULL && size)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    return allocation;
+}
+
+CRUST_SNAPSHOT_LAYOUT * crust_snapshot_layout_copy(CRUST_STATE * state)
+{
+    CRUST_SNAPSHOT_LAYOUT * layout = crust_snapshot_allocate(sizeof(CRUST_SNAPSHOT_LAYOUT));
+    layout->references = 1;
+    layout->layoutGeneration = state->layoutGeneration;
+    layout->numBlocks = state->blockIndexPointer;
+    layout->numTrackCircuits = state->trackCircuitIndexPointer;
+    layout->blocks = crust_snapshot_allocate(sizeof(CRUST_SNAPSHOT_BLOCK) * layout->numBlocks);
+    layout->trackCircuits = crust_snapshot_allocate(sizeof(CRUST_SNAPSHOT_TRACK_CIRCUIT) * layout->numTrackCircuits);
+
+    for(CRUST_IDENTIFIER i = 0; i < layout->numBlocks; i++)
+    {
+        CRUST_BLOCK * block = state->blockIndex[i];
+        for(int j = 0; j < CRUST_MAX_LINKS; j++)
+        {
+            layout->blocks[i].links[j] = block->links[j] == NULL ? CRUST_SNAPSHOT_NO_LINK : block->links[j]->blockId;
+        }
+        layout->blocks[i].berth = block->berth;
+        layout->blocks[i].berthDirection = block->berthDirection;
+        layout->blocks[i].blockName = block->blockName;
+    }
+
+    CRUST_IDENTIFIER numMembers = 0;
+    for(CRUST_IDENTIFIER i = 0; i < layout->numTrackCircuits; i++)
+    {
+        numMembers += state->trackCircuitIndex[i]->numBlocks;
+    }
+    layout->members = crust_snapshot_allocate(sizeof(CRUST_IDENTIFIER) * numMembers);
+
+    CRUST_IDENTIFIER memberPointer = 0;
+    for(CRUST_IDENTIFIER i = 0; i < layout->numTrackCircuits; i++)
+    {
+        CRUST_TRACK_CIRCUIT * trackCircuit = state->trackCircuitIndex[i];
+        layout->trackCircuits[i].blockBase = memberPointer;
+        layout->trackCircuits[i].numBlocks = trackCircuit->numBlocks;
+        for(CRUST_IDENTIFIER j = 0; j < trackCircuit->numBlocks; j++)
+        {
+            layout->members[memberPointer++] = trackCircuit->blocks[j]->blockId;
+        }
+    }
+
+    return layout;
+}
+
+CRUST_SNAPSHOT_RUNTIME * crust_snapshot_runtime_copy(CRUST_STATE * state)
+{
+    size_t bitsetLength = sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(state->trackCircuitIndexPointer);
+    size_t headcodesLength = (size_t)state->blockIndexPointer * CRUST_HEADCODE_LENGTH;
+
+    CRUST_SNAPSHOT_RUNTIME * runtime = crust_snapshot_allocate(sizeof(CRUST_SNAPSHOT_RUNTIME));
+    runtime->references = 1;
+    runtime->generation = state->generation;
+    runtime->trackCircuitOccupancy = crust_snapshot_allocate(bitsetLength);
+    runtime->trackCircuitKnown = crust_snapshot_allocate(bitsetLength);
+    runtime->headcodes = crust_snapshot_allocate(headcodesLength);
+    memcpy(runtime->trackCircuitOccupancy, state->trackCircuitOccupancy, bitsetLength);
+    memcpy(runtime->trackCircuitKnown, state->trackCircuitKnown, bitsetLength);
+    memcpy(runtime->headcodes, state->headcodes, headcodesLength);
+
+    return runtime;
+}
+
+// Must be called with the reference lock held
+void crust_snapshot_layout_unreference(CRUST_SNAPSHOT_LAYOUT * layout)
+{
+    if(--layout->references)
+    {
+        return;
+    }
+    free(layout->blocks);
+    free(layout->trackCircuits);
+    free(layout->members);
+    free(layout);
+}
+
+// Must be called with the reference lock held
+void crust_snapshot_runtime_unreference(CRUST_SNAPSHOT_RUNTIME * runtime)
+{
+    if(--runtime->references)
+    {
+        return;
+    }
+    free(runtime->trackCircuitOccupancy);
+    free(runtime->trackCircuitKnown);
+    free(runtime->headcodes);
+    free(runtime);
+}
+
+/*
+ * Fills snapshot with a copy of the state as it is now. Only the parts of the state that have changed since the last
+ * snapshot are copied. Must only be called from the thread that changes the state. The snapshot must be released with
+ * crust_snapshot_release() once it has been read.
+ */
+void crust_snapshot_take(CRUST_STATE * state, CRUST_SNAPSHOT * snapshot)
+{
+    CRUST_SNAPSHOT_LAYOUT * newLayout = NULL;
+    CRUST_SNAPSHOT_RUNTIME * newRuntime = NULL;
+
+    // The latest snapshot is only ever replaced by this thread so it can be checked and copied without the lock
+    if(state->snapshotLayout == NULL || state->snapshotLayout->layoutGeneration != state->layoutGeneration)
+    {
+        newLayout = crust_snapshot_layout_copy(state);
+    }
+    if(state->snapshotRuntime == NULL || state->snapshotRuntime->generation != state->generation)
+    {
+        newRuntime = crust_snapshot_runtime_copy(state);
+    }
+
+    pthread_mutex_lock(&state->snapshotReferenceLock);
+    if(newLayout != NULL)
+    {
+        if(state->snapshotLayout != NULL)
+        {
+            crust_snapshot_layout_unreference(state->snapshotLayout);
+        }
+        state->snapshotLayout = newLayout;
+    }
+    if(newRuntime != NULL)
+    {
+        if(state->snapshotRuntime != NULL)
+        {
+            crust_snapshot_runtime_unreference(state->snapshotRuntime);
+        }
+        state->snapshotRuntime = newRuntime;
+    }
+    state->snapshotLayout->references++;
+    state->snapshotRuntime->references++;
+    pthread_mutex_unlock(&state->snapshotReferenceLock);
+
+    snapshot->layout = state->snapshotLayout;
+    snapshot->runtime = state->snapshotRuntime;
+    snapshot->referenceLock = &state->snapshotReferenceLock;
+}
+
+/*
+ * Releases a snapshot taken with crust_snapshot_take(). May be called from any thread.
+ */
+void crust_snapshot_release(CRUST_SNAPSHOT * snapshot)
+{
+    pthread_mutex_lock(snapshot->referenceLock);
+    crust_snapshot_layout_unreference(snapshot->layout);
+    crust_snapshot_runtime_unreference(snapshot->runtime);
+    pthread_mutex_unlock(snapshot->referenceLock);
+    snapshot->layout = NULL;
+    snapshot->runtime = NULL;
+}
+
+void * crust_snapshot_printer_thread(void * argument)
+{
+    CRUST_SNAPSHOT_PRINTER * printer = argument;
+
+    crust_thread_block_stop_signals();
+
+    for(;;)
+    {
+        pthread_mutex_lock(&printer->jobLock);
+        while(printer->waitingHead == NULL)
+        {
+            pthread_cond_wait(&printer->jobReady, &printer->jobLock);
+        }
+        CRUST_SNAPSHOT_JOB * job = printer->waitingHead;
+        printer->waitingHead = job->next;
+        if(printer->waitingHead == NULL)
+        {
+            printer->waitingTail = NULL;
+        }
+        pthread_mutex_unlock(&printer->jobLock);
+
+        u_int64_t printStart = crust_metrics_nanoseconds();
+        crust_print_snapshot(&job->snapshot, &job->text);
+        job->printTime = crust_metrics_nanoseconds() - printStart;
+        crust_snapshot_release(&job->snapshot);
+        job->next = NULL;
+
+        pthread_mutex_lock(&printer->jobLock);
+        if(printer->doneTail == NULL)
+        {
+            printer->doneHead = job;
+        }
+        else
+        {
+            printer->doneTail->next = job;
+        }
+        printer->doneTail = job;
+        pthread_mutex_unlock(&printer->jobLock);
+
+        printer->notifyFunction();
+    }
+}
+
+/*
+ * Starts the thread that prints snapshots. notifyFunction is called on the printer thread whenever a job is done and
+ * should arrange for crust_snapshot_printer_collect() to be called on the requesting thread.
+ */
+void crust_snapshot_printer_start(CRUST_SNAPSHOT_PRINTER * printer, void (*notifyFunction)(void))
+{
+    printer->waitingHead = NULL;
+    printer->waitingTail = NULL;
+    printer->doneHead = NULL;
+    printer->doneTail = NULL;
+    printer->notifyFunction = notifyFunction;
+
+    if(pthread_mutex_init(&printer->jobLock, NULL)
+       || pthread_cond_init(&printer->jobReady, NULL)
+       || pthread_create(&printer->thread, NULL, crust_snapshot_printer_thread, printer)
+       || pthread_detach(printer->thread))
+    {
+        crust_terminal_print("Failed to start the snapshot printer.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Queues a job for the printer. Jobs are printed and handed back in the order they are submitted.
+ */
+void crust_snapshot_printer_submit(CRUST_SNAPSHOT_PRINTER * printer, CRUST_SNAPSHOT_JOB * job)
+{
+    job->text = NULL;
+    job->next = NULL;
+
+    pthread_mutex_lock(&printer->jobLock);
+    if(printer->waitingTail == NULL)
+    {
+        printer->waitingHead = job;
+    }
+    else
+    {
+        printer->waitingTail->next = job;
+    }
+    printer->waitingTail = job;
+    pthread_cond_signal(&printer->jobReady);
+    pthread_mutex_unlock(&printer->jobLock);
+}
+
+/*
+ * Returns the jobs the printer has finished since the last call as a list linked by next, in the order they were
+ * submitted, or NULL if there are none.
+ */
+CRUST_SNAPSHOT_JOB * crust_snapshot_printer_collect(CRUST_SNAPSHOT_PRINTER * printer)
+{
+    pthread_mutex_lock(&printer->jobLock);
+    CRUST_SNAPSHOT_JOB * jobs = printer->doneHead;
+    printer->doneHead = NULL;
+    printer->doneTail = NULL;
+    pthread_mutex_unlock(&printer->jobLock);
+
+    return jobs;
+}
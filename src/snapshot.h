@@ -0,0 +1,111 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_SNAPSHOT_H
+#define CRUST_SNAPSHOT_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "state.h"
+
+/*
+ * A snapshot is an immutable copy of the state as it was at one moment, which can be read on another thread while the
+ * daemon loop carries on changing the live state. It is made of two parts that are copied separately: the layout, which
+ * only changes when blocks, track circuits or berths are added, and the runtime state, which changes with every
+ * occupation and headcode. Each part is reference counted and reused by later snapshots until the state it copies
+ * changes, so taking a snapshot of a quiet state copies nothing at all.
+ */
+
+#define CRUST_SNAPSHOT_NO_LINK UINT32_MAX
+
+#define CRUST_SNAPSHOT struct crustSnapshot
+#define CRUST_SNAPSHOT_LAYOUT struct crustSnapshotLayout
+#define CRUST_SNAPSHOT_RUNTIME struct crustSnapshotRuntime
+#define CRUST_SNAPSHOT_BLOCK struct crustSnapshotBlock
+#define CRUST_SNAPSHOT_TRACK_CIRCUIT struct crustSnapshotTrackCircuit
+#define CRUST_SNAPSHOT_JOB struct crustSnapshotJob
+#define CRUST_SNAPSHOT_PRINTER struct crustSnapshotPrinter
+
+struct crustSnapshotBlock {
+    CRUST_IDENTIFIER links[CRUST_MAX_LINKS]; // CRUST_SNAPSHOT_NO_LINK where there is no link
+    bool berth;
+    CRUST_DIRECTION berthDirection;
+    const char * blockName; // Names never change once a block is inserted so they are shared with the live block
+};
+
+struct crustSnapshotTrackCircuit {
+    CRUST_IDENTIFIER blockBase; // Where the member block IDs start in the layout's member list
+    CRUST_IDENTIFIER numBlocks;
+};
+
+struct crustSnapshotLayout {
+    unsigned int references;
+    u_int64_t layoutGeneration;
+    CRUST_IDENTIFIER numBlocks;
+    CRUST_IDENTIFIER numTrackCircuits;
+    CRUST_SNAPSHOT_BLOCK * blocks;
+    CRUST_SNAPSHOT_TRACK_CIRCUIT * trackCircuits;
+    CRUST_IDENTIFIER * members;
+};
+
+struct crustSnapshotRuntime {
+    unsigned int references;
+    u_int64_t generation;
+    CRUST_BITSET_WORD * trackCircuitOccupancy;
+    CRUST_BITSET_WORD * trackCircuitKnown;
+    char * headcodes;
+};
+
+struct crustSnapshot {
+    CRUST_SNAPSHOT_LAYOUT * layout;
+    CRUST_SNAPSHOT_RUNTIME * runtime;
+    pthread_mutex_t * referenceLock; // The lock of the state the snapshot was taken from
+};
+
+/*
+ * A request to print a snapshot on the printer thread. The requester fills in the snapshot and owner, the printer
+ * fills in the text and hands the job back once it is done.
+ */
+struct crustSnapshotJob {
+    CRUST_SNAPSHOT snapshot;
+    void * owner;
+    char * text;
+    u_int64_t printTime; // Nanoseconds the printer spent on the text
+    CRUST_SNAPSHOT_JOB * next;
+};
+
+struct crustSnapshotPrinter {
+    pthread_t thread;
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobReady;
+    CRUST_SNAPSHOT_JOB * waitingHead;
+    CRUST_SNAPSHOT_JOB * waitingTail;
+    CRUST_SNAPSHOT_JOB * doneHead;
+    CRUST_SNAPSHOT_JOB * doneTail;
+    void (*notifyFunction)(void); // Called on the printer thread each time a job is done
+};
+
+void crust_snapshot_take(CRUST_STATE * state, CRUST_SNAPSHOT * snapshot);
+void crust_snapshot_release(CRUST_SNAPSHOT * snapshot);
+void crust_snapshot_printer_start(CRUST_SNAPSHOT_PRINTER * printer, void (*notifyFunction)(void));
+void crust_snapshot_printer_submit(CRUST_SNAPSHOT_PRINTER * printer, CRUST_SNAPSHOT_JOB * job);
+CRUST_SNAPSHOT_JOB * crust_snapshot_printer_collect(CRUST_SNAPSHOT_PRINTER * printer);
+
+#endif //CRUST_SNAPSHOT_H
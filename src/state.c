@@ -26,7 +26,15 @@
 #include "terminal.h"
 
 #define CRUST_INDEX_SIZE_INCREMENT 100
-#define CRUST_BLOCK_WALK_DEPTH_LIMIT 10
+#define CRUST_BLOCK_NAME_INDEX_INITIAL_LENGTH 256 // Must be a power of two
+#define CRUST_BLOCK_WALK struct crustBlockWalk
+
+// Where a walk from a berth has got to, kept on the caller's stack so that each state can be remapped independently.
+struct crustBlockWalk {
+    CRUST_BLOCK * path[CRUST_BLOCK_WALK_DEPTH_LIMIT];
+    CRUST_IDENTIFIER pathNodes[CRUST_BLOCK_WALK_DEPTH_LIMIT]; // The node recorded for each block in path
+    CRUST_IDENTIFIER recordedDepth; // How much of path already has nodes recorded
+};
 
 // Each type of link has an inversion. For example, if downMain of block A points to block B then upMain of block B must
 // point to block A.
@@ -41,7 +49,8 @@ void crust_index_regrow(void ** index, unsigned int * indexLength, const unsigne
 {
     if(*indexPointer >= *indexLength)
     {
-        *indexLength += CRUST_INDEX_SIZE_INCREMENT;
+        // Grow in proportion to the index so that building a large index takes linear time
+        *indexLength += *indexLength > CRUST_INDEX_SIZE_INCREMENT ? *indexLength / 2 : CRUST_INDEX_SIZE_INCREMENT;
         *index = realloc(*index, *indexLength * entrySize);
         if(*index == NULL)
         {
@@ -51,54 +60,150 @@ void crust_index_regrow(void ** index, unsigned int * indexLength, const unsigne
     }
 }
 
+// Notes that the runtime state of everything has changed, as when it is restored in one go.
+void crust_state_all_changed(CRUST_STATE * state)
+{
+    state->allChanged = true;
+}
+
+void crust_state_changes_clear(CRUST_STATE * state)
+{
+    state->numChangedTrackCircuits = 0;
+    state->numChangedBlocks = 0;
+    state->allChanged = false;
+}
+
+// Adds an ID to a list of changes, treating everything as changed once the list is full.
+void crust_state_change(CRUST_IDENTIFIER * changes, unsigned int * numChanges, CRUST_IDENTIFIER id, CRUST_STATE * state)
+{
+    // The same circuit or block often changes several times over, such as a headcode stepping into and out of a berth
+    if(state->allChanged || (*numChanges && changes[*numChanges - 1] == id))
+    {
+        return;
+    }
+    if(*numChanges == CRUST_STATE_CHANGE_LIMIT)
+    {
+        state->allChanged = true;
+        return;
+    }
+    changes[(*numChanges)++] = id;
+}
+
+void crust_state_track_circuit_changed(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
+{
+    crust_state_change(state->changedTrackCircuits, &state->numChangedTrackCircuits, trackCircuit->trackCircuitId, state);
+}
+
+void crust_state_block_changed(CRUST_BLOCK * block, CRUST_STATE * state)
+{
+    crust_state_change(state->changedBlocks, &state->numChangedBlocks, block->blockId, state);
+}
+
 /*
- * Adds a block to the block index, enabling CRUST to locate it by its block ID which is allocated at the same time.
- * All blocks that form part of the live layout must be in the index.
+ * Hashes a block name for the block name index (FNV-1a).
  */
-int crust_block_index_add(CRUST_BLOCK * block, CRUST_STATE * state)
+u_int32_t crust_block_name_hash(const char * blockName)
 {
-    bool generateName = false;
-    CRUST_IDENTIFIER potentialName;
-    if(block->blockName == NULL)
+    u_int32_t hash = 2166136261u;
+    for(; *blockName != '\0'; blockName++)
     {
-        generateName = true;
-        potentialName = state->blockIndexPointer;
-        asprintf(&block->blockName, "%i", potentialName);
+        hash ^= (unsigned char)*blockName;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    for(;;)
+/*
+ * Returns the slot in the block name index that holds the named block, or the empty slot where it would go.
+ */
+CRUST_BLOCK ** crust_block_name_index_slot(const char * blockName, CRUST_STATE * state)
+{
+    u_int32_t mask = state->blockNameIndexLength - 1;
+    u_int32_t slot = crust_block_name_hash(blockName) & mask;
+    while(state->blockNameIndex[slot] != NULL && strcmp(state->blockNameIndex[slot]->blockName, blockName))
     {
-        int i = 0;
-        while(i < state->blockIndexPointer)
+        slot = (slot + 1) & mask;
+    }
+    return &state->blockNameIndex[slot];
+}
+
+/*
+ * Adds a block to the block name index, doubling the index whenever it becomes half full.
+ */
+void crust_block_name_index_add(CRUST_BLOCK * block, CRUST_STATE * state)
+{
+    if((state->blockIndexPointer + 1) * 2 > state->blockNameIndexLength)
+    {
+        CRUST_BLOCK ** oldBlockNameIndex = state->blockNameIndex;
+        unsigned int oldBlockNameIndexLength = state->blockNameIndexLength;
+
+        state->blockNameIndexLength = oldBlockNameIndexLength ? oldBlockNameIndexLength * 2 : CRUST_BLOCK_NAME_INDEX_INITIAL_LENGTH;
+        state->blockNameIndex = calloc(state->blockNameIndexLength, sizeof(CRUST_BLOCK *));
+        if(state->blockNameIndex == NULL)
         {
-            if(!strcmp(block->blockName, state->blockIndex[i]->blockName))
+            crust_terminal_print("Failed to grow an index.");
+            exit(EXIT_FAILURE);
+        }
+
+        for(unsigned int i = 0; i < oldBlockNameIndexLength; i++)
+        {
+            if(oldBlockNameIndex[i] != NULL)
             {
-                if(generateName)
-                {
-                    potentialName++;
-                    asprintf(&block->blockName, "%i", potentialName);
-                    break;
-                }
-                else
-                {
-                    return 1;
-                }
+                *crust_block_name_index_slot(oldBlockNameIndex[i]->blockName, state) = oldBlockNameIndex[i];
             }
-            i++;
         }
-        if(i == state->blockIndexPointer)
+        free(oldBlockNameIndex);
+    }
+
+    *crust_block_name_index_slot(block->blockName, state) = block;
+}
+
+/*
+ * Adds a block to the block index, enabling CRUST to locate it by its block ID which is allocated at the same time.
+ * All blocks that form part of the live layout must be in the index.
+ */
+int crust_block_index_add(CRUST_BLOCK * block, CRUST_STATE * state)
+{
+    if(block->blockName == NULL)
+    {
+        // Use the block ID as the name, or the next free number after it
+        CRUST_IDENTIFIER potentialName = state->blockIndexPointer;
+        asprintf(&block->blockName, "%i", potentialName);
+        while(state->blockNameIndexLength && *crust_block_name_index_slot(block->blockName, state) != NULL)
         {
-            break;
+            free(block->blockName);
+            potentialName++;
+            asprintf(&block->blockName, "%i", potentialName);
         }
     }
+    else if(state->blockNameIndexLength && *crust_block_name_index_slot(block->blockName, state) != NULL)
+    {
+        return 1;
+    }
+
+    crust_block_name_index_add(block, state);
 
     // Resize the index if we are running out of space.
+    unsigned int oldIndexLength = state->blockIndexLength;
     crust_index_regrow((void **) &state->blockIndex, &state->blockIndexLength, &state->blockIndexPointer, sizeof(CRUST_BLOCK *));
+    if(state->blockIndexLength != oldIndexLength)
+    {
+        state->headcodes = realloc(state->headcodes, state->blockIndexLength * CRUST_HEADCODE_LENGTH);
+        if(state->headcodes == NULL)
+        {
+            crust_terminal_print("Failed to grow an index.");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Add the block to the index.
     state->blockIndex[state->blockIndexPointer] = block;
     block->blockId = state->blockIndexPointer;
+    memset(&state->headcodes[block->blockId * CRUST_HEADCODE_LENGTH], CRUST_EMPTY_BERTH_CHARACTER, CRUST_HEADCODE_LENGTH);
+    crust_state_block_changed(block, state);
     state->blockIndexPointer++;
+    state->generation++;
+    state->layoutGeneration++;
 
     return 0;
 }
@@ -119,50 +224,140 @@ void crust_block_init(CRUST_BLOCK ** block, CRUST_STATE * state)
     (*block)->trackCircuit = NULL;
     (*block)->blockName = NULL;
     (*block)->berth = false;
-
-    for(int i = 0; i < CRUST_HEADCODE_LENGTH; i++)
-    {
-        (*block)->headcode[i] = CRUST_EMPTY_BERTH_CHARACTER;
-    }
-
-    (*block)->headcode[CRUST_HEADCODE_LENGTH] = '\0';
-
     (*block)->berthDirection = CRUST_DEFAULT_DIRECTION;
 
     (*block)->rearBerths = NULL;
     (*block)->pathsToRearBerths = NULL;
     (*block)->numRearBerths = 0;
+    (*block)->pathNodeBase = 0;
+    (*block)->numPathNodes = 0;
 }
 
-void crust_path_init(CRUST_PATH ** path)
+/*
+ * Appends a node to the path node arena on behalf of a berth and returns the index of the node relative to the berth's
+ * pathNodeBase. Only the berth currently being mapped may add nodes so that each berth's nodes stay together.
+ */
+CRUST_IDENTIFIER crust_path_node_add(CRUST_BLOCK * block, CRUST_IDENTIFIER parent, CRUST_BLOCK * berth, CRUST_STATE * state)
 {
-    *path = malloc(sizeof(CRUST_PATH));
-    if(*path == NULL)
+    crust_index_regrow((void **) &state->pathNodes, &state->pathNodesLength, &state->pathNodesPointer, sizeof(CRUST_PATH_NODE));
+
+    state->pathNodes[state->pathNodesPointer].blockId = block->blockId;
+    state->pathNodes[state->pathNodesPointer].parent = parent;
+    state->pathNodesPointer++;
+    state->pathNodesInUse++;
+
+    return berth->numPathNodes++;
+}
+
+/*
+ * Moves the path nodes that are still in use to a fresh arena, dropping the ones left behind when berths were remapped.
+ * Node indexes are relative to each berth's pathNodeBase so only the bases need updating.
+ */
+void crust_path_nodes_compact(CRUST_STATE * state)
+{
+    unsigned int newLength = state->pathNodesInUse + CRUST_INDEX_SIZE_INCREMENT;
+    CRUST_PATH_NODE * newPathNodes = malloc(sizeof(CRUST_PATH_NODE) * newLength);
+    if(newPathNodes == NULL)
     {
         crust_terminal_print("Memory allocation error");
         exit(EXIT_FAILURE);
     }
-    (*path)->linkedBlocks = NULL;
-    (*path)->numLinkedBlocks = 0;
+
+    unsigned int newPointer = 0;
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        CRUST_BLOCK * block = state->blockIndex[i];
+        if(block->numPathNodes)
+        {
+            memcpy(&newPathNodes[newPointer], &state->pathNodes[block->pathNodeBase], sizeof(CRUST_PATH_NODE) * block->numPathNodes);
+            block->pathNodeBase = newPointer;
+            newPointer += block->numPathNodes;
+        }
+    }
+
+    free(state->pathNodes);
+    state->pathNodes = newPathNodes;
+    state->pathNodesLength = newLength;
+    state->pathNodesPointer = newPointer;
+}
+
+/*
+ * Reports the memory used to hold the paths between berths and fills numPaths with the number of paths held.
+ */
+size_t crust_state_path_memory(CRUST_STATE * state, CRUST_IDENTIFIER * numPaths)
+{
+    size_t memory = sizeof(CRUST_PATH_NODE) * state->pathNodesLength;
+    *numPaths = 0;
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        memory += (sizeof(CRUST_BLOCK *) + sizeof(CRUST_PATH)) * state->blockIndex[i]->numRearBerths;
+        *numPaths += state->blockIndex[i]->numRearBerths;
+    }
+    return memory;
 }
 
-void crust_path_destroy(CRUST_PATH * path)
+/*
+ * Grows a bitset from oldLength bits to newLength bits, clearing the new bits.
+ */
+void crust_bitset_regrow(CRUST_BITSET_WORD ** bitset, unsigned int oldLength, unsigned int newLength)
 {
-    if(path == NULL)
+    size_t oldWords = CRUST_BITSET_WORDS(oldLength);
+    size_t newWords = CRUST_BITSET_WORDS(newLength);
+    if(newWords == oldWords)
     {
         return;
     }
-    free(path->linkedBlocks);
-    free(path);
+
+    *bitset = realloc(*bitset, sizeof(CRUST_BITSET_WORD) * newWords);
+    if(*bitset == NULL)
+    {
+        crust_terminal_print("Memory allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memset(&(*bitset)[oldWords], 0, sizeof(CRUST_BITSET_WORD) * (newWords - oldWords));
+}
+
+void crust_bitset_set(CRUST_BITSET_WORD * bitset, CRUST_IDENTIFIER bit, bool value)
+{
+    if(value)
+    {
+        bitset[bit / CRUST_BITSET_WORD_BITS] |= (CRUST_BITSET_WORD)1 << (bit % CRUST_BITSET_WORD_BITS);
+    }
+    else
+    {
+        bitset[bit / CRUST_BITSET_WORD_BITS] &= ~((CRUST_BITSET_WORD)1 << (bit % CRUST_BITSET_WORD_BITS));
+    }
+}
+
+/*
+ * Adds length bytes of data to a 64-bit FNV-1a hash, which should start at CRUST_HASH_BASIS.
+ */
+u_int64_t crust_hash(u_int64_t hash, const void * data, size_t length)
+{
+    const unsigned char * byte = data;
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= byte[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
 }
 
 void crust_track_circuit_index_add(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
 {
+    unsigned int oldIndexLength = state->trackCircuitIndexLength;
     crust_index_regrow((void **) &state->trackCircuitIndex, &state->trackCircuitIndexLength, &state->trackCircuitIndexPointer, sizeof(CRUST_TRACK_CIRCUIT *));
+    crust_bitset_regrow(&state->trackCircuitOccupancy, oldIndexLength, state->trackCircuitIndexLength);
+    crust_bitset_regrow(&state->trackCircuitKnown, oldIndexLength, state->trackCircuitIndexLength);
 
     state->trackCircuitIndex[state->trackCircuitIndexPointer] = trackCircuit;
     trackCircuit->trackCircuitId = state->trackCircuitIndexPointer;
+    crust_bitset_set(state->trackCircuitOccupancy, trackCircuit->trackCircuitId, true); // Track circuits always start out occupied
+    crust_bitset_set(state->trackCircuitKnown, trackCircuit->trackCircuitId, false);
+    crust_state_track_circuit_changed(trackCircuit, state);
     state->trackCircuitIndexPointer++;
+    state->generation++;
+    state->layoutGeneration++;
 }
 
 void crust_track_circuit_init(CRUST_TRACK_CIRCUIT ** trackCircuit, CRUST_STATE * state)
@@ -170,7 +365,6 @@ void crust_track_circuit_init(CRUST_TRACK_CIRCUIT ** trackCircuit, CRUST_STATE *
     *trackCircuit = malloc(sizeof(CRUST_TRACK_CIRCUIT));
     (*trackCircuit)->blocks = NULL;
     (*trackCircuit)->numBlocks = 0;
-    (*trackCircuit)->occupied = true; // Track circuits always start out occupied
     (*trackCircuit)->upEdgeBlocks = NULL;
     (*trackCircuit)->numUpEdgeBlocks = 0;
     (*trackCircuit)->downEdgeBlocks = NULL;
@@ -178,20 +372,103 @@ void crust_track_circuit_init(CRUST_TRACK_CIRCUIT ** trackCircuit, CRUST_STATE *
     (*trackCircuit)->owningSession = NULL;
 }
 
+/*
+ * Checks the links of a block in a track circuit, recording whether any of its up or down links lead out of the circuit.
+ * Returns true if at least one link leads to another block in the circuit. Blocks in the circuit are recognised by
+ * their trackCircuit pointer so that no searching is needed.
+ */
+bool crust_track_circuit_block_edges(CRUST_BLOCK * block, CRUST_TRACK_CIRCUIT * trackCircuit, bool * upEdgeBlock, bool * downEdgeBlock)
+{
+    bool linkedToCircuit = false;
+    *upEdgeBlock = false;
+    *downEdgeBlock = false;
+
+    for(int link = 0; link < CRUST_MAX_LINKS; link++)
+    {
+        if(block->links[link] == NULL)
+        {
+            continue;
+        }
+
+        if(block->links[link]->trackCircuit == trackCircuit)
+        {
+            linkedToCircuit = true;
+        }
+        else if(link == upMain || link == upBranching)
+        {
+            *upEdgeBlock = true;
+        }
+        else
+        {
+            *downEdgeBlock = true;
+        }
+    }
+
+    return linkedToCircuit;
+}
+
+/*
+ * Finds the blocks on the up and down edges of a track circuit, replacing any edges found previously. Returns false if
+ * the circuit contains more than one block and any of them is not linked to another block in the circuit. The blocks
+ * in the circuit must already point to it.
+ */
+bool crust_track_circuit_find_edges(CRUST_TRACK_CIRCUIT * trackCircuit)
+{
+    bool upEdgeBlock, downEdgeBlock;
+    CRUST_IDENTIFIER numUpEdgeBlocks = 0;
+    CRUST_IDENTIFIER numDownEdgeBlocks = 0;
+
+    // Count the edges first so that the edge lists can be allocated in one go
+    for(CRUST_IDENTIFIER i = 0; i < trackCircuit->numBlocks; i++)
+    {
+        if(!crust_track_circuit_block_edges(trackCircuit->blocks[i], trackCircuit, &upEdgeBlock, &downEdgeBlock)
+           && trackCircuit->numBlocks != 1)
+        {
+            return false;
+        }
+        numUpEdgeBlocks += upEdgeBlock;
+        numDownEdgeBlocks += downEdgeBlock;
+    }
+
+    free(trackCircuit->upEdgeBlocks);
+    free(trackCircuit->downEdgeBlocks);
+    trackCircuit->upEdgeBlocks = malloc(sizeof(CRUST_BLOCK *) * numUpEdgeBlocks);
+    trackCircuit->downEdgeBlocks = malloc(sizeof(CRUST_BLOCK *) * numDownEdgeBlocks);
+    if((numUpEdgeBlocks && trackCircuit->upEdgeBlocks == NULL)
+       || (numDownEdgeBlocks && trackCircuit->downEdgeBlocks == NULL))
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    trackCircuit->numUpEdgeBlocks = 0;
+    trackCircuit->numDownEdgeBlocks = 0;
+
+    for(CRUST_IDENTIFIER i = 0; i < trackCircuit->numBlocks; i++)
+    {
+        crust_track_circuit_block_edges(trackCircuit->blocks[i], trackCircuit, &upEdgeBlock, &downEdgeBlock);
+        if(upEdgeBlock)
+        {
+            trackCircuit->upEdgeBlocks[trackCircuit->numUpEdgeBlocks++] = trackCircuit->blocks[i];
+        }
+        if(downEdgeBlock)
+        {
+            trackCircuit->downEdgeBlocks[trackCircuit->numDownEdgeBlocks++] = trackCircuit->blocks[i];
+        }
+    }
+
+    return true;
+}
+
 /*
  * Takes a CRUST block with one or more links set (up and down main and branching)
  * and attempts to insert them into the CRUST layout. Returns 0 on success or:
  * 1: The block could not be inserted because it's name was not unique
  * 2: The block could not be inserted because a link already exists to it's target
  * 3: The block could not be inserted because it contains no links
+ * Blocks may be inserted at any time. Track circuits and berth paths around the new block are updated to suit.
  * */
 int crust_block_insert(CRUST_BLOCK * block, CRUST_STATE * state)
 {
-    if(state->circuitsInserted)
-    {
-        return 4;
-    }
-
     unsigned int linkCount = 0;
     for(int i = 0; i < CRUST_MAX_LINKS; i++)
     {
@@ -223,6 +500,17 @@ int crust_block_insert(CRUST_BLOCK * block, CRUST_STATE * state)
         }
     }
 
+    // The blocks we have linked to may now be on the edge of their track circuits
+    for(int i = 0; i < CRUST_MAX_LINKS; i++)
+    {
+        if(block->links[i] != NULL && block->links[i]->trackCircuit != NULL)
+        {
+            crust_track_circuit_find_edges(block->links[i]->trackCircuit);
+        }
+    }
+
+    crust_remap_berths_around(block, state);
+
     return 0;
 }
 
@@ -248,81 +536,25 @@ int crust_track_circuit_insert(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE *
         }
     }
 
-    // Check that the referenced blocks are all connected together and find the
-    // edge blocks
-    for(u_int32_t blockInCircuit = 0; blockInCircuit < trackCircuit->numBlocks; blockInCircuit++)
+    // Point the referenced blocks at the new track circuit, this also marks them as members for finding the edges
+    for(u_int32_t i = 0; i < trackCircuit->numBlocks; i++)
     {
-        bool linkedToCircuit = false;
-        bool upEdgeBlock = false;
-        bool downEdgeBlock = false;
-        for(int link = 0; link < CRUST_MAX_LINKS; link++)
-        {
-            if(trackCircuit->blocks[blockInCircuit]->links[link] != NULL)
-            {
-                bool linkMatchFound = false;
-                for(u_int32_t otherBlockInCircuit = 0; otherBlockInCircuit < trackCircuit->numBlocks; otherBlockInCircuit++)
-                {
-                    if(trackCircuit->blocks[blockInCircuit]->links[link] == trackCircuit->blocks[otherBlockInCircuit])
-                    {
-                        linkedToCircuit = true;
-                        linkMatchFound = true;
-                    }
-                }
-                if(!linkMatchFound)
-                {
-                    if(!upEdgeBlock
-                    && (link == upMain
-                            || link == upBranching))
-                    {
-                        (trackCircuit->numUpEdgeBlocks)++;
-                        trackCircuit->upEdgeBlocks = realloc(trackCircuit->upEdgeBlocks, sizeof(CRUST_BLOCK *) * trackCircuit->numUpEdgeBlocks);
-                        if(trackCircuit->upEdgeBlocks == NULL)
-                        {
-                            crust_terminal_print("Memory allocation error.");
-                            exit(EXIT_FAILURE);
-                        }
-                        trackCircuit->upEdgeBlocks[trackCircuit->numUpEdgeBlocks - 1] = trackCircuit->blocks[blockInCircuit];
-                        upEdgeBlock = true;
-                    }
-                    else if(!downEdgeBlock
-                    && (link == downMain
-                            || link == downBranching))
-                    {
-                        (trackCircuit->numDownEdgeBlocks)++;
-                        trackCircuit->downEdgeBlocks = realloc(trackCircuit->downEdgeBlocks, sizeof(CRUST_BLOCK *) * trackCircuit->numDownEdgeBlocks);
-                        if(trackCircuit->downEdgeBlocks == NULL)
-                        {
-                            crust_terminal_print("Memory allocation error.");
-                            exit(EXIT_FAILURE);
-                        }
-                        trackCircuit->downEdgeBlocks[trackCircuit->numDownEdgeBlocks - 1] = trackCircuit->blocks[blockInCircuit];
-                        downEdgeBlock = true;
-                    }
-                }
-            }
-        }
-        if(trackCircuit->numBlocks != 1 && !linkedToCircuit)
-        {
-            free(trackCircuit->upEdgeBlocks);
-            trackCircuit->upEdgeBlocks = NULL;
-            trackCircuit->numUpEdgeBlocks = 0;
-            free(trackCircuit->downEdgeBlocks);
-            trackCircuit->downEdgeBlocks = NULL;
-            trackCircuit->numDownEdgeBlocks = 0;
-            return 3;
-        }
+        trackCircuit->blocks[i]->trackCircuit = trackCircuit;
     }
 
-    // Update the referenced blocks with the new track circuit
-    for(u_int32_t i = 0; i < trackCircuit->numBlocks; i++)
+    // Check that the referenced blocks are all connected together and find the edge blocks
+    if(!crust_track_circuit_find_edges(trackCircuit))
     {
-        trackCircuit->blocks[i]->trackCircuit = trackCircuit;
+        for(u_int32_t i = 0; i < trackCircuit->numBlocks; i++)
+        {
+            trackCircuit->blocks[i]->trackCircuit = NULL;
+        }
+        return 3;
     }
     // Add the track circuit to the index
     crust_track_circuit_index_add(trackCircuit, state);
 
-    // Record that we have started inserting circuits
-    state->circuitsInserted = true;
+    crust_recompile_berths_through(trackCircuit, state);
 
     return 0;
 }
@@ -340,9 +572,34 @@ void crust_state_init(CRUST_STATE ** state)
     (*state)->trackCircuitIndex = NULL;
     (*state)->trackCircuitIndexLength = 0;
     (*state)->trackCircuitIndexPointer = 0;
+    (*state)->pathNodes = NULL;
+    (*state)->pathNodesLength = 0;
+    (*state)->pathNodesPointer = 0;
+    (*state)->pathNodesInUse = 0;
+    (*state)->pathCircuits = NULL;
+    (*state)->pathCircuitsLength = 0;
+    (*state)->pathCircuitsPointer = 0;
+    (*state)->pathCircuitsInUse = 0;
+    (*state)->pathCircuitsStale = false;
+    (*state)->trackCircuitOccupancy = NULL;
+    (*state)->trackCircuitKnown = NULL;
+    (*state)->headcodes = NULL;
+    (*state)->generation = 0;
+    (*state)->layoutGeneration = 0;
+    (*state)->blockNameIndex = NULL;
+    (*state)->blockNameIndexLength = 0;
+    (*state)->closedLayout = false;
+    (*state)->snapshotLayout = NULL;
+    (*state)->snapshotRuntime = NULL;
+    crust_state_changes_clear(*state);
+    crust_state_all_changed(*state);
+    if(pthread_mutex_init(&(*state)->snapshotReferenceLock, NULL))
+    {
+        crust_terminal_print("Failed to create the snapshot lock.");
+        exit(EXIT_FAILURE);
+    }
     crust_block_init(&(*state)->initialBlock, *state);
     crust_block_index_add((*state)->initialBlock, *state);
-    (*state)->circuitsInserted = false;
 }
 
 /*
@@ -385,7 +642,10 @@ bool crust_track_circuit_set_occupation(CRUST_TRACK_CIRCUIT * trackCircuit,
     {
         trackCircuit->owningSession = requestingSession;
         requestingSession->ownsCircuits = true;
-        trackCircuit->occupied = occupied;
+        crust_bitset_set(state->trackCircuitKnown, trackCircuit->trackCircuitId, true);
+        crust_bitset_set(state->trackCircuitOccupancy, trackCircuit->trackCircuitId, occupied);
+        crust_state_track_circuit_changed(trackCircuit, state);
+        state->generation++;
         return true;
     }
     else if(trackCircuit->owningSession != requestingSession)
@@ -393,70 +653,187 @@ bool crust_track_circuit_set_occupation(CRUST_TRACK_CIRCUIT * trackCircuit,
         return false;
     }
 
-    if(trackCircuit->occupied == occupied)
+    if(crust_track_circuit_is_occupied(trackCircuit, state) == occupied)
     {
         return false;
     }
 
-    trackCircuit->occupied = occupied;
+    crust_bitset_set(state->trackCircuitOccupancy, trackCircuit->trackCircuitId, occupied);
+    crust_state_track_circuit_changed(trackCircuit, state);
+    state->generation++;
     return true;
 }
 
-void crust_remap_berths_block_walk(CRUST_BLOCK * block,
-                                   CRUST_DIRECTION direction,
-                                   CRUST_IDENTIFIER * numBlocks,
-                                   CRUST_BLOCK *** foundBlocks,
-                                   CRUST_PATH *** pathsToFoundBlocks,
-                                   CRUST_IDENTIFIER depth)
+// Removes the owning session from a track circuit, leaving its occupation unknown until another session claims it.
+void crust_track_circuit_release(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
 {
-    static CRUST_BLOCK * path[CRUST_BLOCK_WALK_DEPTH_LIMIT];
-    path[depth] = block;
-    depth++;
+    trackCircuit->owningSession = NULL;
+    crust_bitset_set(state->trackCircuitKnown, trackCircuit->trackCircuitId, false);
+    crust_state_track_circuit_changed(trackCircuit, state);
+    state->generation++;
+}
+
+// Sets the occupation of a track circuit without an owning session, for restoring a state recorded earlier.
+void crust_track_circuit_restore(CRUST_TRACK_CIRCUIT * trackCircuit, bool occupied, bool known, CRUST_STATE * state)
+{
+    crust_bitset_set(state->trackCircuitOccupancy, trackCircuit->trackCircuitId, occupied);
+    crust_bitset_set(state->trackCircuitKnown, trackCircuit->trackCircuitId, known);
+    crust_state_track_circuit_changed(trackCircuit, state);
+    state->generation++;
+}
+
+bool crust_track_circuit_is_occupied(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
+{
+    return CRUST_BITSET_TEST(state->trackCircuitOccupancy, trackCircuit->trackCircuitId);
+}
+
+bool crust_track_circuit_is_known(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
+{
+    return CRUST_BITSET_TEST(state->trackCircuitKnown, trackCircuit->trackCircuitId);
+}
+
+// Returns the headcode held by a block. The headcode is CRUST_HEADCODE_LENGTH characters long and is not terminated.
+const char * crust_block_headcode(CRUST_BLOCK * block, CRUST_STATE * state)
+{
+    return &state->headcodes[block->blockId * CRUST_HEADCODE_LENGTH];
+}
+
+/*
+ * Reduces each of a berth's paths to the list of track circuits it passes through so that headcode auto advance can
+ * test the circuits against the occupancy bitset rather than walking the path block by block. The lists are added to
+ * the end of the state's path circuit list, replacing any the berth had before.
+ */
+void crust_compile_berth_path_circuits(CRUST_BLOCK * berth, CRUST_STATE * state)
+{
+    for(CRUST_IDENTIFIER j = 0; j < berth->numRearBerths; j++)
+    {
+        CRUST_PATH * path = &berth->pathsToRearBerths[j];
+        CRUST_TRACK_CIRCUIT * pathCircuits[CRUST_BLOCK_WALK_DEPTH_LIMIT];
+
+        // The nodes lead back from the rear berth so fill the list from the end
+        CRUST_IDENTIFIER node = path->lastNode;
+        for(CRUST_IDENTIFIER k = path->numLinkedBlocks; k-- > 0;)
+        {
+            pathCircuits[k] = state->blockIndex[state->pathNodes[berth->pathNodeBase + node].blockId]->trackCircuit;
+            node = state->pathNodes[berth->pathNodeBase + node].parent;
+        }
+
+        path->pathCircuitBase = state->pathCircuitsPointer;
+        path->numPathCircuits = 0;
+        for(CRUST_IDENTIFIER k = 0; k < path->numLinkedBlocks; k++)
+        {
+            if(pathCircuits[k] == NULL)
+            {
+                continue;
+            }
+
+            // Only the first block in each circuit matters
+            bool seen = false;
+            for(CRUST_IDENTIFIER l = 0; l < path->numPathCircuits; l++)
+            {
+                if(state->pathCircuits[path->pathCircuitBase + l].trackCircuitId == pathCircuits[k]->trackCircuitId)
+                {
+                    seen = true;
+                    break;
+                }
+            }
+            if(seen)
+            {
+                continue;
+            }
+
+            crust_index_regrow((void **) &state->pathCircuits, &state->pathCircuitsLength, &state->pathCircuitsPointer, sizeof(CRUST_PATH_CIRCUIT));
+            state->pathCircuits[state->pathCircuitsPointer].trackCircuitId = pathCircuits[k]->trackCircuitId;
+            state->pathCircuits[state->pathCircuitsPointer].position = k;
+            state->pathCircuitsPointer++;
+            path->numPathCircuits++;
+        }
+    }
+}
+
+/*
+ * Rebuilds the path circuit lists of every berth from scratch.
+ */
+void crust_compile_path_circuits(CRUST_STATE * state)
+{
+    state->pathCircuitsPointer = 0;
+
+    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    {
+        crust_compile_berth_path_circuits(state->blockIndex[i], state);
+    }
+
+    state->pathCircuitsInUse = state->pathCircuitsPointer;
+    state->pathCircuitsStale = false;
+}
 
+/*
+ * Walks away from a berth looking for the berths to its rear. The blocks on the way to each rear berth found are added
+ * to the berth's path tree, reusing the nodes already recorded for the part of the walk that got us here.
+ */
+void crust_remap_berths_block_walk(CRUST_BLOCK * berth,
+                                   CRUST_BLOCK * block,
+                                   CRUST_DIRECTION direction,
+                                   CRUST_IDENTIFIER depth,
+                                   CRUST_BLOCK_WALK * walk,
+                                   CRUST_STATE * state)
+{
     // If we've hit the depth limit do nothing and return
-    if(depth > CRUST_BLOCK_WALK_DEPTH_LIMIT)
+    if(depth >= CRUST_BLOCK_WALK_DEPTH_LIMIT)
     {
         return;
     }
 
+    walk->path[depth] = block;
+
+    // Anything recorded beyond this point belongs to a branch we have already walked back out of
+    if(!depth || walk->recordedDepth > depth)
+    {
+        walk->recordedDepth = depth;
+    }
+
+    depth++;
+
     // If the block is a berth and we are not at the starting block then add it to the list and return
     if(depth > 1 && block->berth && block->berthDirection == direction)
     {
         // Check that the block is not already recorded (if there is a loop this will happen)
-        for(CRUST_IDENTIFIER i = 0; i < *numBlocks; i++)
+        for(CRUST_IDENTIFIER i = 0; i < berth->numRearBerths; i++)
         {
-            if((*foundBlocks)[i] == block)
+            if(berth->rearBerths[i] == block)
             {
                 return;
             }
         }
-        (*numBlocks)++;
-        *foundBlocks = realloc(*foundBlocks, sizeof(CRUST_BLOCK *) * *numBlocks);
-        if(*foundBlocks == NULL)
+        berth->numRearBerths++;
+        berth->rearBerths = realloc(berth->rearBerths, sizeof(CRUST_BLOCK *) * berth->numRearBerths);
+        if(berth->rearBerths == NULL)
         {
             crust_terminal_print("Memory allocation error");
             exit(EXIT_FAILURE);
         }
-        (*foundBlocks)[(*numBlocks) - 1] = block;
+        berth->rearBerths[berth->numRearBerths - 1] = block;
 
-        *pathsToFoundBlocks = realloc(*pathsToFoundBlocks, sizeof(CRUST_PATH *) * *numBlocks);
-        if(*pathsToFoundBlocks == NULL)
-        {
-            crust_terminal_print("Memory allocation error");
-            exit(EXIT_FAILURE);
-        }
-        crust_path_init(&(*pathsToFoundBlocks)[(*numBlocks) - 1]);
-        (*pathsToFoundBlocks)[(*numBlocks) - 1]->numLinkedBlocks = depth;
-        (*pathsToFoundBlocks)[(*numBlocks) - 1]->linkedBlocks = malloc(sizeof(CRUST_BLOCK *) * depth);
-        if((*pathsToFoundBlocks)[(*numBlocks) - 1]->linkedBlocks == NULL)
+        berth->pathsToRearBerths = realloc(berth->pathsToRearBerths, sizeof(CRUST_PATH) * berth->numRearBerths);
+        if(berth->pathsToRearBerths == NULL)
         {
             crust_terminal_print("Memory allocation error");
             exit(EXIT_FAILURE);
         }
-        for(CRUST_IDENTIFIER i = 0; i < depth; i++)
+
+        for(CRUST_IDENTIFIER i = walk->recordedDepth; i < depth; i++)
         {
-            (*pathsToFoundBlocks)[(*numBlocks) - 1]->linkedBlocks[i] = path[i];
+            walk->pathNodes[i] = crust_path_node_add(walk->path[i],
+                                                     i ? walk->pathNodes[i - 1] : CRUST_PATH_NO_PARENT,
+                                                     berth,
+                                                     state);
         }
+        walk->recordedDepth = depth;
+
+        berth->pathsToRearBerths[berth->numRearBerths - 1].lastNode = walk->pathNodes[depth - 1];
+        berth->pathsToRearBerths[berth->numRearBerths - 1].numLinkedBlocks = depth;
+        berth->pathsToRearBerths[berth->numRearBerths - 1].pathCircuitBase = 0;
+        berth->pathsToRearBerths[berth->numRearBerths - 1].numPathCircuits = 0;
         return;
     }
 
@@ -466,47 +843,219 @@ void crust_remap_berths_block_walk(CRUST_BLOCK * block,
         case DOWN:
             if(block->links[upMain] != NULL)
             {
-                crust_remap_berths_block_walk(block->links[upMain], direction, numBlocks, foundBlocks, pathsToFoundBlocks, depth);
+                crust_remap_berths_block_walk(berth, block->links[upMain], direction, depth, walk, state);
             }
             if(block->links[upBranching] != NULL)
             {
-                crust_remap_berths_block_walk(block->links[upBranching], direction, numBlocks, foundBlocks, pathsToFoundBlocks, depth);
+                crust_remap_berths_block_walk(berth, block->links[upBranching], direction, depth, walk, state);
             }
             return;
 
         case UP:
             if(block->links[downMain] != NULL)
             {
-                crust_remap_berths_block_walk(block->links[downMain], direction, numBlocks, foundBlocks, pathsToFoundBlocks, depth);
+                crust_remap_berths_block_walk(berth, block->links[downMain], direction, depth, walk, state);
             }
             if(block->links[downBranching] != NULL)
             {
-                crust_remap_berths_block_walk(block->links[downBranching], direction, numBlocks, foundBlocks, pathsToFoundBlocks, depth);
+                crust_remap_berths_block_walk(berth, block->links[downBranching], direction, depth, walk, state);
             }
             return;
     }
 }
 
-void crust_remap_berths(CRUST_DIRECTION direction, CRUST_STATE * state)
+/*
+ * Finds the berths that would pass through a block when searching for their rear berths, that is the berths facing
+ * direction that are in advance of the block and within reach of the block walk.
+ */
+void crust_find_berths_in_advance(CRUST_BLOCK * block,
+                                  CRUST_DIRECTION direction,
+                                  CRUST_IDENTIFIER depth,
+                                  CRUST_IDENTIFIER * numBerths,
+                                  CRUST_BLOCK *** foundBerths)
 {
-    for(CRUST_IDENTIFIER i = 0; i < state->blockIndexPointer; i++)
+    if(depth >= CRUST_BLOCK_WALK_DEPTH_LIMIT)
+    {
+        return;
+    }
+
+    // A berth stops the search for rear berths so nothing beyond it can reach the block
+    if(depth && block->berth && block->berthDirection == direction)
     {
-        if(state->blockIndex[i]->berth && state->blockIndex[i]->berthDirection == direction)
+        for(CRUST_IDENTIFIER i = 0; i < *numBerths; i++)
         {
-            free(state->blockIndex[i]->rearBerths);
-            for(CRUST_IDENTIFIER j = 0; j < state->blockIndex[i]->numRearBerths; j++)
+            if((*foundBerths)[i] == block)
             {
-                crust_path_destroy(state->blockIndex[i]->pathsToRearBerths[j]);
+                return;
             }
-            state->blockIndex[i]->rearBerths = NULL;
-            state->blockIndex[i]->numRearBerths = 0;
-            crust_remap_berths_block_walk(state->blockIndex[i],
-                                          direction,
-                                          &state->blockIndex[i]->numRearBerths,
-                                          &state->blockIndex[i]->rearBerths,
-                                          &state->blockIndex[i]->pathsToRearBerths,
-                                          0);
         }
+        (*numBerths)++;
+        *foundBerths = realloc(*foundBerths, sizeof(CRUST_BLOCK *) * *numBerths);
+        if(*foundBerths == NULL)
+        {
+            crust_terminal_print("Memory allocation error");
+            exit(EXIT_FAILURE);
+        }
+        (*foundBerths)[(*numBerths) - 1] = block;
+        return;
+    }
+
+    depth++;
+
+    // UP berths search DOWN for their rear berths so the UP berths that can reach us are found by searching UP
+    switch(direction)
+    {
+        case UP:
+            if(block->links[upMain] != NULL)
+            {
+                crust_find_berths_in_advance(block->links[upMain], direction, depth, numBerths, foundBerths);
+            }
+            if(block->links[upBranching] != NULL)
+            {
+                crust_find_berths_in_advance(block->links[upBranching], direction, depth, numBerths, foundBerths);
+            }
+            return;
+
+        case DOWN:
+            if(block->links[downMain] != NULL)
+            {
+                crust_find_berths_in_advance(block->links[downMain], direction, depth, numBerths, foundBerths);
+            }
+            if(block->links[downBranching] != NULL)
+            {
+                crust_find_berths_in_advance(block->links[downBranching], direction, depth, numBerths, foundBerths);
+            }
+            return;
+    }
+}
+
+/*
+ * Finds the rear berths of a single berth and the paths to them.
+ */
+void crust_remap_berth(CRUST_BLOCK * berth, CRUST_STATE * state)
+{
+    if(!state->pathCircuitsStale)
+    {
+        for(CRUST_IDENTIFIER i = 0; i < berth->numRearBerths; i++)
+        {
+            state->pathCircuitsInUse -= berth->pathsToRearBerths[i].numPathCircuits;
+        }
+    }
+
+    free(berth->rearBerths);
+    free(berth->pathsToRearBerths);
+    berth->rearBerths = NULL;
+    berth->pathsToRearBerths = NULL;
+    berth->numRearBerths = 0;
+    state->pathNodesInUse -= berth->numPathNodes;
+    berth->pathNodeBase = state->pathNodesPointer;
+    berth->numPathNodes = 0;
+    CRUST_BLOCK_WALK walk;
+    crust_remap_berths_block_walk(berth, berth, berth->berthDirection, 0, &walk, state);
+
+    // Compile the new paths straight away unless everything is due to be compiled anyway
+    if(!state->pathCircuitsStale)
+    {
+        unsigned int firstNewPathCircuit = state->pathCircuitsPointer;
+        crust_compile_berth_path_circuits(berth, state);
+        state->pathCircuitsInUse += state->pathCircuitsPointer - firstNewPathCircuit;
+    }
+}
+
+/*
+ * Remaps the berths whose paths may have changed because of a change to a block, that is the block itself if it is a
+ * berth and the berths that search through the block for their rear berths. The rest of the layout is left alone.
+ */
+void crust_remap_berths_around(CRUST_BLOCK * block, CRUST_STATE * state)
+{
+    CRUST_BLOCK ** berths = NULL;
+    CRUST_IDENTIFIER numBerths = 0;
+
+    crust_find_berths_in_advance(block, UP, 0, &numBerths, &berths);
+    crust_find_berths_in_advance(block, DOWN, 0, &numBerths, &berths);
+
+    if(block->berth)
+    {
+        crust_remap_berth(block, state);
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < numBerths; i++)
+    {
+        crust_remap_berth(berths[i], state);
+    }
+
+    free(berths);
+
+    // Tidy up the arenas once most of them are made up of paths that have been replaced
+    if(state->pathNodesPointer > (state->pathNodesInUse * 2) + CRUST_INDEX_SIZE_INCREMENT)
+    {
+        crust_path_nodes_compact(state);
+    }
+    if(!state->pathCircuitsStale
+       && state->pathCircuitsPointer > (state->pathCircuitsInUse * 2) + CRUST_INDEX_SIZE_INCREMENT)
+    {
+        crust_compile_path_circuits(state);
+    }
+}
+
+/*
+ * Compiles the path circuits again for the berths whose paths run through the blocks of a track circuit, as when the
+ * circuit has just been added. The paths themselves are unchanged so the berths are not remapped.
+ */
+void crust_recompile_berths_through(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state)
+{
+    CRUST_BLOCK ** berths = NULL;
+    CRUST_IDENTIFIER numBerths = 0;
+
+    // Everything is due to be compiled anyway
+    if(state->pathCircuitsStale)
+    {
+        return;
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < trackCircuit->numBlocks; i++)
+    {
+        crust_find_berths_in_advance(trackCircuit->blocks[i], UP, 0, &numBerths, &berths);
+        crust_find_berths_in_advance(trackCircuit->blocks[i], DOWN, 0, &numBerths, &berths);
+    }
+    // A berth's own block starts each of its paths
+    for(CRUST_IDENTIFIER i = 0; i < trackCircuit->numBlocks; i++)
+    {
+        CRUST_BLOCK * block = trackCircuit->blocks[i];
+        bool found = !block->berth;
+        for(CRUST_IDENTIFIER j = 0; j < numBerths && !found; j++)
+        {
+            found = berths[j] == block;
+        }
+        if(!found)
+        {
+            numBerths++;
+            berths = realloc(berths, sizeof(CRUST_BLOCK *) * numBerths);
+            if(berths == NULL)
+            {
+                crust_terminal_print("Memory allocation error");
+                exit(EXIT_FAILURE);
+            }
+            berths[numBerths - 1] = block;
+        }
+    }
+
+    for(CRUST_IDENTIFIER i = 0; i < numBerths; i++)
+    {
+        for(CRUST_IDENTIFIER j = 0; j < berths[i]->numRearBerths; j++)
+        {
+            state->pathCircuitsInUse -= berths[i]->pathsToRearBerths[j].numPathCircuits;
+        }
+        unsigned int firstNewPathCircuit = state->pathCircuitsPointer;
+        crust_compile_berth_path_circuits(berths[i], state);
+        state->pathCircuitsInUse += state->pathCircuitsPointer - firstNewPathCircuit;
+    }
+
+    free(berths);
+
+    if(state->pathCircuitsPointer > (state->pathCircuitsInUse * 2) + CRUST_INDEX_SIZE_INCREMENT)
+    {
+        crust_compile_path_circuits(state);
     }
 }
 
@@ -518,39 +1067,39 @@ bool crust_enable_berth(CRUST_BLOCK *block, CRUST_DIRECTION direction, CRUST_STA
     }
     block->berth = true;
     block->berthDirection = direction;
-    crust_remap_berths(direction, state);
+    crust_remap_berths_around(block, state);
+    state->generation++;
+    state->layoutGeneration++;
     return true;
 }
 
-bool crust_interpose(CRUST_BLOCK * block, const char * headcode)
+bool crust_interpose(CRUST_BLOCK * block, const char * headcode, CRUST_STATE * state)
 {
     if(!block->berth)
     {
         return false;
     }
 
-    for(int i = 0; i < CRUST_HEADCODE_LENGTH; i++)
-    {
-        block->headcode[i] = headcode[i];
-    }
-    block->headcode[CRUST_HEADCODE_LENGTH] = '\0';
+    memmove(&state->headcodes[block->blockId * CRUST_HEADCODE_LENGTH], headcode, CRUST_HEADCODE_LENGTH);
+    crust_state_block_changed(block, state);
+    state->generation++;
 
     return true;
 }
 
-bool crust_headcode_advance(CRUST_BLOCK * fromBlock, CRUST_BLOCK * toBlock)
+bool crust_headcode_advance(CRUST_BLOCK * fromBlock, CRUST_BLOCK * toBlock, CRUST_STATE * state)
 {
     if(!fromBlock->berth)
     {
         return false;
     }
 
-    if(!crust_interpose(toBlock, fromBlock->headcode))
+    if(!crust_interpose(toBlock, crust_block_headcode(fromBlock, state), state))
     {
         return false;
     }
 
-    return crust_interpose(fromBlock, CRUST_EMPTY_BERTH_HEADCODE);
+    return crust_interpose(fromBlock, CRUST_EMPTY_BERTH_HEADCODE, state);
 }
 
 size_t crust_headcode_auto_advance(CRUST_TRACK_CIRCUIT * occupiedTrackCircuit, CRUST_BLOCK *** affectedBlocks, CRUST_STATE * state)
@@ -559,41 +1108,45 @@ size_t crust_headcode_auto_advance(CRUST_TRACK_CIRCUIT * occupiedTrackCircuit, C
     CRUST_BLOCK * advancedBlock = NULL;
     CRUST_IDENTIFIER shortestPathFound = UINT32_MAX;
 
+    if(state->pathCircuitsStale)
+    {
+        crust_compile_path_circuits(state);
+    }
+
     // Go through the berths in the occupied circuit
     for(int i = 0; i < occupiedTrackCircuit->numBlocks; i++)
     {
         // Focus on the empty berths
-        if(occupiedTrackCircuit->blocks[i]->berth && occupiedTrackCircuit->blocks[i]->headcode[0] == CRUST_EMPTY_BERTH_CHARACTER)
+        if(occupiedTrackCircuit->blocks[i]->berth
+        && crust_block_headcode(occupiedTrackCircuit->blocks[i], state)[0] == CRUST_EMPTY_BERTH_CHARACTER)
         {
             // Go through the berths in the rear of the empty berth (the berth in 'advance')
             for(int j = 0; j < occupiedTrackCircuit->blocks[i]->numRearBerths; j++)
             {
                 // If there is a headcode on the berth that is movable
-                if(occupiedTrackCircuit->blocks[i]->rearBerths[j]->headcode[0] != CRUST_EMPTY_BERTH_CHARACTER
-                && occupiedTrackCircuit->blocks[i]->rearBerths[j]->headcode[0] != CRUST_STATIC_BERTH_CHARACTER)
+                const char * rearHeadcode = crust_block_headcode(occupiedTrackCircuit->blocks[i]->rearBerths[j], state);
+                if(rearHeadcode[0] != CRUST_EMPTY_BERTH_CHARACTER
+                && rearHeadcode[0] != CRUST_STATIC_BERTH_CHARACTER)
                 {
                     // Find the first occupied circuit in the path that isn't the newly occupied circuit
-                    for(int k = 0; k < occupiedTrackCircuit->blocks[i]->pathsToRearBerths[j]->numLinkedBlocks; k++)
+                    CRUST_PATH * path = &occupiedTrackCircuit->blocks[i]->pathsToRearBerths[j];
+                    for(CRUST_IDENTIFIER k = 0; k < path->numPathCircuits; k++)
                     {
-                        // Skip blocks that are not in a circuit
-                        if(occupiedTrackCircuit->blocks[i]->pathsToRearBerths[j]->linkedBlocks[k]->trackCircuit == NULL)
-                        {
-                            continue;
-                        }
-
-                        if(occupiedTrackCircuit->blocks[i]->pathsToRearBerths[j]->linkedBlocks[k]->trackCircuit->occupied
-                        && occupiedTrackCircuit->blocks[i]->pathsToRearBerths[j]->linkedBlocks[k]->trackCircuit != occupiedTrackCircuit)
+                        CRUST_PATH_CIRCUIT * pathCircuit = &state->pathCircuits[path->pathCircuitBase + k];
+                        if(CRUST_BITSET_TEST(state->trackCircuitOccupancy, pathCircuit->trackCircuitId)
+                        && pathCircuit->trackCircuitId != occupiedTrackCircuit->trackCircuitId)
                         {
                             // If this path is shorter than the last one found then set it as the one we will use
-                            if(shortestPathFound < k)
+                            if(shortestPathFound < pathCircuit->position)
                             {
-                                shortestPathFound = k;
+                                shortestPathFound = pathCircuit->position;
                                 rearBlock = occupiedTrackCircuit->blocks[i]->rearBerths[j];
                                 advancedBlock = occupiedTrackCircuit->blocks[i];
                                 break;
                             }
                             // If this path is the same length as the last one but the origin berth is now unoccupied then also set it
-                            else if(shortestPathFound == k && !occupiedTrackCircuit->blocks[i]->rearBerths[j]->trackCircuit->occupied)
+                            else if(shortestPathFound == pathCircuit->position
+                                    && !CRUST_BITSET_TEST(state->trackCircuitOccupancy, occupiedTrackCircuit->blocks[i]->rearBerths[j]->trackCircuit->trackCircuitId))
                             {
                                 rearBlock = occupiedTrackCircuit->blocks[i]->rearBerths[j];
                                 advancedBlock = occupiedTrackCircuit->blocks[i];
@@ -605,7 +1158,8 @@ size_t crust_headcode_auto_advance(CRUST_TRACK_CIRCUIT * occupiedTrackCircuit, C
                     // If this is the first headcode we have found then take it anyway, regardless of path length
                     // Also take it if we have a headcode with no path length but this one is in an unoccupied circuit
                     if(advancedBlock == NULL
-                    || (shortestPathFound == UINT32_MAX && !occupiedTrackCircuit->blocks[i]->rearBerths[j]->trackCircuit->occupied))
+                    || (shortestPathFound == UINT32_MAX
+                        && !CRUST_BITSET_TEST(state->trackCircuitOccupancy, occupiedTrackCircuit->blocks[i]->rearBerths[j]->trackCircuit->trackCircuitId)))
                     {
                         rearBlock = occupiedTrackCircuit->blocks[i]->rearBerths[j];
                         advancedBlock = occupiedTrackCircuit->blocks[i];
@@ -618,7 +1172,7 @@ size_t crust_headcode_auto_advance(CRUST_TRACK_CIRCUIT * occupiedTrackCircuit, C
     // If we've found an advancement to make then action it and output the blocks that have changed
     if(advancedBlock != NULL)
     {
-        crust_headcode_advance(rearBlock, advancedBlock);
+        crust_headcode_advance(rearBlock, advancedBlock, state);
 
         *affectedBlocks = malloc(sizeof(CRUST_BLOCK *) * 2);
         (*affectedBlocks)[0] = rearBlock;
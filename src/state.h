@@ -22,7 +22,9 @@
 #define CRUST_STATE_H
 
 #include <stdbool.h>
-#include "daemon.h"
+#include <stdint.h>
+#include <pthread.h>
+#include "session.h"
 
 #define CRUST_BLOCK struct crustBlock
 #define CRUST_TRACK_CIRCUIT struct crustTrackCircuit
@@ -32,6 +34,12 @@
 #define CRUST_INTERPOSE_INSTRUCTION struct crustInterposeInstruction
 #define CRUST_BERTH_STEP_INSTRUCTION struct crustBerthStepInstruction
 #define CRUST_PATH struct crustPath
+#define CRUST_PATH_NODE struct crustPathNode
+#define CRUST_PATH_CIRCUIT struct crustPathCircuit
+#define CRUST_BITSET_WORD u_int64_t
+#define CRUST_BITSET_WORD_BITS 64
+#define CRUST_BITSET_WORDS(bits) (((bits) + CRUST_BITSET_WORD_BITS - 1) / CRUST_BITSET_WORD_BITS)
+#define CRUST_BITSET_TEST(bitset, bit) (((bitset)[(bit) / CRUST_BITSET_WORD_BITS] >> ((bit) % CRUST_BITSET_WORD_BITS)) & 1)
 #define CRUST_IDENTIFIER u_int32_t
 #define CRUST_MAX_LINKS 4
 #define CRUST_HEADCODE_LENGTH 4
@@ -39,6 +47,10 @@
 #define CRUST_STATIC_BERTH_CHARACTER '*'
 #define CRUST_EMPTY_BERTH_HEADCODE "____"
 #define CRUST_DEFAULT_DIRECTION UP
+#define CRUST_PATH_NO_PARENT UINT32_MAX
+#define CRUST_BLOCK_WALK_DEPTH_LIMIT 10 // The most blocks a berth looks back through to find its rear berths
+#define CRUST_HASH_BASIS 14695981039346656037ull // FNV-1a, used to fingerprint layouts and check saved files
+#define CRUST_STATE_CHANGE_LIMIT 64 // Changed IDs remembered before the whole runtime state is treated as changed
 
 enum crustLinkType {
     upMain,
@@ -58,16 +70,38 @@ struct crustBlock {
     CRUST_BLOCK * links[CRUST_MAX_LINKS];
     CRUST_TRACK_CIRCUIT * trackCircuit;
     bool berth;
-    char headcode[CRUST_HEADCODE_LENGTH + 1]; // +1 for trailing null
     CRUST_DIRECTION berthDirection;
     CRUST_BLOCK ** rearBerths;
-    CRUST_PATH ** pathsToRearBerths;
+    CRUST_PATH * pathsToRearBerths;
     CRUST_IDENTIFIER numRearBerths;
+    CRUST_IDENTIFIER pathNodeBase; // Where this berth's path nodes start in the state's path node arena
+    CRUST_IDENTIFIER numPathNodes;
+};
+
+/*
+ * The paths from a berth to each of its rear berths are stored as a tree rooted at the berth. Each node records a block
+ * and the node before it, so paths that share a prefix share the nodes for that prefix. A berth's nodes are held
+ * together in the state's path node arena and node indexes are relative to the berth's pathNodeBase.
+ */
+struct crustPathNode {
+    CRUST_IDENTIFIER blockId;
+    CRUST_IDENTIFIER parent;
 };
 
 struct crustPath {
-    CRUST_BLOCK ** linkedBlocks;
+    CRUST_IDENTIFIER lastNode; // The node holding the rear berth, follow the parents back to reach the berth itself
     CRUST_IDENTIFIER numLinkedBlocks;
+    CRUST_IDENTIFIER pathCircuitBase; // Where this path's circuits start in the state's path circuit list
+    CRUST_IDENTIFIER numPathCircuits;
+};
+
+/*
+ * A path compiled down to the track circuits it passes through, in order from the berth and with each circuit listed
+ * only once. The position is the index in the path of the first block in the circuit.
+ */
+struct crustPathCircuit {
+    CRUST_IDENTIFIER trackCircuitId;
+    CRUST_IDENTIFIER position;
 };
 
 struct crustTrackCircuit {
@@ -78,7 +112,6 @@ struct crustTrackCircuit {
     CRUST_IDENTIFIER numUpEdgeBlocks;
     CRUST_BLOCK ** downEdgeBlocks;
     CRUST_IDENTIFIER numDownEdgeBlocks;
-    bool occupied;
     CRUST_SESSION * owningSession;
 };
 
@@ -87,10 +120,44 @@ struct crustState {
     CRUST_BLOCK ** blockIndex;
     unsigned int blockIndexLength;
     unsigned int blockIndexPointer;
+    CRUST_BLOCK ** blockNameIndex; // Open addressed hash table of blocks by name
+    unsigned int blockNameIndexLength;
     CRUST_TRACK_CIRCUIT ** trackCircuitIndex;
     unsigned int trackCircuitIndexLength;
     unsigned int trackCircuitIndexPointer;
-    bool circuitsInserted;
+    CRUST_PATH_NODE * pathNodes;
+    unsigned int pathNodesLength;
+    unsigned int pathNodesPointer;
+    unsigned int pathNodesInUse; // Nodes still referenced by a berth, the rest are waiting to be compacted away
+    CRUST_PATH_CIRCUIT * pathCircuits;
+    unsigned int pathCircuitsLength;
+    unsigned int pathCircuitsPointer;
+    unsigned int pathCircuitsInUse; // Entries still referenced by a path, the rest are dropped on the next compile
+    bool pathCircuitsStale; // Paths or circuits have changed since the path circuits were compiled
+    /*
+     * The runtime state of the layout is held here as arrays indexed by ID rather than in the blocks and track
+     * circuits themselves, so that it can be scanned and copied a word at a time. Use the accessor functions below
+     * rather than reaching into these directly.
+     */
+    CRUST_BITSET_WORD * trackCircuitOccupancy; // One bit per track circuit ID, set when the circuit is occupied
+    CRUST_BITSET_WORD * trackCircuitKnown; // One bit per track circuit ID, set when a session owns the circuit
+    char * headcodes; // CRUST_HEADCODE_LENGTH characters per block ID with no terminators
+    u_int64_t generation; // Counts changes to the layout and runtime state so that copies can tell when they are stale
+    u_int64_t layoutGeneration; // Counts changes to the layout alone, every one of which also counts towards generation
+    bool closedLayout; // Blocks may only link to blocks that already exist, as when the daemon builds its layout
+    // The parts of the latest snapshot of this state, each holding a reference, for later snapshots to reuse
+    struct crustSnapshotLayout * snapshotLayout;
+    struct crustSnapshotRuntime * snapshotRuntime;
+    pthread_mutex_t snapshotReferenceLock; // Guards the reference counts of this state's snapshots
+    /*
+     * The track circuits and blocks whose runtime state has changed since crust_state_changes_clear(), for copies of
+     * the state that only take what has changed. Once either list is full the whole state is treated as changed.
+     */
+    CRUST_IDENTIFIER changedTrackCircuits[CRUST_STATE_CHANGE_LIMIT];
+    unsigned int numChangedTrackCircuits;
+    CRUST_IDENTIFIER changedBlocks[CRUST_STATE_CHANGE_LIMIT];
+    unsigned int numChangedBlocks;
+    bool allChanged;
 };
 
 struct crustInterposeInstruction {
@@ -103,20 +170,37 @@ struct crustBerthStepInstruction {
     CRUST_IDENTIFIER destinationBlockID;
 };
 
+void crust_bitset_regrow(CRUST_BITSET_WORD ** bitset, unsigned int oldLength, unsigned int newLength);
+void crust_bitset_set(CRUST_BITSET_WORD * bitset, CRUST_IDENTIFIER bit, bool value);
+u_int64_t crust_hash(u_int64_t hash, const void * data, size_t length);
 void crust_state_init(CRUST_STATE ** state);
+void crust_state_all_changed(CRUST_STATE * state);
+void crust_state_changes_clear(CRUST_STATE * state);
 bool crust_block_get(unsigned int blockId, CRUST_BLOCK ** block, CRUST_STATE * state);
 bool crust_track_circuit_get(unsigned int trackCircuitId, CRUST_TRACK_CIRCUIT ** trackCircuit, CRUST_STATE * state);
 void crust_block_init(CRUST_BLOCK ** block, CRUST_STATE * state);
 void crust_track_circuit_init(CRUST_TRACK_CIRCUIT ** trackCircuit, CRUST_STATE * state);
+int crust_block_index_add(CRUST_BLOCK * block, CRUST_STATE * state);
+void crust_track_circuit_index_add(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
 int crust_block_insert(CRUST_BLOCK * block, CRUST_STATE * state);
 int crust_track_circuit_insert(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
+bool crust_track_circuit_find_edges(CRUST_TRACK_CIRCUIT * trackCircuit);
+void crust_remap_berths_around(CRUST_BLOCK * block, CRUST_STATE * state);
+void crust_recompile_berths_through(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
 bool crust_track_circuit_set_occupation(CRUST_TRACK_CIRCUIT * trackCircuit,
                                         bool occupied,
                                         CRUST_STATE * state,
                                         CRUST_SESSION * requestingSession);
+void crust_track_circuit_release(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
+void crust_track_circuit_restore(CRUST_TRACK_CIRCUIT * trackCircuit, bool occupied, bool known, CRUST_STATE * state);
+bool crust_track_circuit_is_occupied(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
+bool crust_track_circuit_is_known(CRUST_TRACK_CIRCUIT * trackCircuit, CRUST_STATE * state);
+const char * crust_block_headcode(CRUST_BLOCK * block, CRUST_STATE * state);
 bool crust_enable_berth(CRUST_BLOCK *block, CRUST_DIRECTION direction, CRUST_STATE * state);
-bool crust_interpose(CRUST_BLOCK * block, const char * headcode);
-bool crust_headcode_advance(CRUST_BLOCK * fromBlock, CRUST_BLOCK * toBlock);
+bool crust_interpose(CRUST_BLOCK * block, const char * headcode, CRUST_STATE * state);
+bool crust_headcode_advance(CRUST_BLOCK * fromBlock, CRUST_BLOCK * toBlock, CRUST_STATE * state);
+void crust_compile_path_circuits(CRUST_STATE * state);
+size_t crust_state_path_memory(CRUST_STATE * state, CRUST_IDENTIFIER * numPaths);
 size_t crust_headcode_auto_advance(CRUST_TRACK_CIRCUIT * occupiedTrackCircuit, CRUST_BLOCK *** affectedBlocks, CRUST_STATE * state);
 
 #endif //CRUST_STATE_H
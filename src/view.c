@@ -0,0 +1,347 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef MACOS
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "view.h"
+#include "terminal.h"
+
+// POSIX shared memory names begin with a slash
+void crust_view_name(char * viewName, const char * name)
+{
+    snprintf(viewName, NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+u_int32_t crust_view_field(const u_int32_t * field)
+{
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+void crust_view_wake(CRUST_VIEW * view)
+{
+#ifndef MACOS
+    syscall(SYS_futex, &view->header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// Makes room in the shared memory object for the layout in state. Call between the sequence being made odd and even.
+void crust_view_grow(CRUST_VIEW * view, CRUST_STATE * state)
+{
+    while(view->blockCapacity < state->blockIndexPointer)
+    {
+        view->blockCapacity *= 2;
+    }
+    while(view->trackCircuitCapacity < state->trackCircuitIndexPointer)
+    {
+        view->trackCircuitCapacity *= 2;
+    }
+
+    size_t bitsetSize = sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(view->trackCircuitCapacity);
+    size_t size = sizeof(CRUST_VIEW_HEADER) + bitsetSize * 2 + (size_t)view->blockCapacity * CRUST_HEADCODE_LENGTH;
+    if(size > UINT32_MAX || ftruncate(view->fd, (off_t)size) == -1)
+    {
+        crust_terminal_print("Failed to grow the shared memory view.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Readers keep their own mappings, which stay valid as the object only ever grows
+    CRUST_VIEW_HEADER * header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, view->fd, 0);
+    if(header == MAP_FAILED)
+    {
+        crust_terminal_print("Failed to map the shared memory view.");
+        exit(EXIT_FAILURE);
+    }
+    if(view->header != NULL)
+    {
+        munmap(view->header, view->size);
+    }
+    view->header = header;
+    view->size = size;
+
+    header->occupancyOffset = sizeof(CRUST_VIEW_HEADER);
+    header->knownOffset = header->occupancyOffset + bitsetSize;
+    header->headcodesOffset = header->knownOffset + bitsetSize;
+    header->size = (u_int32_t)size;
+}
+
+/*
+ * Copies the runtime state into the view and wakes the readers waiting for it to change. Only the bitset words and
+ * headcodes of the track circuits and blocks the state lists as changed are copied, unless it has lost track of them.
+ */
+void crust_view_write(CRUST_VIEW * view, CRUST_STATE * state)
+{
+    u_int32_t sequence = view->header->sequence;
+    __atomic_store_n(&view->header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if(state->blockIndexPointer > view->blockCapacity || state->trackCircuitIndexPointer > view->trackCircuitCapacity)
+    {
+        crust_view_grow(view, state);
+        crust_state_all_changed(state);
+    }
+
+    CRUST_VIEW_HEADER * header = view->header;
+    char * base = (char *)header;
+    CRUST_BITSET_WORD * occupancy = (CRUST_BITSET_WORD *)(base + header->occupancyOffset);
+    CRUST_BITSET_WORD * known = (CRUST_BITSET_WORD *)(base + header->knownOffset);
+    char * headcodes = base + header->headcodesOffset;
+    header->numBlocks = state->blockIndexPointer;
+    header->numTrackCircuits = state->trackCircuitIndexPointer;
+    header->generationLow = (u_int32_t)state->generation;
+    header->generationHigh = (u_int32_t)(state->generation >> 32);
+    if(state->allChanged)
+    {
+        if(state->trackCircuitIndexPointer)
+        {
+            size_t bitsetSize = sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS(state->trackCircuitIndexPointer);
+            memcpy(occupancy, state->trackCircuitOccupancy, bitsetSize);
+            memcpy(known, state->trackCircuitKnown, bitsetSize);
+        }
+        if(state->blockIndexPointer)
+        {
+            memcpy(headcodes, state->headcodes, (size_t)state->blockIndexPointer * CRUST_HEADCODE_LENGTH);
+        }
+    }
+    else
+    {
+        for(unsigned int i = 0; i < state->numChangedTrackCircuits; i++)
+        {
+            size_t word = state->changedTrackCircuits[i] / CRUST_BITSET_WORD_BITS;
+            occupancy[word] = state->trackCircuitOccupancy[word];
+            known[word] = state->trackCircuitKnown[word];
+        }
+        for(unsigned int i = 0; i < state->numChangedBlocks; i++)
+        {
+            size_t headcode = (size_t)state->changedBlocks[i] * CRUST_HEADCODE_LENGTH;
+            memcpy(headcodes + headcode, state->headcodes + headcode, CRUST_HEADCODE_LENGTH);
+        }
+    }
+    crust_state_changes_clear(state);
+
+    __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+    crust_view_wake(view);
+    view->generation = state->generation;
+    view->publishes++;
+}
+
+/*
+ * Creates the shared memory object called name and publishes state in it. An object of the same name left behind by
+ * an earlier daemon is replaced rather than reused, so its size and contents can be trusted.
+ */
+void crust_view_open(CRUST_VIEW * view, const char * name, CRUST_STATE * state)
+{
+    crust_view_name(view->name, name);
+    shm_unlink(view->name);
+    view->fd = shm_open(view->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(view->fd == -1)
+    {
+        crust_terminal_print("Failed to create the shared memory view.");
+        exit(EXIT_FAILURE);
+    }
+
+    view->header = NULL;
+    view->size = 0;
+    view->blockCapacity = CRUST_VIEW_MINIMUM_CAPACITY;
+    view->trackCircuitCapacity = CRUST_VIEW_MINIMUM_CAPACITY;
+    view->publishes = 0;
+    crust_view_grow(view, state);
+
+    memcpy(view->header->magic, CRUST_VIEW_MAGIC, CRUST_VIEW_MAGIC_LENGTH);
+    view->header->version = CRUST_VIEW_VERSION;
+    view->header->sequence = 0;
+    view->header->closed = 0;
+    crust_state_all_changed(state);
+    crust_view_write(view, state);
+}
+
+// Publishes state in the view if it has changed since it was last published.
+void crust_view_publish(CRUST_VIEW * view, CRUST_STATE * state)
+{
+    if(state->generation != view->generation)
+    {
+        crust_view_write(view, state);
+    }
+}
+
+// Marks the view closed for the readers still attached to it and removes its name.
+void crust_view_close(CRUST_VIEW * view)
+{
+    u_int32_t sequence = view->header->sequence;
+    __atomic_store_n(&view->header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    view->header->closed = 1;
+    __atomic_store_n(&view->header->sequence, sequence + 2, __ATOMIC_RELEASE);
+    crust_view_wake(view);
+
+    munmap(view->header, view->size);
+    close(view->fd);
+    shm_unlink(view->name);
+}
+
+/*
+ * Maps the view called name read only. Returns 0 on success or:
+ * 1: The view could not be opened
+ * 2: The object is not a view this version of CRUST can read
+ */
+int crust_view_attach(CRUST_VIEW_READER * reader, const char * name)
+{
+    char viewName[NAME_MAX];
+    struct stat viewStat;
+
+    crust_view_name(viewName, name);
+    reader->fd = shm_open(viewName, O_RDONLY, 0);
+    if(reader->fd == -1)
+    {
+        return 1;
+    }
+    if(fstat(reader->fd, &viewStat) == -1 || (size_t)viewStat.st_size < sizeof(CRUST_VIEW_HEADER))
+    {
+        close(reader->fd);
+        return 2;
+    }
+    reader->size = (size_t)viewStat.st_size;
+    reader->header = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if(reader->header == MAP_FAILED)
+    {
+        close(reader->fd);
+        return 1;
+    }
+    if(memcmp(reader->header->magic, CRUST_VIEW_MAGIC, CRUST_VIEW_MAGIC_LENGTH) != 0
+       || reader->header->version != CRUST_VIEW_VERSION)
+    {
+        crust_view_detach(reader);
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * Starts a read of the view, returning the sequence to pass to crust_view_read_retry() once the read is done. Waits
+ * for the daemon to finish any write in progress, and maps more of the object if the layout has grown.
+ */
+u_int32_t crust_view_read_begin(CRUST_VIEW_READER * reader)
+{
+    for(;;)
+    {
+        u_int32_t sequence = __atomic_load_n(&reader->header->sequence, __ATOMIC_ACQUIRE);
+        if(sequence & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        size_t size = crust_view_field(&reader->header->size);
+        if(size > reader->size)
+        {
+            const CRUST_VIEW_HEADER * header = mmap(NULL, size, PROT_READ, MAP_SHARED, reader->fd, 0);
+            if(header == MAP_FAILED)
+            {
+                crust_terminal_print("Failed to map the shared memory view.");
+                exit(EXIT_FAILURE);
+            }
+            munmap((void *)reader->header, reader->size);
+            reader->header = header;
+            reader->size = size;
+            continue;
+        }
+        return sequence;
+    }
+}
+
+// Returns true if the daemon changed the view during the read begun with sequence, which must then be read again.
+bool crust_view_read_retry(CRUST_VIEW_READER * reader, u_int32_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&reader->header->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+/*
+ * The accessors below may be called between crust_view_read_begin() and crust_view_read_retry(). What they return
+ * is only meaningful if the read doesn't need retrying, but they never read outside the mapping whatever the daemon
+ * is doing.
+ */
+const char * crust_view_bitset(CRUST_VIEW_READER * reader, const u_int32_t * offset, CRUST_IDENTIFIER trackCircuitId)
+{
+    size_t bitsetOffset = crust_view_field(offset);
+    if(trackCircuitId >= crust_view_field(&reader->header->numTrackCircuits)
+       || bitsetOffset + sizeof(CRUST_BITSET_WORD) * CRUST_BITSET_WORDS((size_t)trackCircuitId + 1) > reader->size)
+    {
+        return NULL;
+    }
+    return (const char *)reader->header + bitsetOffset;
+}
+
+bool crust_view_track_circuit_is_occupied(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER trackCircuitId)
+{
+    const char * bitset = crust_view_bitset(reader, &reader->header->occupancyOffset, trackCircuitId);
+    return bitset != NULL && CRUST_BITSET_TEST((const CRUST_BITSET_WORD *)bitset, trackCircuitId);
+}
+
+bool crust_view_track_circuit_is_known(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER trackCircuitId)
+{
+    const char * bitset = crust_view_bitset(reader, &reader->header->knownOffset, trackCircuitId);
+    return bitset != NULL && CRUST_BITSET_TEST((const CRUST_BITSET_WORD *)bitset, trackCircuitId);
+}
+
+// Fills headcode, which must have room for CRUST_HEADCODE_LENGTH characters and a terminator. Empty if there is no block.
+void crust_view_block_headcode(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER blockId, char * headcode)
+{
+    size_t headcodeOffset = crust_view_field(&reader->header->headcodesOffset) + (size_t)blockId * CRUST_HEADCODE_LENGTH;
+    headcode[0] = '\0';
+    if(blockId < crust_view_field(&reader->header->numBlocks) && headcodeOffset + CRUST_HEADCODE_LENGTH <= reader->size)
+    {
+        memcpy(headcode, (const char *)reader->header + headcodeOffset, CRUST_HEADCODE_LENGTH);
+        headcode[CRUST_HEADCODE_LENGTH] = '\0';
+    }
+}
+
+/*
+ * Sleeps until the daemon has published a change since the read begun with sequence. Returns false if the view has
+ * been closed, in which case the reader should detach and attach to the view the next daemon creates.
+ */
+bool crust_view_wait(CRUST_VIEW_READER * reader, u_int32_t sequence)
+{
+    while(__atomic_load_n(&reader->header->sequence, __ATOMIC_ACQUIRE) == sequence
+          && !crust_view_field(&reader->header->closed))
+    {
+#ifdef MACOS
+        usleep(CRUST_VIEW_POLL_INTERVAL);
+#else
+        syscall(SYS_futex, &reader->header->sequence, FUTEX_WAIT, sequence, NULL, NULL, 0);
+#endif
+    }
+    return !crust_view_field(&reader->header->closed);
+}
+
+void crust_view_detach(CRUST_VIEW_READER * reader)
+{
+    munmap((void *)reader->header, reader->size);
+    close(reader->fd);
+}
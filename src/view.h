@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_VIEW_H
+#define CRUST_VIEW_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "state.h"
+
+/*
+ * A view is the runtime state of a layout published by the daemon in a POSIX shared memory object, so that programs
+ * on the same host can read the occupancy of each track circuit and the headcode in each block straight out of memory
+ * instead of listening on a socket and parsing every update.
+ *
+ * The daemon is the only writer. It bumps the header's sequence to an odd number before changing anything and to the
+ * next even number once it is done, so a reader copies what it needs between crust_view_read_begin() and
+ * crust_view_read_retry() and starts again if the sequence moved in between. On Linux the sequence is also a futex
+ * that the daemon wakes each time it publishes, which crust_view_wait() sleeps on.
+ */
+
+#define CRUST_VIEW_MAGIC "CRUSTVEW"
+#define CRUST_VIEW_MAGIC_LENGTH 8
+#define CRUST_VIEW_VERSION 1
+#define CRUST_VIEW_MINIMUM_CAPACITY 64 // Blocks and track circuits room is made for when a view is created
+#define CRUST_VIEW_POLL_INTERVAL 10000 // Microseconds between looks at the sequence where there is no futex to wait on
+
+#define CRUST_VIEW_HEADER struct crustViewHeader
+#define CRUST_VIEW struct crustView
+#define CRUST_VIEW_READER struct crustViewReader
+
+/*
+ * The start of the shared memory object. It is followed by the occupancy bitset, the known bitset and the headcodes,
+ * at the offsets given. The fields are 32 bits wide so that a reader on a 32 bit machine can't see half of one
+ * changed, and all of them apart from the magic and version may only be trusted once crust_view_read_retry() has
+ * returned false.
+ */
+struct crustViewHeader {
+    char magic[CRUST_VIEW_MAGIC_LENGTH];
+    u_int32_t version;
+    u_int32_t sequence; // Odd while the daemon is writing
+    u_int32_t closed; // Set when the daemon stops, after which the object is never written again
+    u_int32_t size; // Bytes in the object, which grows as the layout does
+    u_int32_t generationLow; // The state's generation as of the last publish
+    u_int32_t generationHigh;
+    u_int32_t numBlocks;
+    u_int32_t numTrackCircuits;
+    u_int32_t occupancyOffset;
+    u_int32_t knownOffset;
+    u_int32_t headcodesOffset; // CRUST_HEADCODE_LENGTH characters per block ID with no terminators
+};
+
+// The daemon's side of a view
+struct crustView {
+    char name[NAME_MAX];
+    int fd;
+    CRUST_VIEW_HEADER * header;
+    size_t size;
+    u_int32_t blockCapacity;
+    u_int32_t trackCircuitCapacity;
+    u_int64_t generation; // The state's generation as of the last publish
+    u_int64_t publishes;
+};
+
+// A reader's side of a view, mapped read only
+struct crustViewReader {
+    int fd;
+    const CRUST_VIEW_HEADER * header;
+    size_t size; // Bytes mapped, which may be fewer than are in the object once the layout grows
+};
+
+void crust_view_open(CRUST_VIEW * view, const char * name, CRUST_STATE * state);
+void crust_view_publish(CRUST_VIEW * view, CRUST_STATE * state);
+void crust_view_close(CRUST_VIEW * view);
+int crust_view_attach(CRUST_VIEW_READER * reader, const char * name);
+u_int32_t crust_view_read_begin(CRUST_VIEW_READER * reader);
+bool crust_view_read_retry(CRUST_VIEW_READER * reader, u_int32_t sequence);
+bool crust_view_track_circuit_is_occupied(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER trackCircuitId);
+bool crust_view_track_circuit_is_known(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER trackCircuitId);
+void crust_view_block_headcode(CRUST_VIEW_READER * reader, CRUST_IDENTIFIER blockId, char * headcode);
+bool crust_view_wait(CRUST_VIEW_READER * reader, u_int32_t sequence);
+void crust_view_detach(CRUST_VIEW_READER * reader);
+
+#endif //CRUST_VIEW_H
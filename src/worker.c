@@ -0,0 +1,692 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/uio.h>
+#ifdef IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "worker.h"
+#include "terminal.h"
+#include "thread.h"
+
+// Takes ownership of text, which must have been allocated with malloc. The caller holds the first reference.
+CRUST_WORKER_BUFFER * crust_worker_buffer_create(char * text, size_t length)
+{
+    CRUST_WORKER_BUFFER * buffer = malloc(sizeof(CRUST_WORKER_BUFFER));
+    if(buffer == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    buffer->text = text;
+    buffer->length = length;
+    buffer->references = 1;
+    return buffer;
+}
+
+// Buffers are shared between workers, so the count is changed atomically.
+void crust_worker_buffer_retain(CRUST_WORKER_BUFFER * buffer)
+{
+    __atomic_add_fetch(&buffer->references, 1, __ATOMIC_RELAXED);
+}
+
+void crust_worker_buffer_release(CRUST_WORKER_BUFFER * buffer)
+{
+    if(__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(buffer->text);
+        free(buffer);
+    }
+}
+
+// Drops the entry at the head of a channel's queue. Call with the worker locked.
+void crust_worker_channel_pop(CRUST_WORKER_CHANNEL * channel)
+{
+    CRUST_WORKER_QUEUE_ENTRY * entry = channel->head;
+    channel->head = entry->next;
+    if(channel->head == NULL)
+    {
+        channel->tail = NULL;
+    }
+    channel->queuedBytes -= entry->buffer->length - channel->headWritten;
+    channel->headWritten = 0;
+    crust_worker_buffer_release(entry->buffer);
+    free(entry);
+}
+
+// Throws away everything queued on a channel. Call with the worker locked.
+void crust_worker_channel_drop(CRUST_WORKER_CHANNEL * channel)
+{
+    while(channel->head != NULL)
+    {
+        crust_worker_channel_pop(channel);
+    }
+    channel->markedBytes = 0;
+}
+
+// Points iovecs at the unwritten part of the channel's queue. Returns how many were filled.
+int crust_worker_channel_gather(CRUST_WORKER_CHANNEL * channel, struct iovec * iovecs)
+{
+    int iovecCount = 0;
+    size_t offset = channel->headWritten;
+    for(CRUST_WORKER_QUEUE_ENTRY * entry = channel->head;
+        entry != NULL && iovecCount < CRUST_WORKER_MAX_IOVECS;
+        entry = entry->next)
+    {
+        iovecs[iovecCount].iov_base = entry->buffer->text + offset;
+        iovecs[iovecCount].iov_len = entry->buffer->length - offset;
+        iovecCount++;
+        offset = 0;
+    }
+    return iovecCount;
+}
+
+// Accounts for bytesWritten bytes from the head of the channel's queue having been written. Call with the worker locked.
+void crust_worker_channel_written(CRUST_WORKER * worker, CRUST_WORKER_CHANNEL * channel, size_t bytesWritten)
+{
+    worker->metrics.bytesWritten += bytesWritten;
+
+    if(channel->markedBytes > bytesWritten)
+    {
+        channel->markedBytes -= bytesWritten;
+    }
+    else if(channel->markedBytes)
+    {
+        channel->markedBytes = 0;
+        crust_histogram_record(&worker->metrics.markedWriteTime, crust_metrics_nanoseconds() - channel->markedAt);
+    }
+
+    while(channel->head != NULL && bytesWritten >= channel->head->buffer->length - channel->headWritten)
+    {
+        bytesWritten -= channel->head->buffer->length - channel->headWritten;
+        crust_worker_channel_pop(channel);
+    }
+    if(bytesWritten)
+    {
+        channel->headWritten += bytesWritten;
+        channel->queuedBytes -= bytesWritten;
+    }
+}
+
+/*
+ * Writes as much of a channel's queue as the socket will take. Call with the worker locked. If the socket fills up the
+ * channel is left blocked until poll says it has drained. If the client has gone the queue is thrown away; the daemon
+ * loop sees the hangup and closes the channel.
+ */
+void crust_worker_channel_flush(CRUST_WORKER * worker, CRUST_WORKER_CHANNEL * channel)
+{
+    struct iovec iovecs[CRUST_WORKER_MAX_IOVECS];
+
+    while(channel->head != NULL)
+    {
+        ssize_t bytesWritten = writev(channel->fd, iovecs, crust_worker_channel_gather(channel, iovecs));
+        worker->metrics.writes++;
+        if(bytesWritten == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                channel->blocked = true;
+                return;
+            }
+            crust_worker_channel_drop(channel);
+            return;
+        }
+        crust_worker_channel_written(worker, channel, (size_t)bytesWritten);
+    }
+}
+
+void * crust_worker_thread(void * argument)
+{
+    CRUST_WORKER * worker = argument;
+    struct pollfd * pollList = NULL;
+    CRUST_WORKER_CHANNEL ** polledChannels = NULL;
+    size_t pollListLength = 0;
+    char wakeBuffer[64];
+
+    crust_thread_block_stop_signals();
+
+    for(;;)
+    {
+        pthread_mutex_lock(&worker->lock);
+        worker->wakePending = false;
+
+        // Free the channels the daemon has finished with and write to the rest
+        size_t i = 0;
+        while(i < worker->channelCount)
+        {
+            CRUST_WORKER_CHANNEL * channel = worker->channels[i];
+            if(channel->closed)
+            {
+                crust_worker_channel_drop(channel);
+                free(channel);
+                worker->channels[i] = worker->channels[--worker->channelCount];
+                continue;
+            }
+            if(channel->head != NULL && !channel->blocked)
+            {
+                crust_worker_channel_flush(worker, channel);
+            }
+            if(channel->head == NULL && channel->watched)
+            {
+                channel->watched = false;
+                worker->drainedFunction();
+            }
+            i++;
+        }
+
+        // Wait for the wake pipe and for each full socket to drain
+        if(pollListLength < worker->channelCount + 1)
+        {
+            pollListLength = worker->channelCount + 1;
+            pollList = realloc(pollList, sizeof(struct pollfd) * pollListLength);
+            polledChannels = realloc(polledChannels, sizeof(CRUST_WORKER_CHANNEL *) * pollListLength);
+            if(pollList == NULL || polledChannels == NULL)
+            {
+                crust_terminal_print("Memory allocation error.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        nfds_t pollCount = 1;
+        pollList[0].fd = worker->wakeFDs[0];
+        pollList[0].events = POLLIN;
+        for(i = 0; i < worker->channelCount; i++)
+        {
+            if(worker->channels[i]->blocked)
+            {
+                pollList[pollCount].fd = worker->channels[i]->fd;
+                pollList[pollCount].events = POLLOUT;
+                polledChannels[pollCount] = worker->channels[i];
+                pollCount++;
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        if(poll(pollList, pollCount, -1) == -1 && errno != EINTR)
+        {
+            crust_terminal_print("Worker poll error.");
+            exit(EXIT_FAILURE);
+        }
+
+        if(pollList[0].revents & POLLIN)
+        {
+            while(read(worker->wakeFDs[0], wakeBuffer, sizeof(wakeBuffer)) > 0);
+        }
+
+        // Only this thread frees channels, so the polled ones are all still there
+        pthread_mutex_lock(&worker->lock);
+        for(nfds_t j = 1; j < pollCount; j++)
+        {
+            if(pollList[j].revents)
+            {
+                polledChannels[j]->blocked = false;
+            }
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+#ifdef IO_URING
+#define CRUST_WORKER_RING_ENTRIES 256
+#define CRUST_WORKER_RING_POLL 1 // Set in the user data of the poll linked ahead of a send to a blocked channel
+
+// Maps a new io_uring into the worker. Returns false, leaving the worker to use poll(), if the kernel can't provide one.
+bool crust_worker_ring_open(CRUST_WORKER_RING * ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, CRUST_WORKER_RING_ENTRIES, &params);
+    if(ring->fd == -1)
+    {
+        return false;
+    }
+    // Kernels without NODROP also lack some of the operations used here
+    if(!(params.features & IORING_FEAT_NODROP))
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        return false;
+    }
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP && ring->cqMapSize > ring->sqMapSize)
+    {
+        ring->sqMapSize = ring->cqMapSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    ring->cqMap = params.features & IORING_FEAT_SINGLE_MMAP
+            ? ring->sqMap
+            : mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                   IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if(ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        crust_terminal_print("Failed to map an io_uring.");
+        exit(EXIT_FAILURE);
+    }
+
+    char * sq = ring->sqMap;
+    char * cq = ring->cqMap;
+    ring->sqHead = (unsigned int *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned int *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->toSubmit = 0;
+    return true;
+}
+
+/*
+ * Submits the queued entries and, if wait is set, blocks until at least one has completed. Returns early on a signal
+ * or when the completion queue has overflowed, in which case the caller should reap it and try again.
+ */
+void crust_worker_ring_enter(CRUST_WORKER_RING * ring, bool wait)
+{
+    int result = (int)syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait ? 1 : 0,
+                              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(result == -1)
+    {
+        if(errno == EINTR || errno == EBUSY || errno == EAGAIN)
+        {
+            return;
+        }
+        crust_terminal_print("Worker io_uring error.");
+        exit(EXIT_FAILURE);
+    }
+    ring->toSubmit -= (unsigned int)result;
+}
+
+void crust_worker_ring_reap(CRUST_WORKER * worker);
+
+// Copies an entry into the submission queue, submitting what is already there first if it is full. Call with the worker locked.
+void crust_worker_ring_queue(CRUST_WORKER * worker, const struct io_uring_sqe * sqe)
+{
+    CRUST_WORKER_RING * ring = &worker->ring;
+    unsigned int tail = *ring->sqTail;
+    while(tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+    {
+        crust_worker_ring_enter(ring, false);
+        if(tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+        {
+            crust_worker_ring_reap(worker);
+        }
+    }
+    unsigned int index = tail & ring->sqMask;
+    ring->sqes[index] = *sqe;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+/*
+ * Queues a send of as much of the channel's queue as fits in its iovecs. A channel whose socket was full on the last
+ * send has a poll for it to drain linked ahead of the send, so the kernel waits rather than failing it again.
+ */
+void crust_worker_ring_send(CRUST_WORKER * worker, CRUST_WORKER_CHANNEL * channel)
+{
+    struct io_uring_sqe sqe;
+
+    if(channel->blocked)
+    {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.flags = IOSQE_IO_LINK;
+        sqe.fd = channel->fd;
+        sqe.poll32_events = POLLOUT;
+        sqe.user_data = (u_int64_t)(uintptr_t)channel | CRUST_WORKER_RING_POLL;
+        crust_worker_ring_queue(worker, &sqe);
+    }
+
+    memset(&channel->message, 0, sizeof(channel->message));
+    channel->message.msg_iov = channel->iovecs;
+    channel->message.msg_iovlen = (size_t)crust_worker_channel_gather(channel, channel->iovecs);
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = channel->fd;
+    sqe.addr = (u_int64_t)(uintptr_t)&channel->message;
+    sqe.len = 1;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = (u_int64_t)(uintptr_t)channel;
+    crust_worker_ring_queue(worker, &sqe);
+    channel->inFlight = true;
+}
+
+// Asks the kernel to stop the send in flight on a closed channel, along with any poll linked ahead of it.
+void crust_worker_ring_cancel(CRUST_WORKER * worker, CRUST_WORKER_CHANNEL * channel)
+{
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.user_data = 0; // Cancellations complete with user data 0 and are otherwise ignored
+    sqe.addr = (u_int64_t)(uintptr_t)channel | CRUST_WORKER_RING_POLL;
+    crust_worker_ring_queue(worker, &sqe);
+    sqe.addr = (u_int64_t)(uintptr_t)channel;
+    crust_worker_ring_queue(worker, &sqe);
+    channel->cancelled = true;
+}
+
+// Handles every completion waiting in the ring. Call with the worker locked.
+void crust_worker_ring_reap(CRUST_WORKER * worker)
+{
+    CRUST_WORKER_RING * ring = &worker->ring;
+    char wakeBuffer[64];
+    unsigned int head = *ring->cqHead;
+    unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe * cqe = &ring->cqes[head & ring->cqMask];
+        if(cqe->user_data == (u_int64_t)(uintptr_t)worker)
+        {
+            while(read(worker->wakeFDs[0], wakeBuffer, sizeof(wakeBuffer)) > 0);
+            worker->wakeArmed = false;
+            continue;
+        }
+        if(cqe->user_data == 0 || cqe->user_data & CRUST_WORKER_RING_POLL)
+        {
+            continue;
+        }
+
+        CRUST_WORKER_CHANNEL * channel = (CRUST_WORKER_CHANNEL *)(uintptr_t)cqe->user_data;
+        channel->inFlight = false;
+        worker->metrics.writes++;
+        if(cqe->res >= 0)
+        {
+            channel->blocked = false;
+            crust_worker_channel_written(worker, channel, (size_t)cqe->res);
+        }
+        else if(cqe->res == -EAGAIN)
+        {
+            channel->blocked = true;
+        }
+        else if(cqe->res != -EINTR && cqe->res != -ECANCELED)
+        {
+            // As with writev(), the daemon loop sees the hangup and closes the channel
+            channel->blocked = false;
+            crust_worker_channel_drop(channel);
+        }
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// crust_worker_thread() for a worker with a ring: each pass submits the new sends and waits in the same system call.
+void * crust_worker_ring_thread(void * argument)
+{
+    CRUST_WORKER * worker = argument;
+    struct io_uring_sqe sqe;
+
+    crust_thread_block_stop_signals();
+
+    for(;;)
+    {
+        pthread_mutex_lock(&worker->lock);
+        worker->wakePending = false;
+
+        // The kernel may still be reading a closed channel's iovecs, so it is only freed once its send has completed
+        size_t i = 0;
+        while(i < worker->channelCount)
+        {
+            CRUST_WORKER_CHANNEL * channel = worker->channels[i];
+            if(channel->closed)
+            {
+                if(channel->inFlight)
+                {
+                    if(!channel->cancelled)
+                    {
+                        crust_worker_ring_cancel(worker, channel);
+                    }
+                    i++;
+                    continue;
+                }
+                crust_worker_channel_drop(channel);
+                close(channel->fd);
+                free(channel);
+                worker->channels[i] = worker->channels[--worker->channelCount];
+                continue;
+            }
+            if(channel->head != NULL && !channel->inFlight)
+            {
+                crust_worker_ring_send(worker, channel);
+            }
+            if(channel->head == NULL && channel->watched)
+            {
+                channel->watched = false;
+                worker->drainedFunction();
+            }
+            i++;
+        }
+
+        if(!worker->wakeArmed)
+        {
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_POLL_ADD;
+            sqe.fd = worker->wakeFDs[0];
+            sqe.poll32_events = POLLIN;
+            sqe.user_data = (u_int64_t)(uintptr_t)worker;
+            crust_worker_ring_queue(worker, &sqe);
+            worker->wakeArmed = true;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        crust_worker_ring_enter(&worker->ring, true);
+
+        pthread_mutex_lock(&worker->lock);
+        crust_worker_ring_reap(worker);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+#endif
+
+void crust_worker_wake(CRUST_WORKER * worker)
+{
+    if(!worker->wakePending)
+    {
+        worker->wakePending = true;
+        write(worker->wakeFDs[1], "", 1);
+    }
+}
+
+/*
+ * Starts a worker. drainedFunction is called on the worker thread and should wake the daemon loop, which can then
+ * look at the channels it was watching.
+ */
+void crust_worker_start(CRUST_WORKER * worker, void (*drainedFunction)(void))
+{
+    worker->drainedFunction = drainedFunction;
+    worker->wakePending = false;
+    worker->channels = NULL;
+    worker->channelCount = 0;
+    worker->metrics.bytesWritten = 0;
+    worker->metrics.writes = 0;
+    crust_histogram_init(&worker->metrics.markedWriteTime);
+
+    void * (*threadFunction)(void *) = crust_worker_thread;
+#ifdef IO_URING
+    worker->wakeArmed = false;
+    if(crust_worker_ring_open(&worker->ring))
+    {
+        threadFunction = crust_worker_ring_thread;
+    }
+#endif
+
+    if(pipe(worker->wakeFDs)
+       || fcntl(worker->wakeFDs[0], F_SETFL, O_NONBLOCK)
+       || fcntl(worker->wakeFDs[1], F_SETFL, O_NONBLOCK)
+       || pthread_mutex_init(&worker->lock, NULL)
+       || pthread_create(&worker->thread, NULL, threadFunction, worker)
+       || pthread_detach(worker->thread))
+    {
+        crust_terminal_print("Failed to start a worker.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Hands a connected socket to a worker to write to. The socket must be non-blocking. Returns NULL if the worker can't
+ * take the socket because it has run out of descriptors to duplicate it with.
+ */
+CRUST_WORKER_CHANNEL * crust_worker_channel_open(CRUST_WORKER * worker, int fd)
+{
+    CRUST_WORKER_CHANNEL * channel = malloc(sizeof(CRUST_WORKER_CHANNEL));
+    if(channel == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    channel->fd = fd;
+#ifdef IO_URING
+    channel->inFlight = false;
+    channel->cancelled = false;
+    // Sends are submitted after the lock is dropped, by which time the daemon may have closed and reused fd
+    if(worker->ring.fd != -1)
+    {
+        channel->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if(channel->fd == -1)
+        {
+            free(channel);
+            return NULL;
+        }
+    }
+#endif
+    channel->worker = worker;
+    channel->head = NULL;
+    channel->tail = NULL;
+    channel->headWritten = 0;
+    channel->queuedBytes = 0;
+    channel->blocked = false;
+    channel->closed = false;
+    channel->watched = false;
+    channel->markedBytes = 0;
+    channel->markedAt = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->channels = realloc(worker->channels, sizeof(CRUST_WORKER_CHANNEL *) * (worker->channelCount + 1));
+    if(worker->channels == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    worker->channels[worker->channelCount++] = channel;
+    pthread_mutex_unlock(&worker->lock);
+
+    return channel;
+}
+
+/*
+ * Queues a reference to the buffer on the channel. Returns how many bytes are waiting to be written to it. Unless
+ * markedAt is 0 the end of the buffer is marked as crust_connection_mark() marks a connection; marking here rather
+ * than after queueing means the worker can't have written the buffer before the mark is set.
+ */
+size_t crust_worker_channel_write(CRUST_WORKER_CHANNEL * channel, CRUST_WORKER_BUFFER * buffer, u_int64_t markedAt)
+{
+    CRUST_WORKER_QUEUE_ENTRY * entry = malloc(sizeof(CRUST_WORKER_QUEUE_ENTRY));
+    if(entry == NULL)
+    {
+        crust_terminal_print("Memory allocation error.");
+        exit(EXIT_FAILURE);
+    }
+    crust_worker_buffer_retain(buffer);
+    entry->buffer = buffer;
+    entry->next = NULL;
+
+    pthread_mutex_lock(&channel->worker->lock);
+    if(channel->tail == NULL)
+    {
+        channel->head = entry;
+    }
+    else
+    {
+        channel->tail->next = entry;
+    }
+    channel->tail = entry;
+    channel->queuedBytes += buffer->length;
+    size_t queuedBytes = channel->queuedBytes;
+    if(markedAt && !channel->markedBytes)
+    {
+        channel->markedBytes = queuedBytes;
+        channel->markedAt = markedAt;
+    }
+    crust_worker_wake(channel->worker);
+    pthread_mutex_unlock(&channel->worker->lock);
+
+    return queuedBytes;
+}
+
+size_t crust_worker_channel_queued_bytes(CRUST_WORKER_CHANNEL * channel)
+{
+    pthread_mutex_lock(&channel->worker->lock);
+    size_t queuedBytes = channel->queuedBytes;
+    pthread_mutex_unlock(&channel->worker->lock);
+    return queuedBytes;
+}
+
+// Asks for the worker's drainedFunction to be called once everything now queued on the channel has been written.
+void crust_worker_channel_watch(CRUST_WORKER_CHANNEL * channel)
+{
+    pthread_mutex_lock(&channel->worker->lock);
+    channel->watched = true;
+    crust_worker_wake(channel->worker);
+    pthread_mutex_unlock(&channel->worker->lock);
+}
+
+/*
+ * Tells the worker to stop writing to the channel and free it. Once this returns the worker will not touch the socket
+ * again, so it can be closed. A worker with a ring writes to its own duplicate of the socket and closes that itself.
+ */
+void crust_worker_channel_close(CRUST_WORKER_CHANNEL * channel)
+{
+    CRUST_WORKER * worker = channel->worker;
+    pthread_mutex_lock(&worker->lock);
+    channel->closed = true;
+    crust_worker_wake(worker);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Copies the worker's metrics, which are changed on the worker thread.
+void crust_worker_metrics(CRUST_WORKER * worker, CRUST_WORKER_METRICS * metrics)
+{
+    pthread_mutex_lock(&worker->lock);
+    *metrics = worker->metrics;
+    pthread_mutex_unlock(&worker->lock);
+}
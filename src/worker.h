@@ -0,0 +1,146 @@
+/******************************************************************************
+ * Consolidated, Realtime Updates on Status of Trains (CRUST)
+ * Copyright (C) 2022-2026 Michael R. Bell <michael@black-dragon.io>
+ *
+ * This file is part of CRUST. For more information, visit
+ * <https://github.com/Sarrus/crust>
+ *
+ * CRUST is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * CRUST is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * CRUST. If not, see <https://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef CRUST_WORKER_H
+#define CRUST_WORKER_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "metrics.h"
+#ifdef IO_URING
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Workers are threads that write to the daemon's clients on its behalf, so that sending each update to hundreds of
+ * listeners is spread across cores while the daemon loop alone reads commands and changes the state. Each client's
+ * socket is given to one worker as a channel. Text is queued on a channel as a reference counted buffer, so an update
+ * sent to every listener is printed once and shared by all of their queues.
+ *
+ * Built with IO_URING, a worker hands its writes to the kernel through an io_uring instead of calling writev() on each
+ * socket poll() finds ready, so one system call submits the writes for every channel and collects those that finished.
+ * Workers fall back to poll() if the kernel can't set up a ring.
+ */
+
+#define CRUST_WORKER_MAX_IOVECS 64 // Buffers written to a channel in one call
+#ifdef IO_URING
+#define CRUST_WORKER_CHANNEL_DESCRIPTORS 2 // A worker with a ring holds its own duplicate of each client's socket
+#else
+#define CRUST_WORKER_CHANNEL_DESCRIPTORS 1
+#endif
+
+#define CRUST_WORKER struct crustWorker
+#define CRUST_WORKER_CHANNEL struct crustWorkerChannel
+#define CRUST_WORKER_BUFFER struct crustWorkerBuffer
+#define CRUST_WORKER_QUEUE_ENTRY struct crustWorkerQueueEntry
+#define CRUST_WORKER_METRICS struct crustWorkerMetrics
+#ifdef IO_URING
+#define CRUST_WORKER_RING struct crustWorkerRing
+#endif
+
+struct crustWorkerBuffer {
+    char * text;
+    size_t length;
+    unsigned int references;
+};
+
+struct crustWorkerQueueEntry {
+    CRUST_WORKER_BUFFER * buffer;
+    CRUST_WORKER_QUEUE_ENTRY * next;
+};
+
+struct crustWorkerChannel {
+    int fd;
+    CRUST_WORKER * worker;
+    CRUST_WORKER_QUEUE_ENTRY * head;
+    CRUST_WORKER_QUEUE_ENTRY * tail;
+    size_t headWritten; // How much of the buffer at the head has already been written
+    size_t queuedBytes;
+    bool blocked; // The socket was full on the last write, so the worker waits for it to drain
+    bool closed; // The daemon has finished with the channel and the worker should free it
+    bool watched; // Whether to call the worker's drainedFunction once everything queued has been written
+    size_t markedBytes; // How much must still be written to reach the mark set by crust_worker_channel_write(), 0 if none
+    u_int64_t markedAt;
+#ifdef IO_URING
+    bool inFlight; // A send has been submitted to the ring and has not completed, so the queue must not be written
+    bool cancelled; // The channel was closed while in flight and the send has been asked to stop
+    struct msghdr message; // Read by the kernel while the send is in flight
+    struct iovec iovecs[CRUST_WORKER_MAX_IOVECS];
+#endif
+};
+
+struct crustWorkerMetrics {
+    u_int64_t bytesWritten;
+    u_int64_t writes; // Calls made to write the queued buffers
+    CRUST_HISTOGRAM markedWriteTime; // Nanoseconds from each mark being set to the write reaching it
+};
+
+#ifdef IO_URING
+// The parts of an io_uring shared with the kernel. Only the worker thread touches them.
+struct crustWorkerRing {
+    int fd; // -1 if the worker is using poll()
+    unsigned int * sqHead;
+    unsigned int * sqTail;
+    unsigned int * sqArray;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    struct io_uring_sqe * sqes;
+    unsigned int * cqHead;
+    unsigned int * cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe * cqes;
+    unsigned int toSubmit; // Entries queued since the last call to io_uring_enter()
+    void * sqMap;
+    size_t sqMapSize;
+    void * cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+};
+#endif
+
+struct crustWorker {
+    pthread_t thread;
+    pthread_mutex_t lock; // Held by the worker while it writes, and by the daemon loop while it queues
+    int wakeFDs[2]; // A pipe that wakes the worker when there is something new to write
+    bool wakePending;
+    CRUST_WORKER_CHANNEL ** channels;
+    size_t channelCount;
+    CRUST_WORKER_METRICS metrics;
+    void (*drainedFunction)(void); // Called on the worker thread when a watched channel has been written out
+#ifdef IO_URING
+    CRUST_WORKER_RING ring;
+    bool wakeArmed; // A poll on the wake pipe is waiting in the ring
+#endif
+};
+
+CRUST_WORKER_BUFFER * crust_worker_buffer_create(char * text, size_t length);
+void crust_worker_buffer_release(CRUST_WORKER_BUFFER * buffer);
+void crust_worker_start(CRUST_WORKER * worker, void (*drainedFunction)(void));
+CRUST_WORKER_CHANNEL * crust_worker_channel_open(CRUST_WORKER * worker, int fd);
+size_t crust_worker_channel_write(CRUST_WORKER_CHANNEL * channel, CRUST_WORKER_BUFFER * buffer, u_int64_t markedAt);
+size_t crust_worker_channel_queued_bytes(CRUST_WORKER_CHANNEL * channel);
+void crust_worker_channel_watch(CRUST_WORKER_CHANNEL * channel);
+void crust_worker_channel_close(CRUST_WORKER_CHANNEL * channel);
+void crust_worker_metrics(CRUST_WORKER * worker, CRUST_WORKER_METRICS * metrics);
+
+#endif //CRUST_WORKER_H